@@ -0,0 +1,148 @@
+#!/bin/sh
+#
+# End to end throughput of scrounge-ntfs on synthetic NTFS images.
+#
+# usage: bench.sh scrounge-ntfs [scenario ...]
+#
+# Each scenario builds an image with mkntfsimg (once, they're kept in
+# the work directory), rescues it and checks the result against the
+# image's manifest. The rescue is timed by runstat, and a line is
+# printed with the records and files per second, the MB/s of file
+# data, and the read and write system calls made per file.
+#
+# The environment can change:
+#   BENCH_DIR     Work directory for images and output (bench-work)
+#   BENCH_SCALE   Multiplies the number of files in each image (1)
+#   BENCH_ARGS    Extra arguments for scrounge-ntfs (eg: -u -w 4)
+#
+
+SCROUNGE=$1
+if [ -z "$SCROUNGE" ]; then
+	echo "usage: bench.sh scrounge-ntfs [scenario ...]" >&2
+	exit 2
+fi
+shift
+
+# The helpers are built next to this script
+BINDIR=`dirname "$0"`
+[ -x "$BINDIR/mkntfsimg" ] || BINDIR=.
+MKNTFSIMG=$BINDIR/mkntfsimg
+RUNSTAT=$BINDIR/runstat
+
+DIR=${BENCH_DIR:-bench-work}
+SCALE=${BENCH_SCALE:-1}
+SCENARIOS=${*:-"small large frag sparse links raw"}
+FAILED=0
+
+case "$SCROUNGE" in
+	/*) ;;
+	*) SCROUNGE=`pwd`/$SCROUNGE ;;
+esac
+
+mkdir -p "$DIR" || exit 1
+
+# name mode(mft|raw) generator-args [scrounge-args]
+image()
+{
+	NAME=$1
+	MODE=$2
+	GENARGS=$3
+	ARGS=$4
+
+	IMG=$DIR/$NAME.img
+	MAN=$DIR/$NAME.man
+	OUT=$DIR/$NAME.out
+
+	# Images are made again when the arguments for them change
+	if [ ! -f "$IMG" -o "`cat "$DIR/$NAME.args" 2>/dev/null`" != "$GENARGS" ]; then
+		"$MKNTFSIMG" $GENARGS "$IMG" "$MAN" > "$DIR/$NAME.gen" || exit 1
+		echo "$GENARGS" > "$DIR/$NAME.args"
+	fi
+
+	RECORDS=`sed -n 's/.* \([0-9]*\) records$/\1/p' "$DIR/$NAME.gen"`
+	END=`wc -c < "$IMG"`
+	END=`expr $END / 512 - 1`
+
+	rm -rf "$OUT" && mkdir "$OUT" || exit 1
+
+	# Files go relative to the output directory, so the image can't be relative
+	case "$IMG" in
+		/*) ;;
+		*) IMG=`pwd`/$IMG ;;
+	esac
+
+	"$RUNSTAT" -o "$DIR/$NAME.stat" "$SCROUNGE" $BENCH_ARGS $ARGS -o "$OUT" \
+		"$IMG" 0 $END > "$DIR/$NAME.log" 2>&1
+
+	if [ $MODE = raw ]; then
+		"$MKNTFSIMG" -R "$MAN" "$OUT" > "$DIR/$NAME.verify" 2>&1
+	else
+		"$MKNTFSIMG" -V "$MAN" "$OUT" > "$DIR/$NAME.verify" 2>&1
+	fi
+
+	if [ $? -eq 0 ]; then
+		RESULT=ok
+	else
+		RESULT=FAILED
+		FAILED=1
+	fi
+
+	awk -v name="$NAME" -v mode="$MODE" -v records="$RECORDS" -v result="$RESULT" '
+		FILENAME ~ /\.man$/ {
+			if($1 == "F") { files++; bytes += $2 }
+			next
+		}
+		{
+			for(i = 1; i <= NF; i++)
+			{
+				split($i, kv, "=")
+				stat[kv[1]] = kv[2]
+			}
+		}
+		END {
+			wall = stat["wall"] > 0 ? stat["wall"] : 0.001
+			printf("%-8s %-4s %8d %7d %8.1f %8.3f %10.0f %8.1f %8.2f  %s\n", name, mode,
+			       records, files, bytes / 1048576, stat["wall"], records / wall,
+			       bytes / 1048576 / wall, (stat["syscr"] + stat["syscw"]) / (files ? files : 1),
+			       result)
+		}' "$MAN" "$DIR/$NAME.stat"
+
+	rm -rf "$OUT"
+}
+
+scale()
+{
+	expr $1 \* $SCALE
+}
+
+printf "%-8s %-4s %8s %7s %8s %8s %10s %8s %8s  %s\n" scenario mode records files \
+	MB seconds records/s MB/s sys/file result
+
+for s in $SCENARIOS; do
+	case $s in
+	small)
+		# Lots of small files, the MFT dominates
+		image small mft "-r 1 -n `scale 20000` -M 16384 -w 400 -d 4 -f 5" ;;
+	large)
+		# Fewer big files, the data copy dominates
+		image large mft "-r 2 -n `scale 100` -m 1048576 -M 16777216 -f 20 -s 0" ;;
+	frag)
+		# Fragmented files and MFT, with attribute lists, read in disk order
+		image frag mft "-r 3 -n `scale 3000` -M 1048576 -f 60 -F -a 10" "-D" ;;
+	sparse)
+		# Many sparse files and hard links
+		image sparse mft "-r 4 -n `scale 2000` -M 4194304 -s 40 -l 20" ;;
+	links)
+		# Small files with a second name, so the names crowd the records
+		image links mft "-r 6 -n `scale 5000` -M 1024 -w 100 -l 50 -u 20" ;;
+	raw)
+		# No boot sectors, so every sector is searched for records. Without
+		# an MFT the attribute lists can't be followed, so there are none
+		image raw raw "-r 5 -n `scale 5000` -M 65536 -a 0 -B" ;;
+	*)
+		echo "bench.sh: unknown scenario: $s" >&2
+		exit 2 ;;
+	esac
+done
+
+exit $FAILED
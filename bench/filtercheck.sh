@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Filter checks with hard links, run by 'make check'.
+#
+# usage: filtercheck.sh
+#
+# Builds an image where some files have a second name, then rescues
+# it with the -e and -p filters. Every name that matches has to be
+# there with the right content, whichever of a file's names it is,
+# and nothing else may be.
+#
+# The environment can change:
+#   SCROUNGE          The scrounge-ntfs to check (../src/scrounge-ntfs)
+#   CHECK_DIR         Work directory for images and output (check-work)
+#
+
+SCROUNGE=${SCROUNGE:-../src/scrounge-ntfs}
+MKNTFSIMG=./mkntfsimg
+
+DIR=${CHECK_DIR:-check-work}
+FAILED=0
+
+for prog in "$SCROUNGE" "$MKNTFSIMG"; do
+	if [ ! -x "$prog" ]; then
+		echo "filtercheck.sh: not built: $prog" >&2
+		exit 1
+	fi
+done
+
+case "$SCROUNGE" in
+	/*) ;;
+	*) SCROUNGE=`pwd`/$SCROUNGE ;;
+esac
+
+mkdir -p "$DIR" || exit 1
+
+case "$DIR" in
+	/*) IMG=$DIR/links.img ;;
+	*) IMG=`pwd`/$DIR/links.img ;;
+esac
+MAN=$DIR/links.man
+OUT=$DIR/links.out
+
+"$MKNTFSIMG" -r 21 -n 300 -l 15 -w 20 "$IMG" "$MAN" > "$DIR/links.gen" || exit 1
+END=`wc -c < "$IMG"`
+END=`expr $END / 512 - 1`
+
+# name filter-args awk-condition-on-path
+check()
+{
+	NAME=$1
+	ARGS=$2
+	COND=$3
+
+	rm -rf "$OUT" && mkdir "$OUT" || exit 1
+
+	if ! "$SCROUNGE" $ARGS -o "$OUT" "$IMG" 0 $END > "$DIR/$NAME.log" 2>&1; then
+		echo "FAIL: $NAME: scrounge-ntfs failed, see $DIR/$NAME.log"
+		FAILED=1
+		return
+	fi
+
+	# Files and links that match, and only those
+	awk -F '	' '($1 == "F" || $1 == "L") && '"$COND" "$MAN" > "$DIR/$NAME.man"
+	cut -f 5 "$DIR/$NAME.man" | sort > "$DIR/$NAME.want"
+	(cd "$OUT" && find . -type f | sed 's|^\./||' | sort) > "$DIR/$NAME.got"
+
+	if [ ! -s "$DIR/$NAME.want" ] || ! grep -q '^L' "$DIR/$NAME.man"; then
+		echo "FAIL: $NAME: nothing with links matches, the check is no good"
+		FAILED=1
+	elif ! diff "$DIR/$NAME.want" "$DIR/$NAME.got" > "$DIR/$NAME.diff"; then
+		echo "FAIL: $NAME: the wrong names were rescued, see $DIR/$NAME.diff"
+		FAILED=1
+	elif ! "$MKNTFSIMG" -V "$DIR/$NAME.man" "$OUT" > "$DIR/$NAME.verify" 2>&1; then
+		echo "FAIL: $NAME: rescued files are wrong, see $DIR/$NAME.verify"
+		FAILED=1
+	else
+		echo "PASS: $NAME: `wc -l < "$DIR/$NAME.want"` names"
+	fi
+}
+
+check extensions "-e pst,doc" '$5 ~ /\.(pst|doc)$/'
+check path "-p dir0000/*" '$5 ~ /^dir0000\//'
+
+rm -rf "$OUT"
+exit $FAILED
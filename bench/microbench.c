@@ -0,0 +1,533 @@
+/*
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ *
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+/*
+ * microbench times the parsing functions scrounge spends its time in,
+ * one at a time, over the MFT of a real or synthetic NTFS image. The
+ * records, names, data runs and extents are loaded from the image up
+ * front, so only the function being measured is timed.
+ *
+ * Each benchmark is run over all of its input until enough time has
+ * passed, then the time and allocations per call are printed. The
+ * allocations are the ones memref counts, which are the objects the
+ * parsing makes. Other memory, such as the array of locks, isn't.
+ */
+
+#define _LARGEFILE_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include "usuals.h"
+#include "ntfs.h"
+#include "ntfsx.h"
+#include "locks.h"
+#include "device.h"
+#include "scrounge.h"
+#include "memref.h"
+
+#include <time.h>
+#include <err.h>
+
+/* Most MFT records loaded from the image */
+#define kBench_MaxRecords   0x10000
+
+/* Default time each benchmark runs for (in milliseconds) */
+#define kBench_Time         250
+
+typedef struct _benchdata
+{
+  partitioninfo pi;
+  ntfsx_mftmap map;
+  uint32 size;                /* Size of a record */
+
+  /* The records, as on the disk and then after fixups */
+  byte* raw;
+  ntfsx_record** records;
+  uint32 numRecords;
+
+  /* Non resident data attributes */
+  ntfsx_attribute** attribs;
+  uint32 numAttribs;
+
+  /* File names, in the records they came from */
+  ntfs_attribfilename** names;
+  uint32 numNames;
+
+  /* Where file data is, as pairs of sectors */
+  uint64* extents;
+  uint32 numExtents;
+  drivelocks locks;
+
+  /* MFT indexes in a random order */
+  uint64* shuffled;
+  uint64 numShuffled;
+}
+benchdata;
+
+typedef uint64 (*benchfunc)(benchdata* data);
+
+#ifdef _DEBUG
+bool g_verifyMode = false;
+#endif
+
+/* Allocations of records, attributes, enumerators, data runs and blocks */
+static uint64 allocs()
+{
+  return memref_counts(kMemRef_Total)->allocs;
+}
+
+static uint64 now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static void addArray(void** array, uint32* count, void* item)
+{
+  if((*count & 0x3FF) == 0)
+    *array = realloc(*array, (*count + 0x400) * sizeof(void*));
+  ((void**)*array)[(*count)++] = item;
+}
+
+static void loadRecord(benchdata* data, uint64 sector)
+{
+  ntfsx_attrib_enum* attrenum;
+  ntfsx_attribute* attr;
+  ntfsx_datarun* datarun;
+  ntfs_recordheader* header;
+  ntfs_attribfilename* filename;
+  ntfsx_record* record;
+  byte* raw = data->raw + (data->numRecords * data->size);
+  static const byte kRecMagic[] = { 'F', 'I', 'L', 'E' };
+
+  if(device_read(data->pi.device, false, SECTOR_TO_BYTES(sector), raw, data->size)
+        != (int)data->size)
+    return;
+
+  header = (ntfs_recordheader*)raw;
+  if(memcmp(kRecMagic, raw, sizeof(kRecMagic)) || !(header->flags & kNTFS_RecFlagUse))
+    return;
+
+  record = ntfsx_record_alloc(&(data->pi));
+  if(!ntfsx_record_read(record, sector, data->pi.device))
+  {
+    ntfsx_record_free(record);
+    return;
+  }
+
+  data->records[data->numRecords++] = record;
+
+  attrenum = ntfsx_attrib_enum_alloc(kNTFS_FILENAME, true);
+  while((attr = ntfsx_attrib_enum_inline(attrenum, record)) != NULL)
+  {
+    if(!ntfsx_attribute_header(attr)->bNonResident)
+    {
+      filename = (ntfs_attribfilename*)ntfsx_attribute_getresidentdata(attr);
+      addArray((void**)&(data->names), &(data->numNames), filename);
+    }
+
+    /* The name points into the record, which is kept */
+    ntfsx_attribute_free(attr);
+  }
+  ntfsx_attrib_enum_free(attrenum);
+
+  /* These can be in other records, the attribute keeps hold of them */
+  attrenum = ntfsx_attrib_enum_alloc(kNTFS_DATA, true);
+  while((attr = ntfsx_attrib_enum_all(attrenum, record)) != NULL)
+  {
+    if(!ntfsx_attribute_header(attr)->bNonResident)
+    {
+      ntfsx_attribute_free(attr);
+      continue;
+    }
+
+    addArray((void**)&(data->attribs), &(data->numAttribs), attr);
+
+    datarun = ntfsx_attribute_getdatarun(attr);
+    if(datarun && ntfsx_datarun_first(datarun))
+    {
+      do
+      {
+        if(datarun->sparse)
+          continue;
+
+        if((data->numExtents & 0x1FF) == 0)
+          data->extents = (uint64*)realloc(data->extents,
+                              (data->numExtents + 0x200) * 2 * sizeof(uint64));
+        data->extents[data->numExtents * 2] = CLUSTER_TO_SECTOR(data->pi, datarun->cluster);
+        data->extents[(data->numExtents * 2) + 1] =
+                  CLUSTER_TO_SECTOR(data->pi, datarun->cluster + datarun->length);
+        data->numExtents++;
+      }
+      while(ntfsx_datarun_next(datarun));
+    }
+
+    if(datarun)
+      ntfsx_datarun_free(datarun);
+  }
+  ntfsx_attrib_enum_free(attrenum);
+}
+
+static void loadImage(benchdata* data, const char* image, uint64 first, uint64 end)
+{
+  ntfsx_record* record;
+  uint64 length;
+  uint64 sector;
+  uint64 i, j, t;
+  bool direct = false;
+
+  memset(data, 0, sizeof(*data));
+  device_defaults(&(data->pi.io));
+
+  data->pi.device = device_open(image, &direct);
+  data->pi.first = first;
+  data->pi.end = end;
+
+  if(!scroungeDetect(&(data->pi)))
+    errx(1, "couldn't find the partition in: %s", image);
+
+  data->size = RECORD_SIZE(data->pi);
+
+  record = ntfsx_record_alloc(&(data->pi));
+  if(!ntfsx_record_read(record, data->pi.mft + data->pi.first, data->pi.device))
+    errx(1, "couldn't read the mft");
+
+  ntfsx_mftmap_init(&(data->map), &(data->pi));
+  if(!ntfsx_mftmap_load(&(data->map), record, data->pi.device))
+    errx(1, "couldn't load the mft");
+  ntfsx_record_free(record);
+
+  /* Attribute lists need it to find the other records */
+  data->pi.mftmap = &(data->map);
+
+  length = min(ntfsx_mftmap_length(&(data->map)), kBench_MaxRecords);
+  data->raw = (byte*)malloc(length * data->size);
+  data->records = (ntfsx_record**)malloc(length * sizeof(ntfsx_record*));
+
+  for(i = 0; i < length; i++)
+  {
+    sector = ntfsx_mftmap_sectorforindex(&(data->map), i);
+    if(sector != kInvalidSector)
+      loadRecord(data, sector);
+  }
+
+  if(data->numRecords == 0)
+    errx(1, "no records found in: %s", image);
+
+  /* The same shuffle every time, so that runs compare */
+  data->numShuffled = ntfsx_mftmap_length(&(data->map));
+  data->shuffled = (uint64*)malloc(data->numShuffled * sizeof(uint64));
+  for(i = 0; i < data->numShuffled; i++)
+    data->shuffled[i] = i;
+  for(i = data->numShuffled - 1, j = 1; i > 0; i--)
+  {
+    j = (j * 1103515245 + 12345) & 0x7FFFFFFF;
+    t = data->shuffled[i];
+    data->shuffled[i] = data->shuffled[j % (i + 1)];
+    data->shuffled[j % (i + 1)] = t;
+  }
+
+  for(i = 0; i < data->numExtents; i++)
+    addLocationLock(&(data->locks), data->extents[i * 2], data->extents[(i * 2) + 1]);
+
+  fprintf(stderr, "[Loaded %u records, %u names, %u data runs, %u extents]\n",
+          data->numRecords, data->numNames, data->numAttribs, data->numExtents);
+}
+
+/* ------------------------------------------------------------------------
+ * The benchmarks. Each goes once over its input and returns the calls made
+ */
+
+/* Includes copying the record, since fixups change it */
+static uint64 benchFixups(benchdata* data)
+{
+  byte buf[0x1000];
+  uint32 size = min(data->size, sizeof(buf));
+  uint32 i;
+
+  for(i = 0; i < data->numRecords; i++)
+  {
+    memcpy(buf, data->raw + (i * data->size), size);
+    if(!ntfs_dofixups(buf, size))
+      errx(1, "fixups failed on a valid record");
+  }
+
+  return data->numRecords;
+}
+
+static uint64 benchFindAttribute(benchdata* data)
+{
+  ntfs_recordheader* header;
+  ntfs_attribheader* attrhead;
+  uint64 ops = 0;
+  byte* end;
+  uint32 i;
+
+  for(i = 0; i < data->numRecords; i++)
+  {
+    header = ntfsx_record_header(data->records[i]);
+    end = (byte*)header + data->size;
+
+    attrhead = ntfs_findattribute(header, kNTFS_DATA, end);
+    ops++;
+
+    while(attrhead)
+    {
+      attrhead = ntfs_nextattribute(attrhead, kNTFS_DATA, end);
+      ops++;
+    }
+  }
+
+  return ops;
+}
+
+static uint64 benchAttribEnum(benchdata* data)
+{
+  ntfsx_attrib_enum* attrenum;
+  ntfsx_attribute* attr;
+  uint32 i;
+
+  for(i = 0; i < data->numRecords; i++)
+  {
+    attrenum = ntfsx_attrib_enum_alloc(kNTFS_DATA, true);
+    while((attr = ntfsx_attrib_enum_all(attrenum, data->records[i])) != NULL)
+      ntfsx_attribute_free(attr);
+    ntfsx_attrib_enum_free(attrenum);
+  }
+
+  return data->numRecords;
+}
+
+/* A call is one run, the allocation is once per attribute */
+static uint64 benchDatarun(benchdata* data)
+{
+  ntfsx_datarun* datarun;
+  uint64 ops = 0;
+  uint32 i;
+
+  for(i = 0; i < data->numAttribs; i++)
+  {
+    datarun = ntfsx_attribute_getdatarun(data->attribs[i]);
+    if(!datarun)
+      continue;
+
+    if(ntfsx_datarun_first(datarun))
+    {
+      ops++;
+      while(ntfsx_datarun_next(datarun))
+        ops++;
+    }
+
+    ntfsx_datarun_free(datarun);
+  }
+
+  return ops;
+}
+
+static uint64 benchMftmapSequential(benchdata* data)
+{
+  uint64 length = ntfsx_mftmap_length(&(data->map));
+  uint64 sum = 0;
+  uint64 i;
+
+  for(i = 0; i < length; i++)
+    sum += ntfsx_mftmap_sectorforindex(&(data->map), i);
+
+  /* Keep the compiler from leaving it out */
+  if(sum == 1)
+    fprintf(stderr, " ");
+
+  return length;
+}
+
+static uint64 benchMftmapRandom(benchdata* data)
+{
+  uint64 sum = 0;
+  uint64 i;
+
+  for(i = 0; i < data->numShuffled; i++)
+    sum += ntfsx_mftmap_sectorforindex(&(data->map), data->shuffled[i]);
+
+  if(sum == 1)
+    fprintf(stderr, " ");
+
+  return data->numShuffled;
+}
+
+static uint64 benchAddLock(benchdata* data)
+{
+  drivelocks locks;
+  uint32 i;
+
+  memset(&locks, 0, sizeof(locks));
+
+  for(i = 0; i < data->numExtents; i++)
+    addLocationLock(&locks, data->extents[i * 2], data->extents[(i * 2) + 1]);
+
+  if(locks._locks)
+    free(locks._locks);
+
+  return data->numExtents;
+}
+
+/* Goes over the partition the way a raw search does */
+static uint64 benchCheckLock(benchdata* data)
+{
+  uint64 ops = 0;
+  uint64 locked;
+  uint64 sec;
+
+  for(sec = data->pi.first; sec < data->pi.end; ops++)
+  {
+    locked = checkLocationLock(&(data->locks), sec);
+    sec += locked ? locked : 1;
+  }
+
+  return ops;
+}
+
+static uint64 benchTranscode(benchdata* data)
+{
+  ntfs_attribfilename* filename;
+  char buf[MAX_PATH + 1];
+  uint32 i;
+
+  for(i = 0; i < data->numNames; i++)
+  {
+    filename = data->names[i];
+    unicode_transcode16to8((ntfs_char*)(filename + 1), filename->cFileName,
+                           buf, sizeof(buf));
+  }
+
+  return data->numNames;
+}
+
+static void run(benchdata* data, const char* name, benchfunc func, uint64 time)
+{
+  uint64 start, elapsed;
+  uint64 before;
+  uint64 ops = 0;
+
+  /* Once to warm up, and check there's something to do */
+  if(func(data) == 0)
+  {
+    printf("%-32s %12s\n", name, "no input");
+    return;
+  }
+
+  before = allocs();
+  start = now();
+
+  do
+  {
+    ops += func(data);
+    elapsed = now() - start;
+  }
+  while(elapsed < time);
+
+  printf("%-32s %12llu %10.1f %10.2f\n", name, (unsigned long long)ops,
+         (double)elapsed / (double)ops, (double)(allocs() - before) / (double)ops);
+}
+
+static void usage()
+{
+  fprintf(stderr, "usage: microbench [-t ms] [-b benchmark] image [start end]\n");
+  exit(2);
+}
+
+int main(int argc, char* argv[])
+{
+  benchdata data;
+  const char* only = NULL;
+  uint64 time = kBench_Time;
+  uint64 first = 0;
+  uint64 end;
+  int64 size;
+  int ch;
+  int fd;
+  uint32 i;
+
+  static const struct
+  {
+    const char* name;
+    benchfunc func;
+  }
+  benchmarks[] =
+  {
+    { "ntfs_dofixups", benchFixups },
+    { "ntfs_findattribute", benchFindAttribute },
+    { "ntfsx_attrib_enum_all", benchAttribEnum },
+    { "ntfsx_datarun_next", benchDatarun },
+    { "ntfsx_mftmap_sectorforindex", benchMftmapSequential },
+    { "ntfsx_mftmap_sectorforindex/rnd", benchMftmapRandom },
+    { "addLocationLock", benchAddLock },
+    { "checkLocationLock", benchCheckLock },
+    { "unicode_transcode16to8", benchTranscode },
+  };
+
+  while((ch = getopt(argc, argv, "b:t:")) != -1)
+  {
+    switch(ch)
+    {
+    case 'b':
+      only = optarg;
+      break;
+    case 't':
+      time = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      usage();
+    }
+  }
+
+  argc -= optind;
+  argv += optind;
+
+  if(argc != 1 && argc != 3)
+    usage();
+
+  /* Without a partition the whole image is used */
+  if(argc == 3)
+  {
+    first = strtoull(argv[1], NULL, 10);
+    end = strtoull(argv[2], NULL, 10);
+  }
+  else
+  {
+    fd = open(argv[0], O_RDONLY | OPEN_LARGE_OPTS);
+    if(fd == -1)
+      err(1, "couldn't open image: %s", argv[0]);
+    size = lseek(fd, 0, SEEK_END);
+    close(fd);
+
+    end = (size / kSectorSize) - 1;
+  }
+
+  loadImage(&data, argv[0], first, end);
+
+  printf("%-32s %12s %10s %10s\n", "benchmark", "calls", "ns/call", "allocs/call");
+
+  for(i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++)
+  {
+    if(!only || !strcmp(only, benchmarks[i].name))
+      run(&data, benchmarks[i].name, benchmarks[i].func, time * 1000000);
+  }
+
+  return 0;
+}
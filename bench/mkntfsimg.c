@@ -0,0 +1,1437 @@
+/*
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ *
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+/*
+ * mkntfsimg builds synthetic NTFS images for exercising scrounge-ntfs
+ * without needing a Windows machine. It deliberately does not share
+ * any structures or parsing code with scrounge itself, so that it can
+ * act as an independent oracle.
+ *
+ * The images contain only what scrounge looks at: boot sectors, an MFT
+ * (optionally fragmented) with its mirror, and FILE records carrying
+ * $STANDARD_INFORMATION, $FILE_NAME, $ATTRIBUTE_LIST and $DATA. Index
+ * allocations and bitmaps are not generated.
+ *
+ * Alongside the image a manifest is written describing every file and
+ * directory. The same program can then verify an extracted tree against
+ * that manifest.
+ */
+
+#define _LARGEFILE_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/stat.h>
+#include <math.h>
+#include <dirent.h>
+
+#define SECTOR          512
+#define RECLEN          1024
+#define RECSECS         (RECLEN / SECTOR)
+#define MAX_RUNS        64
+#define MAX_NAME        64
+
+#define ATTR_STDINFO    0x10
+#define ATTR_LIST       0x20
+#define ATTR_FILENAME   0x30
+#define ATTR_DATA       0x80
+
+#define FLAG_READONLY   0x0001
+#define FLAG_HIDDEN     0x0002
+#define FLAG_SYSTEM     0x0004
+#define FLAG_ARCHIVE    0x0020
+#define FLAG_DIRECTORY  0x10000000
+
+/* Seconds between 1601 and 1970 */
+#define EPOCH_DIFF      11644473600ULL
+
+typedef struct _run
+{
+  uint64_t vcn;
+  uint64_t lcn;
+  uint64_t len;
+  int sparse;
+}
+run;
+
+typedef struct _node
+{
+  uint32_t rec;               /* MFT record number */
+  uint32_t parent;            /* Parent directory record */
+  int dir;
+  char name[MAX_NAME];        /* UTF-8 */
+  int dosname;                /* Add a DOS namespace name too */
+  uint32_t flags;             /* NTFS file attributes */
+  uint64_t time;              /* unix time */
+
+  uint64_t size;              /* Real size of data */
+  uint64_t init;              /* Initialized size of data */
+  run runs[MAX_RUNS];
+  int nruns;
+
+  int attrlist;               /* Data lives in extension records */
+  uint32_t ext[2];
+
+  int haslink;                /* A second hard link name */
+  uint32_t linkparent;
+  char linkname[MAX_NAME];
+
+  uint64_t seed;
+}
+node;
+
+/* Options */
+static uint32_t g_spc = 8;
+static uint32_t g_files = 200;
+static uint64_t g_minsize = 0;
+static uint64_t g_maxsize = 256 * 1024;
+static uint32_t g_depth = 3;
+static uint32_t g_dirs = 20;
+static uint32_t g_frag = 10;
+static uint32_t g_sparse = 5;
+static uint32_t g_attrlist = 3;
+static uint32_t g_links = 0;
+static uint32_t g_unicode = 0;
+static int g_dupnames = 0;
+static int g_fragmft = 0;
+static int g_noboot = 0;
+static const char* g_table = "none";
+static uint64_t g_seed = 1;
+
+static int g_fd = -1;
+static uint64_t g_volfirst = 0;     /* First sector of volume in image */
+static uint64_t g_clusbytes;
+static uint64_t g_nextlcn;
+
+static node* g_nodes = NULL;
+static uint32_t g_nnodes = 0;
+static uint32_t g_nrecs = 0;
+
+static run g_mftruns[2];
+static int g_nmftruns = 0;
+static uint64_t g_mirrlcn = 0;
+
+/* ------------------------------------------------------------------------
+ * Random numbers and file content
+ */
+
+static uint64_t splitmix(uint64_t x)
+{
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+static uint64_t g_rand = 0;
+
+static uint64_t rnd(void)
+{
+  g_rand = splitmix(g_rand);
+  return g_rand;
+}
+
+static uint64_t rndrange(uint64_t lo, uint64_t hi)
+{
+  if(hi <= lo)
+    return lo;
+  return lo + rnd() % (hi - lo + 1);
+}
+
+static int percent(uint32_t pc)
+{
+  return (rnd() % 100) < pc;
+}
+
+static int insparse(node* n, uint64_t off)
+{
+  uint64_t vcn = off / g_clusbytes;
+  int i;
+
+  if(off >= n->init)
+    return 1;
+
+  for(i = 0; i < n->nruns; i++)
+  {
+    if(vcn >= n->runs[i].vcn && vcn < n->runs[i].vcn + n->runs[i].len)
+      return n->runs[i].sparse;
+  }
+
+  return 0;
+}
+
+/* Fill buf with file content at off. off and len multiples of 8 */
+static void content(node* n, uint64_t off, unsigned char* buf, size_t len)
+{
+  size_t i;
+  uint64_t v;
+
+  for(i = 0; i < len; i += 8)
+  {
+    if(n->nruns && insparse(n, off + i))
+      v = 0;
+    else
+      v = splitmix(n->seed ^ ((off + i) * 0x9E3779B97F4A7C15ULL));
+
+    if(!n->nruns && off + i >= n->init)
+      v = 0;
+
+    memcpy(buf + i, &v, len - i < 8 ? len - i : 8);
+  }
+}
+
+static uint64_t fnv(uint64_t h, const unsigned char* data, size_t len)
+{
+  size_t i;
+  for(i = 0; i < len; i++)
+  {
+    h ^= data[i];
+    h *= 0x100000001B3ULL;
+  }
+  return h;
+}
+
+#define FNV_INIT 0xCBF29CE484222325ULL
+
+static uint64_t contenthash(node* n)
+{
+  unsigned char buf[65536];
+  uint64_t h = FNV_INIT;
+  uint64_t off;
+  size_t num;
+
+  for(off = 0; off < n->size; off += num)
+  {
+    num = sizeof(buf);
+    if(n->size - off < num)
+      num = (size_t)(n->size - off);
+    content(n, off, buf, (num + 7) & ~7);
+    h = fnv(h, buf, num);
+  }
+
+  return h;
+}
+
+/* ------------------------------------------------------------------------
+ * Low level writing
+ */
+
+static void pwriteall(const void* buf, size_t len, uint64_t off)
+{
+  ssize_t r;
+  const unsigned char* p = buf;
+
+  while(len > 0)
+  {
+    r = pwrite(g_fd, p, len, (off_t)off);
+    if(r < 0)
+      err(1, "couldn't write image");
+    p += r;
+    len -= r;
+    off += r;
+  }
+}
+
+static void writecluster(uint64_t lcn, const void* buf, size_t len)
+{
+  pwriteall(buf, len, (g_volfirst * SECTOR) + lcn * g_clusbytes);
+}
+
+static void put16(unsigned char* p, uint16_t v) { memcpy(p, &v, 2); }
+static void put32(unsigned char* p, uint32_t v) { memcpy(p, &v, 4); }
+static void put64(unsigned char* p, uint64_t v) { memcpy(p, &v, 8); }
+
+static uint64_t ntfstime(uint64_t t)
+{
+  return (t + EPOCH_DIFF) * 10000000ULL;
+}
+
+/* Encode UTF-8 to UTF-16LE, returns number of 16 bit units */
+static int utf16(const char* s, uint16_t* out, int max)
+{
+  const unsigned char* c = (const unsigned char*)s;
+  uint32_t cp;
+  int n = 0;
+
+  while(*c && n < max - 1)
+  {
+    if(*c < 0x80)
+      cp = *c++;
+    else if((*c & 0xE0) == 0xC0)
+    {
+      cp = ((c[0] & 0x1F) << 6) | (c[1] & 0x3F);
+      c += 2;
+    }
+    else if((*c & 0xF0) == 0xE0)
+    {
+      cp = ((c[0] & 0x0F) << 12) | ((c[1] & 0x3F) << 6) | (c[2] & 0x3F);
+      c += 3;
+    }
+    else
+    {
+      cp = ((c[0] & 0x07) << 18) | ((c[1] & 0x3F) << 12) |
+           ((c[2] & 0x3F) << 6) | (c[3] & 0x3F);
+      c += 4;
+    }
+
+    if(cp >= 0x10000)
+    {
+      cp -= 0x10000;
+      out[n++] = (uint16_t)(0xD800 | (cp >> 10));
+      out[n++] = (uint16_t)(0xDC00 | (cp & 0x3FF));
+    }
+    else
+    {
+      out[n++] = (uint16_t)cp;
+    }
+  }
+
+  return n;
+}
+
+/* ------------------------------------------------------------------------
+ * MFT record building
+ */
+
+typedef struct _record
+{
+  unsigned char data[RECLEN];
+  uint32_t pos;
+  uint16_t nextid;
+}
+record;
+
+static void rec_init(record* r, uint32_t num, uint16_t flags, uint32_t base)
+{
+  memset(r->data, 0, RECLEN);
+  memcpy(r->data, "FILE", 4);
+  put16(r->data + 0x04, 0x30);            /* offUpdSeq */
+  put16(r->data + 0x06, 1 + RECSECS);     /* cwUpdSeq */
+  put16(r->data + 0x10, 1);               /* seqNum */
+  put16(r->data + 0x12, 1);               /* cHardlinks */
+  put16(r->data + 0x14, 0x38);            /* offAttrs */
+  put16(r->data + 0x16, flags);
+  put32(r->data + 0x1C, RECLEN);          /* cbAllocated */
+  if(base)
+    put64(r->data + 0x20, (uint64_t)base | (1ULL << 48));
+  put32(r->data + 0x2C, num);             /* recordNum */
+  r->pos = 0x38;
+  r->nextid = 0;
+}
+
+static unsigned char* rec_resident(record* r, uint32_t type, uint32_t len)
+{
+  uint32_t total = (0x18 + len + 7) & ~7;
+  unsigned char* a = r->data + r->pos;
+
+  if(r->pos + total + 8 > RECLEN)
+    errx(1, "record overflow");
+
+  put32(a + 0x00, type);
+  put32(a + 0x04, total);
+  a[0x08] = 0;
+  put16(a + 0x0A, 0x18);
+  put16(a + 0x0E, r->nextid++);
+  put32(a + 0x10, len);
+  put16(a + 0x14, 0x18);
+  if(type == ATTR_FILENAME)
+    a[0x16] = 1;
+
+  r->pos += total;
+  return a + 0x18;
+}
+
+static int encoderuns(unsigned char* out, run* runs, int nruns)
+{
+  int64_t prev = 0;
+  int64_t delta;
+  int pos = 0;
+  int i, lb, ob;
+  uint64_t len;
+
+  for(i = 0; i < nruns; i++)
+  {
+    len = runs[i].len;
+    for(lb = 1; lb < 8 && (len >> (lb * 8)) != 0; lb++)
+      ;
+
+    if(runs[i].sparse)
+    {
+      out[pos++] = (unsigned char)lb;
+      memcpy(out + pos, &len, lb);
+      pos += lb;
+      continue;
+    }
+
+    delta = (int64_t)runs[i].lcn - prev;
+    prev = (int64_t)runs[i].lcn;
+
+    for(ob = 1; ob < 8; ob++)
+    {
+      int64_t lim = (int64_t)1 << (ob * 8 - 1);
+      if(delta >= -lim && delta < lim)
+        break;
+    }
+
+    out[pos++] = (unsigned char)((ob << 4) | lb);
+    memcpy(out + pos, &len, lb);
+    pos += lb;
+    memcpy(out + pos, &delta, ob);
+    pos += ob;
+  }
+
+  out[pos++] = 0;
+  return pos;
+}
+
+static void rec_nonresident(record* r, uint32_t type, run* runs, int nruns,
+                            uint64_t startvcn, uint64_t alloc, uint64_t size,
+                            uint64_t init)
+{
+  unsigned char buf[MAX_RUNS * 20];
+  unsigned char* a = r->data + r->pos;
+  uint64_t lastvcn;
+  int rlen, i;
+  uint32_t total;
+
+  rlen = encoderuns(buf, runs, nruns);
+  total = (0x40 + rlen + 7) & ~7;
+
+  if(r->pos + total + 8 > RECLEN)
+    errx(1, "record overflow");
+
+  lastvcn = startvcn;
+  for(i = 0; i < nruns; i++)
+    lastvcn += runs[i].len;
+
+  put32(a + 0x00, type);
+  put32(a + 0x04, total);
+  a[0x08] = 1;
+  put16(a + 0x0A, 0x40);
+  put16(a + 0x0E, r->nextid++);
+  put64(a + 0x10, startvcn);
+  put64(a + 0x18, lastvcn - 1);
+  put16(a + 0x20, 0x40);
+  put64(a + 0x28, alloc);
+  put64(a + 0x30, size);
+  put64(a + 0x38, init);
+  memcpy(a + 0x40, buf, rlen);
+
+  r->pos += total;
+}
+
+static void rec_stdinfo(record* r, uint64_t t, uint32_t flags)
+{
+  unsigned char* d = rec_resident(r, ATTR_STDINFO, 0x48);
+  uint64_t nt = ntfstime(t);
+  put64(d + 0x00, nt);
+  put64(d + 0x08, nt);
+  put64(d + 0x10, nt);
+  put64(d + 0x18, nt);
+  put32(d + 0x20, flags);
+}
+
+static void rec_filename(record* r, uint32_t parent, const char* name,
+                         int ns, uint64_t t, uint32_t flags, uint64_t size)
+{
+  uint16_t wide[MAX_NAME * 2];
+  int len = utf16(name, wide, MAX_NAME * 2);
+  unsigned char* d = rec_resident(r, ATTR_FILENAME, 0x42 + len * 2);
+  uint64_t nt = ntfstime(t);
+
+  put64(d + 0x00, (uint64_t)parent | (1ULL << 48));
+  put64(d + 0x08, nt);
+  put64(d + 0x10, nt);
+  put64(d + 0x18, nt);
+  put64(d + 0x20, nt);
+  put64(d + 0x28, (size + g_clusbytes - 1) / g_clusbytes * g_clusbytes);
+  put64(d + 0x30, size);
+  put32(d + 0x38, flags);
+  d[0x40] = (unsigned char)len;
+  d[0x41] = (unsigned char)ns;
+  memcpy(d + 0x42, wide, len * 2);
+}
+
+static unsigned char* rec_attrlist(record* r, int entries)
+{
+  return rec_resident(r, ATTR_LIST, entries * 0x20);
+}
+
+static void attrlist_entry(unsigned char* e, uint32_t type, uint64_t vcn,
+                           uint32_t rec, uint16_t id)
+{
+  memset(e, 0, 0x20);
+  put32(e + 0x00, type);
+  put16(e + 0x04, 0x20);
+  e[0x07] = 0x1A;
+  put64(e + 0x08, vcn);
+  put64(e + 0x10, (uint64_t)rec | (1ULL << 48));
+  put16(e + 0x18, id);
+}
+
+static void rec_finish(record* r)
+{
+  uint16_t usn = (uint16_t)(0x0100 + (rnd() & 0xFF));
+  int i;
+
+  put32(r->data + r->pos, 0xFFFFFFFF);
+  put32(r->data + 0x18, r->pos + 8);      /* cbRecord */
+  put16(r->data + 0x28, r->nextid);
+
+  /* Fixups */
+  put16(r->data + 0x30, usn);
+  for(i = 0; i < RECSECS; i++)
+  {
+    memcpy(r->data + 0x32 + i * 2, r->data + (i + 1) * SECTOR - 2, 2);
+    put16(r->data + (i + 1) * SECTOR - 2, usn);
+  }
+}
+
+static uint64_t recoffset(uint32_t num)
+{
+  uint64_t off = (uint64_t)num * RECLEN;
+  int i;
+
+  for(i = 0; i < g_nmftruns; i++)
+  {
+    if(off < g_mftruns[i].len * g_clusbytes)
+      return (g_volfirst * SECTOR) + g_mftruns[i].lcn * g_clusbytes + off;
+    off -= g_mftruns[i].len * g_clusbytes;
+  }
+
+  errx(1, "record outside of mft: %u", num);
+  return 0;
+}
+
+static void rec_write(record* r, uint32_t num)
+{
+  pwriteall(r->data, RECLEN, recoffset(num));
+
+  /* The first four records go into the mirror too */
+  if(num < 4)
+    pwriteall(r->data, RECLEN, (g_volfirst * SECTOR) +
+              g_mirrlcn * g_clusbytes + (uint64_t)num * RECLEN);
+}
+
+/* ------------------------------------------------------------------------
+ * Allocation
+ */
+
+static uint64_t alloc_clusters(uint64_t count)
+{
+  uint64_t lcn = g_nextlcn;
+  g_nextlcn += count;
+  return lcn;
+}
+
+static void layout_data(node* n)
+{
+  uint64_t clusters = (n->size + g_clusbytes - 1) / g_clusbytes;
+  uint64_t vcn = 0;
+  uint64_t len, remain;
+  int pieces, i, j;
+  run tmp;
+
+  n->nruns = 0;
+  if(clusters == 0)
+    return;
+
+  pieces = 1;
+  if(clusters > 1 && percent(g_frag))
+    pieces = (int)rndrange(2, clusters < 8 ? clusters : 8);
+
+  remain = clusters;
+  for(i = 0; i < pieces; i++)
+  {
+    len = (i == pieces - 1) ? remain : rndrange(1, remain - (pieces - i - 1));
+    remain -= len;
+
+    n->runs[n->nruns].vcn = vcn;
+    n->runs[n->nruns].len = len;
+    n->runs[n->nruns].sparse = (pieces > 1 && i > 0 && percent(g_sparse * 4));
+    n->runs[n->nruns].lcn = 0;
+    if(!n->runs[n->nruns].sparse)
+    {
+      n->runs[n->nruns].lcn = alloc_clusters(len);
+
+      /* Leave a gap so that the pieces really are fragmented */
+      if(pieces > 1)
+        alloc_clusters(rndrange(1, 16));
+    }
+
+    vcn += len;
+    n->nruns++;
+  }
+
+  /* Move fragments around so some have negative offsets */
+  if(pieces > 2 && percent(50))
+  {
+    i = (int)rndrange(0, n->nruns - 1);
+    j = (int)rndrange(0, n->nruns - 1);
+    if(!n->runs[i].sparse && !n->runs[j].sparse && n->runs[i].len == n->runs[j].len)
+    {
+      tmp = n->runs[i];
+      n->runs[i].lcn = n->runs[j].lcn;
+      n->runs[j].lcn = tmp.lcn;
+    }
+  }
+}
+
+/* The room a $FILE_NAME attribute takes in a record */
+static uint32_t filename_room(const char* name)
+{
+  uint16_t wide[MAX_NAME * 2];
+  int len = utf16(name, wide, MAX_NAME * 2);
+  return (0x18 + 0x42 + len * 2 + 7) & ~7;
+}
+
+/* Whether a file's data fits in its record along with its names */
+static int resident_fits(node* n)
+{
+  uint32_t used = 0x38 + 0x60 + 8;      /* header, $STANDARD_INFORMATION, end */
+  char dos[16];
+
+  used += filename_room(n->name);
+  if(n->dosname)
+  {
+    snprintf(dos, sizeof(dos), "F%06u.DAT", n->rec);
+    used += filename_room(dos);
+  }
+  if(n->haslink)
+    used += filename_room(n->linkname);
+
+  return used + ((0x18 + n->size + 7) & ~7) <= RECLEN;
+}
+
+static void layout_node(node* n)
+{
+  run* r;
+
+  /* 
+   * Directories and small files are resident, unless the names
+   * leave no room, when NTFS moves the data out of the record too
+   */
+  if(n->dir || (n->size <= 600 && resident_fits(n)))
+    return;
+
+  layout_data(n);
+
+  /* Data in attribute lists is split over two records */
+  if(n->attrlist && n->nruns == 1)
+  {
+    r = n->runs;
+    r[1] = r[0];
+    r[0].len = r[0].len / 2;
+    r[1].vcn += r[0].len;
+    r[1].lcn += r[0].len;
+    r[1].len -= r[0].len;
+    n->nruns = 2;
+  }
+
+  /* A sparse tail beyond the initialized data */
+  if(percent(g_sparse))
+  {
+    n->init = n->size - rndrange(0, n->size / 4);
+    n->init &= ~(uint64_t)7;
+  }
+}
+
+static void write_data(node* n)
+{
+  unsigned char* buf;
+  uint64_t c;
+  int i;
+  size_t chunk = 64;  /* clusters per write */
+  uint64_t num;
+
+  buf = malloc(chunk * g_clusbytes);
+  if(!buf)
+    errx(1, "out of memory");
+
+  for(i = 0; i < n->nruns; i++)
+  {
+    if(n->runs[i].sparse)
+      continue;
+
+    for(c = 0; c < n->runs[i].len; c += num)
+    {
+      num = n->runs[i].len - c;
+      if(num > chunk)
+        num = chunk;
+
+      content(n, (n->runs[i].vcn + c) * g_clusbytes, buf, num * g_clusbytes);
+      writecluster(n->runs[i].lcn + c, buf, num * g_clusbytes);
+    }
+  }
+
+  free(buf);
+}
+
+/* ------------------------------------------------------------------------
+ * Tree building
+ */
+
+static const char* kExts[] = { "txt", "dat", "pst", "doc", "jpg", "bin" };
+static const char* kUnicode[] = { "r\xC3\xA9sum\xC3\xA9", "\xE6\x96\x87\xE6\xA1\xA3",
+                                  "smile\xF0\x9F\x98\x80", "na\xC3\xAFve" };
+
+static node* newnode(void)
+{
+  node* n;
+  g_nodes = realloc(g_nodes, sizeof(node) * (g_nnodes + 1));
+  if(!g_nodes)
+    errx(1, "out of memory");
+  n = g_nodes + g_nnodes++;
+  memset(n, 0, sizeof(node));
+  n->rec = g_nrecs++;
+  n->seed = rnd();
+  n->time = 1577836800ULL + rndrange(0, 86400 * 365 * 3);
+  return n;
+}
+
+static void build_tree(void)
+{
+  uint32_t* dirrecs;
+  uint32_t* dirdepth;
+  uint32_t ndirs = 0;
+  uint32_t i, d;
+  node* n;
+  uint64_t size;
+
+  g_nrecs = 16;
+  dirrecs = calloc(g_dirs + 1, sizeof(uint32_t));
+  dirdepth = calloc(g_dirs + 1, sizeof(uint32_t));
+
+  /* The root directory */
+  dirrecs[ndirs] = 5;
+  dirdepth[ndirs++] = 0;
+
+  for(i = 0; i < g_dirs; i++)
+  {
+    /* Pick a parent that isn't too deep */
+    do
+      d = (uint32_t)rndrange(0, ndirs - 1);
+    while(dirdepth[d] >= g_depth);
+
+    n = newnode();
+    n->dir = 1;
+    n->parent = dirrecs[d];
+    n->flags = FLAG_DIRECTORY;
+    snprintf(n->name, MAX_NAME, "dir%04u", i);
+
+    dirrecs[ndirs] = n->rec;
+    dirdepth[ndirs++] = dirdepth[d] + 1;
+    if(g_depth == 0)
+      break;
+  }
+
+  for(i = 0; i < g_files; i++)
+  {
+    n = newnode();
+    n->parent = dirrecs[rndrange(0, ndirs - 1)];
+    n->flags = FLAG_ARCHIVE;
+    if(percent(5))
+      n->flags |= FLAG_READONLY;
+
+    if(g_dupnames)
+      snprintf(n->name, MAX_NAME, "file%02u.%s", (uint32_t)rndrange(0, 9),
+               kExts[rndrange(0, 5)]);
+    else if(percent(g_unicode))
+      snprintf(n->name, MAX_NAME, "%s%05u.%s", kUnicode[rndrange(0, 3)], i,
+               kExts[rndrange(0, 5)]);
+    else
+      snprintf(n->name, MAX_NAME, "file%05u.%s", i, kExts[rndrange(0, 5)]);
+
+    n->dosname = (i % 3 == 0);
+
+    /* Log uniform distribution of sizes */
+    if(g_maxsize <= g_minsize)
+      size = g_minsize;
+    else
+    {
+      double lo = g_minsize ? (double)g_minsize : 1.0;
+      double f = (double)(rnd() >> 11) / (double)(1ULL << 53);
+      size = (uint64_t)(lo * pow((double)g_maxsize / lo, f));
+      if(g_minsize == 0 && percent(3))
+        size = 0;
+    }
+
+    n->size = size;
+    n->init = size;
+
+    /* Data is laid out later, once the MFT has been placed */
+    if(size > 600 && percent(g_attrlist) && size > 2 * g_clusbytes)
+    {
+      n->attrlist = 1;
+      n->ext[0] = g_nrecs++;
+      n->ext[1] = g_nrecs++;
+    }
+
+    if(percent(g_links) && ndirs > 1)
+    {
+      n->haslink = 1;
+      n->linkparent = dirrecs[rndrange(0, ndirs - 1)];
+      snprintf(n->linkname, MAX_NAME, "link%05u.%s", i, kExts[rndrange(0, 5)]);
+    }
+  }
+
+  free(dirrecs);
+  free(dirdepth);
+}
+
+/* ------------------------------------------------------------------------
+ * Record emission
+ */
+
+static void write_system(uint64_t mftsize)
+{
+  static const char* kNames[] = { "$MFT", "$MFTMirr", "$LogFile", "$Volume",
+                                  "$AttrDef", ".", "$Bitmap", "$Boot",
+                                  "$BadClus", "$Secure", "$UpCase", "$Extend" };
+  record r;
+  run mirr;
+  uint32_t i;
+  uint64_t t = 1577836800ULL;
+
+  for(i = 0; i < 16; i++)
+  {
+    if(i >= 12)
+    {
+      /* Reserved records, not in use */
+      rec_init(&r, i, 0, 0);
+      rec_finish(&r);
+      rec_write(&r, i);
+      continue;
+    }
+
+    rec_init(&r, i, (i == 5 || i == 11) ? 0x03 : 0x01, 0);
+    rec_stdinfo(&r, t, FLAG_HIDDEN | FLAG_SYSTEM);
+    rec_filename(&r, 5, kNames[i], 3, t, FLAG_HIDDEN | FLAG_SYSTEM, 0);
+
+    if(i == 0)
+    {
+      rec_nonresident(&r, ATTR_DATA, g_mftruns, g_nmftruns, 0,
+                      mftsize, mftsize, mftsize);
+    }
+    else if(i == 1)
+    {
+      mirr.vcn = 0;
+      mirr.lcn = g_mirrlcn;
+      mirr.len = (4 * RECLEN + g_clusbytes - 1) / g_clusbytes;
+      mirr.sparse = 0;
+      rec_nonresident(&r, ATTR_DATA, &mirr, 1, 0, mirr.len * g_clusbytes,
+                      4 * RECLEN, 4 * RECLEN);
+    }
+    else if(i != 5 && i != 11)
+    {
+      rec_resident(&r, ATTR_DATA, 0);
+    }
+
+    rec_finish(&r);
+    rec_write(&r, i);
+  }
+}
+
+static void write_node(node* n)
+{
+  record r;
+  record x;
+  unsigned char* list;
+  uint64_t alloc;
+  int split, i, names;
+  unsigned char* d;
+  char dos[16];
+
+  rec_init(&r, n->rec, n->dir ? 0x03 : 0x01, 0);
+  rec_stdinfo(&r, n->time, n->flags & ~FLAG_DIRECTORY);
+
+  if(n->haslink)
+    put16(r.data + 0x12, 2);
+
+  if(n->attrlist)
+  {
+    /* Every file name is listed, they follow with ids from 2 */
+    names = 1 + (n->dosname ? 1 : 0) + (n->haslink ? 1 : 0);
+    list = rec_attrlist(&r, 3 + names);
+    attrlist_entry(list + 0x00, ATTR_STDINFO, 0, n->rec, 0);
+    for(i = 0; i < names; i++)
+      attrlist_entry(list + 0x20 * (i + 1), ATTR_FILENAME, 0, n->rec, 2 + i);
+    split = n->nruns / 2;
+    attrlist_entry(list + 0x20 * (names + 1), ATTR_DATA, 0, n->ext[0], 0);
+    attrlist_entry(list + 0x20 * (names + 2), ATTR_DATA, n->runs[split].vcn, n->ext[1], 0);
+  }
+
+  /* DOS names come first so scrounge has to pick the better one */
+  if(n->dosname)
+  {
+    snprintf(dos, sizeof(dos), "F%06u.DAT", n->rec);
+    rec_filename(&r, n->parent, dos, 2, n->time, n->flags, n->size);
+  }
+
+  rec_filename(&r, n->parent, n->name, 1, n->time, n->flags, n->size);
+
+  if(n->haslink)
+    rec_filename(&r, n->linkparent, n->linkname, 1, n->time, n->flags, n->size);
+
+  if(!n->dir)
+  {
+    alloc = 0;
+    for(i = 0; i < n->nruns; i++)
+      alloc += n->runs[i].len * g_clusbytes;
+
+    if(n->nruns == 0)
+    {
+      d = rec_resident(&r, ATTR_DATA, (uint32_t)n->size);
+      content(n, 0, d, (n->size + 7) & ~7);
+      memset(d + n->size, 0, ((n->size + 7) & ~7) - n->size);
+    }
+    else if(n->attrlist)
+    {
+      split = n->nruns / 2;
+
+      rec_init(&x, n->ext[0], 0x01, n->rec);
+      rec_nonresident(&x, ATTR_DATA, n->runs, split, 0, alloc, n->size, n->init);
+      rec_finish(&x);
+      rec_write(&x, n->ext[0]);
+
+      rec_init(&x, n->ext[1], 0x01, n->rec);
+      rec_nonresident(&x, ATTR_DATA, n->runs + split, n->nruns - split,
+                      n->runs[split].vcn, 0, 0, 0);
+      rec_finish(&x);
+      rec_write(&x, n->ext[1]);
+    }
+    else
+    {
+      rec_nonresident(&r, ATTR_DATA, n->runs, n->nruns, 0, alloc, n->size, n->init);
+    }
+  }
+
+  rec_finish(&r);
+  rec_write(&r, n->rec);
+
+  if(n->nruns)
+    write_data(n);
+}
+
+/* ------------------------------------------------------------------------
+ * Boot sectors and partition tables
+ */
+
+static void write_boot(uint64_t sectors, uint64_t mftlcn)
+{
+  unsigned char b[SECTOR];
+
+  memset(b, 0, SECTOR);
+  b[0] = 0xEB; b[1] = 0x52; b[2] = 0x90;
+  memcpy(b + 3, "NTFS    ", 8);
+  put16(b + 0x0B, SECTOR);
+  b[0x0D] = (unsigned char)g_spc;
+  b[0x15] = 0xF8;
+  put16(b + 0x18, 63);
+  put16(b + 0x1A, 255);
+  put32(b + 0x1C, (uint32_t)g_volfirst);
+  put32(b + 0x24, 0x00800080);
+  put64(b + 0x28, sectors - 1);
+  put64(b + 0x30, mftlcn);
+  put64(b + 0x38, g_mirrlcn);
+  b[0x40] = 0xF6;                         /* 2^10 = 1024 byte records */
+  b[0x44] = 0x01;
+  put64(b + 0x48, g_seed * 0x1234567ULL);
+  b[510] = 0x55; b[511] = 0xAA;
+
+  pwriteall(b, SECTOR, g_volfirst * SECTOR);
+  pwriteall(b, SECTOR, (g_volfirst + sectors - 1) * SECTOR);
+}
+
+static uint32_t crc32(const unsigned char* p, size_t len)
+{
+  uint32_t c = 0xFFFFFFFF;
+  int k;
+
+  while(len--)
+  {
+    c ^= *p++;
+    for(k = 0; k < 8; k++)
+      c = (c >> 1) ^ (0xEDB88320 & (0 - (c & 1)));
+  }
+
+  return ~c;
+}
+
+static void write_mbr(uint64_t start, uint64_t count, int protective)
+{
+  unsigned char m[SECTOR];
+  unsigned char* e = m + 0x1BE;
+
+  memset(m, 0, SECTOR);
+  e[4] = protective ? 0xEE : 0x07;
+  put32(e + 8, protective ? 1 : (uint32_t)start);
+  put32(e + 12, protective ? 0xFFFFFFFF : (uint32_t)count);
+  m[510] = 0x55; m[511] = 0xAA;
+  pwriteall(m, SECTOR, 0);
+}
+
+static void write_gpt(uint64_t start, uint64_t count, uint64_t disksectors)
+{
+  static const unsigned char kBasicData[16] = { 0xA2, 0xA0, 0xD0, 0xEB, 0xE5, 0xB9,
+                      0x33, 0x44, 0x87, 0xC0, 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7 };
+  unsigned char entries[128 * 128];
+  unsigned char h[SECTOR];
+  uint16_t name[36];
+  uint64_t last = disksectors - 1;
+  uint64_t v;
+  int n, pass;
+
+  memset(entries, 0, sizeof(entries));
+  memcpy(entries, kBasicData, 16);
+  v = rnd(); memcpy(entries + 16, &v, 8);
+  v = rnd(); memcpy(entries + 24, &v, 8);
+  put64(entries + 32, start);
+  put64(entries + 40, start + count - 1);
+  memset(name, 0, sizeof(name));
+  n = utf16("Basic data partition", name, 36);
+  memcpy(entries + 56, name, n * 2);
+
+  for(pass = 0; pass < 2; pass++)
+  {
+    memset(h, 0, SECTOR);
+    memcpy(h, "EFI PART", 8);
+    put32(h + 8, 0x00010000);
+    put32(h + 12, 92);
+    put64(h + 24, pass ? last : 1);
+    put64(h + 32, pass ? 1 : last);
+    put64(h + 40, 34);
+    put64(h + 48, last - 33);
+    v = g_seed; memcpy(h + 56, &v, 8);
+    v = ~g_seed; memcpy(h + 64, &v, 8);
+    put64(h + 72, pass ? last - 32 : 2);
+    put32(h + 80, 128);
+    put32(h + 84, 128);
+    put32(h + 88, crc32(entries, sizeof(entries)));
+    put32(h + 16, crc32(h, 92));
+
+    pwriteall(entries, sizeof(entries), (pass ? last - 32 : 2) * SECTOR);
+    pwriteall(h, SECTOR, (pass ? last : 1) * SECTOR);
+  }
+}
+
+/* ------------------------------------------------------------------------
+ * Manifest and verification
+ */
+
+static void path_of(uint32_t rec, char* out, size_t len)
+{
+  char tmp[4096];
+  uint32_t i;
+
+  out[0] = 0;
+  while(rec != 5)
+  {
+    for(i = 0; i < g_nnodes; i++)
+    {
+      if(g_nodes[i].rec == rec)
+        break;
+    }
+
+    if(i == g_nnodes)
+      errx(1, "broken tree");
+
+    snprintf(tmp, sizeof(tmp), "%s%s%s", g_nodes[i].name, out[0] ? "/" : "", out);
+    snprintf(out, len, "%s", tmp);
+    rec = g_nodes[i].parent;
+  }
+}
+
+static void write_manifest(const char* path)
+{
+  FILE* f = fopen(path, "w");
+  char dir[4096];
+  uint32_t i;
+  node* n;
+  uint64_t h;
+
+  if(!f)
+    err(1, "couldn't open manifest: %s", path);
+
+  for(i = 0; i < g_nnodes; i++)
+  {
+    n = g_nodes + i;
+    path_of(n->parent, dir, sizeof(dir));
+
+    if(n->dir)
+    {
+      fprintf(f, "D\t0\t0\t%llu\t%s%s%s\n", (unsigned long long)n->time,
+              dir, dir[0] ? "/" : "", n->name);
+      continue;
+    }
+
+    h = contenthash(n);
+    fprintf(f, "F\t%llu\t%016llx\t%llu\t%s%s%s\n", (unsigned long long)n->size,
+            (unsigned long long)h, (unsigned long long)n->time,
+            dir, dir[0] ? "/" : "", n->name);
+
+    if(n->haslink)
+    {
+      path_of(n->linkparent, dir, sizeof(dir));
+      fprintf(f, "L\t%llu\t%016llx\t%llu\t%s%s%s\n", (unsigned long long)n->size,
+              (unsigned long long)h, (unsigned long long)n->time,
+              dir, dir[0] ? "/" : "", n->linkname);
+    }
+  }
+
+  fclose(f);
+}
+
+static int hashfile(const char* path, uint64_t* size, uint64_t* hash)
+{
+  unsigned char buf[65536];
+  uint64_t h = FNV_INIT;
+  uint64_t total = 0;
+  ssize_t r;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if(fd == -1)
+    return -1;
+
+  while((r = read(fd, buf, sizeof(buf))) > 0)
+  {
+    h = fnv(h, buf, r);
+    total += r;
+  }
+
+  close(fd);
+  *size = total;
+  *hash = h;
+  return r < 0 ? -1 : 0;
+}
+
+/* Verify an extracted tree path by path */
+static int verify_tree(const char* manifest, const char* root, int times)
+{
+  FILE* f = fopen(manifest, "r");
+  char line[8192];
+  char path[8192];
+  char type;
+  unsigned long long size, mtime, hash;
+  char name[4096];
+  uint64_t gsize, ghash;
+  struct stat sb;
+  int bad = 0;
+  int count = 0;
+
+  if(!f)
+    err(1, "couldn't open manifest: %s", manifest);
+
+  while(fgets(line, sizeof(line), f))
+  {
+    if(sscanf(line, "%c\t%llu\t%llx\t%llu\t%4095[^\n]", &type, &size,
+              &hash, &mtime, name) != 5)
+      continue;
+
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    count++;
+
+    if(type == 'D')
+    {
+      if(stat(path, &sb) == -1 || !S_ISDIR(sb.st_mode))
+      {
+        warnx("missing directory: %s", name);
+        bad++;
+      }
+      else if(times && (unsigned long long)sb.st_mtime != mtime)
+      {
+        warnx("wrong directory time: %s", name);
+        bad++;
+      }
+      continue;
+    }
+
+    if(hashfile(path, &gsize, &ghash) == -1)
+    {
+      warnx("missing file: %s", name);
+      bad++;
+    }
+    else if(gsize != size || ghash != hash)
+    {
+      warnx("wrong content: %s (%llu bytes, expected %llu)", name,
+            (unsigned long long)gsize, size);
+      bad++;
+    }
+    else if(times && (stat(path, &sb) == -1 ||
+            (unsigned long long)sb.st_mtime != mtime))
+    {
+      warnx("wrong file time: %s", name);
+      bad++;
+    }
+  }
+
+  fclose(f);
+  printf("verified %d entries, %d problems\n", count, bad);
+  return bad ? 1 : 0;
+}
+
+/* Verify that every file's content appears somewhere in a flat directory */
+static int verify_raw(const char* manifest, const char* root)
+{
+  FILE* f = fopen(manifest, "r");
+  char line[8192];
+  char path[8192];
+  char type;
+  unsigned long long size, mtime, hash;
+  char name[4096];
+  uint64_t* found = NULL;
+  size_t nfound = 0;
+  uint64_t gsize, ghash;
+  struct dirent* ent;
+  DIR* dir;
+  size_t i;
+  int bad = 0;
+  int count = 0;
+
+  dir = opendir(root);
+  if(!dir)
+    err(1, "couldn't open directory: %s", root);
+
+  while((ent = readdir(dir)) != NULL)
+  {
+    snprintf(path, sizeof(path), "%s/%s", root, ent->d_name);
+    if(ent->d_name[0] == '.' || hashfile(path, &gsize, &ghash) == -1)
+      continue;
+    found = realloc(found, sizeof(uint64_t) * (nfound + 1));
+    found[nfound++] = ghash;
+  }
+
+  closedir(dir);
+
+  if(!f)
+    err(1, "couldn't open manifest: %s", manifest);
+
+  while(fgets(line, sizeof(line), f))
+  {
+    if(sscanf(line, "%c\t%llu\t%llx\t%llu\t%4095[^\n]", &type, &size,
+              &hash, &mtime, name) != 5 || type != 'F')
+      continue;
+
+    count++;
+    for(i = 0; i < nfound; i++)
+    {
+      if(found[i] == hash)
+        break;
+    }
+
+    if(i == nfound)
+    {
+      warnx("content not found: %s", name);
+      bad++;
+    }
+  }
+
+  fclose(f);
+  free(found);
+  printf("verified %d files, %d problems\n", count, bad);
+  return bad ? 1 : 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Main
+ */
+
+static void usage(void)
+{
+  fprintf(stderr,
+    "usage: mkntfsimg [options] image manifest\n"
+    "  -a percent   Files with data in attribute lists (default 3)\n"
+    "  -B           Leave out the boot sectors, so only a raw search works\n"
+    "  -c sectors   Cluster size in sectors (default 8)\n"
+    "  -d depth     Maximum directory depth (default 3)\n"
+    "  -D           Use a small pool of duplicate file names\n"
+    "  -f percent   Fragmented files (default 10)\n"
+    "  -F           Fragment the MFT itself\n"
+    "  -l percent   Files with a second hard link (default 0)\n"
+    "  -m bytes     Minimum file size (default 0)\n"
+    "  -M bytes     Maximum file size (default 262144)\n"
+    "  -n count     Number of files (default 200)\n"
+    "  -r seed      Random seed (default 1)\n"
+    "  -s percent   Sparse files (default 5)\n"
+    "  -t table     Partition table: none, mbr or gpt (default none)\n"
+    "  -u percent   Files with non-ASCII names (default 0)\n"
+    "  -w dirs      Number of directories (default 20)\n"
+    "usage: mkntfsimg -V [-T] manifest directory\n"
+    "  Verify an extracted tree (-T also checks modification times)\n"
+    "usage: mkntfsimg -R manifest directory\n"
+    "  Verify that all file content was found in a flat directory\n");
+  exit(2);
+}
+
+int main(int argc, char* argv[])
+{
+  uint64_t mftrecs, mftclus, mftlcn, mftsize;
+  uint64_t volsectors, disksectors;
+  int verify = 0;
+  int times = 0;
+  uint32_t i;
+  int ch;
+
+  while((ch = getopt(argc, argv, "a:Bc:d:Df:Fl:m:M:n:r:Rs:t:Tu:Vw:")) != -1)
+  {
+    switch(ch)
+    {
+    case 'a': g_attrlist = atoi(optarg); break;
+    case 'B': g_noboot = 1; break;
+    case 'c': g_spc = atoi(optarg); break;
+    case 'd': g_depth = atoi(optarg); break;
+    case 'D': g_dupnames = 1; break;
+    case 'f': g_frag = atoi(optarg); break;
+    case 'F': g_fragmft = 1; break;
+    case 'l': g_links = atoi(optarg); break;
+    case 'm': g_minsize = strtoull(optarg, NULL, 10); break;
+    case 'M': g_maxsize = strtoull(optarg, NULL, 10); break;
+    case 'n': g_files = atoi(optarg); break;
+    case 'r': g_seed = strtoull(optarg, NULL, 10); break;
+    case 'R': verify = 2; break;
+    case 's': g_sparse = atoi(optarg); break;
+    case 't': g_table = optarg; break;
+    case 'T': times = 1; break;
+    case 'u': g_unicode = atoi(optarg); break;
+    case 'V': verify = 1; break;
+    case 'w': g_dirs = atoi(optarg); break;
+    default: usage();
+    }
+  }
+
+  argc -= optind;
+  argv += optind;
+
+  if(argc != 2)
+    usage();
+
+  if(verify == 1)
+    return verify_tree(argv[0], argv[1], times);
+  if(verify == 2)
+    return verify_raw(argv[0], argv[1]);
+
+  if(g_spc == 0 || g_spc > 128 || (g_spc & (g_spc - 1)))
+    errx(2, "invalid cluster size");
+
+  g_rand = g_seed;
+  g_clusbytes = (uint64_t)g_spc * SECTOR;
+
+  build_tree();
+
+  /* Room for all records, rounded up to whole clusters */
+  mftrecs = g_nrecs + 16;
+  mftclus = (mftrecs * RECLEN + g_clusbytes - 1) / g_clusbytes;
+  mftrecs = mftclus * g_clusbytes / RECLEN;
+  mftsize = mftrecs * RECLEN;
+
+  /* Leave room for the boot file, then the MFT */
+  g_nextlcn = (8192 + g_clusbytes - 1) / g_clusbytes;
+  if(g_fragmft && mftclus >= 2)
+  {
+    g_mftruns[0].lcn = alloc_clusters(mftclus / 2);
+    g_mftruns[0].len = mftclus / 2;
+    alloc_clusters(7);
+    g_mftruns[1].lcn = alloc_clusters(mftclus - mftclus / 2);
+    g_mftruns[1].len = mftclus - mftclus / 2;
+    g_nmftruns = 2;
+  }
+  else
+  {
+    g_mftruns[0].lcn = alloc_clusters(mftclus);
+    g_mftruns[0].len = mftclus;
+    g_nmftruns = 1;
+  }
+  g_mftruns[0].vcn = 0;
+  g_mftruns[1].vcn = g_mftruns[0].len;
+  mftlcn = g_mftruns[0].lcn;
+  g_mirrlcn = alloc_clusters((4 * RECLEN + g_clusbytes - 1) / g_clusbytes);
+
+  for(i = 0; i < g_nnodes; i++)
+    layout_node(g_nodes + i);
+
+  volsectors = (g_nextlcn + 16) * g_spc + 1;
+
+  if(!strcmp(g_table, "none"))
+  {
+    g_volfirst = 0;
+    disksectors = volsectors;
+  }
+  else if(!strcmp(g_table, "mbr"))
+  {
+    g_volfirst = 2048;
+    disksectors = g_volfirst + volsectors;
+  }
+  else if(!strcmp(g_table, "gpt"))
+  {
+    g_volfirst = 2048;
+    disksectors = g_volfirst + volsectors + 34;
+  }
+  else
+  {
+    errx(2, "invalid partition table type: %s", g_table);
+  }
+
+  g_fd = open(argv[0], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(g_fd == -1)
+    err(1, "couldn't open image: %s", argv[0]);
+
+  if(ftruncate(g_fd, (off_t)(disksectors * SECTOR)) == -1)
+    err(1, "couldn't size image");
+
+  if(!strcmp(g_table, "mbr"))
+    write_mbr(g_volfirst, volsectors, 0);
+  else if(!strcmp(g_table, "gpt"))
+  {
+    write_mbr(1, disksectors - 1, 1);
+    write_gpt(g_volfirst, volsectors, disksectors);
+  }
+
+  if(!g_noboot)
+    write_boot(volsectors, mftlcn);
+  write_system(mftsize);
+
+  for(i = 0; i < g_nnodes; i++)
+    write_node(g_nodes + i);
+
+  /* Unused records at the end of the MFT */
+  for(i = g_nrecs; i < mftrecs; i++)
+  {
+    record r;
+    rec_init(&r, i, 0, 0);
+    rec_finish(&r);
+    rec_write(&r, i);
+  }
+
+  close(g_fd);
+  write_manifest(argv[1]);
+
+  printf("image: %llu sectors, volume at %llu-%llu, cluster %u, mft at %llu, %u records\n",
+         (unsigned long long)disksectors, (unsigned long long)g_volfirst,
+         (unsigned long long)(g_volfirst + volsectors - 1), g_spc,
+         (unsigned long long)(mftlcn * g_spc), g_nrecs);
+  return 0;
+}
@@ -0,0 +1,294 @@
+#!/bin/sh
+#
+# Performance regression checks, run by 'make check'.
+#
+# usage: perfcheck.sh [-u | -U] [scenario ...]
+#
+# Each scenario builds a small image with mkntfsimg, rescues it and
+# checks the files against the image's manifest. Then three things
+# are measured:
+#
+#   records/s       MFT records per second, from the best of a few runs
+#   bytes/syscall   File data per read and write system call made
+#   kB/1000 rec     Peak resident memory per 1000 MFT records, above
+#                   what rescuing a nearly empty image takes
+#
+# A check fails when it's worse than the baseline by more than its
+# tolerance (in percent). bytes/syscall and memory per record don't
+# depend much on the machine, so they're checked against
+# perf-baseline.txt, which is kept with the source. bytes/syscall
+# drops sharply when data gets copied a cluster at a time again, and
+# memory per record grows when something is kept for every file.
+#
+# Speed depends on the machine, so it's only checked against a
+# baseline measured on it, in perf-local.txt in the build directory.
+# Without one the speed isn't checked, and that's said plainly.
+# Timings are noisy, so records/s is given the most room.
+#
+# With -u the baselines are measured again and written to
+# perf-local.txt, for a new machine or after a change that's known to
+# be faster or slower. -U also rewrites perf-baseline.txt in the
+# source directory, for a change that's meant to move the figures
+# kept there.
+#
+# The environment can change:
+#   SCROUNGE          The scrounge-ntfs to check (../src/scrounge-ntfs)
+#   CHECK_DIR         Work directory for images and output (check-work)
+#   CHECK_LOCAL       Baseline measured on this machine (perf-local.txt)
+#   CHECK_RUNS        Runs of each scenario, the best is used (3)
+#   CHECK_ARGS        Extra arguments for scrounge-ntfs
+#   CHECK_SPEED_TOL   Tolerance for records/s (50)
+#   CHECK_IO_TOL      Tolerance for bytes/syscall (10)
+#   CHECK_MEMORY_TOL  Tolerance for memory per record (40)
+#
+
+UPDATE=0
+case "$1" in
+	-u) UPDATE=1; shift ;;
+	-U) UPDATE=2; shift ;;
+esac
+
+SRCDIR=${srcdir:-`dirname "$0"`}
+BASELINE=$SRCDIR/perf-baseline.txt
+LOCAL=${CHECK_LOCAL:-perf-local.txt}
+SCROUNGE=${SCROUNGE:-../src/scrounge-ntfs}
+MKNTFSIMG=./mkntfsimg
+RUNSTAT=./runstat
+
+DIR=${CHECK_DIR:-check-work}
+RUNS=${CHECK_RUNS:-3}
+SPEED_TOL=${CHECK_SPEED_TOL:-50}
+IO_TOL=${CHECK_IO_TOL:-10}
+MEMORY_TOL=${CHECK_MEMORY_TOL:-40}
+SCENARIOS=${*:-"small large frag links"}
+FAILED=0
+
+for prog in "$SCROUNGE" "$MKNTFSIMG" "$RUNSTAT"; do
+	if [ ! -x "$prog" ]; then
+		echo "perfcheck.sh: not built: $prog" >&2
+		exit 1
+	fi
+done
+
+case "$SCROUNGE" in
+	/*) ;;
+	*) SCROUNGE=`pwd`/$SCROUNGE ;;
+esac
+
+mkdir -p "$DIR" || exit 1
+RESULTS=$DIR/results
+: > "$RESULTS"
+
+# Files go relative to the output directory, so the images can't be relative
+case "$DIR" in
+	/*) IMGDIR=$DIR ;;
+	*) IMGDIR=`pwd`/$DIR ;;
+esac
+
+# name generator-args [scrounge-args]
+measure()
+{
+	NAME=$1
+	GENARGS=$2
+	ARGS=$3
+
+	IMG=$IMGDIR/$NAME.img
+	MAN=$DIR/$NAME.man
+	OUT=$DIR/$NAME.out
+
+	if [ ! -f "$IMG" -o "`cat "$DIR/$NAME.args" 2>/dev/null`" != "$GENARGS" ]; then
+		"$MKNTFSIMG" $GENARGS "$IMG" "$MAN" > "$DIR/$NAME.gen" || exit 1
+		echo "$GENARGS" > "$DIR/$NAME.args"
+	fi
+
+	RECORDS=`sed -n 's/.* \([0-9]*\) records$/\1/p' "$DIR/$NAME.gen"`
+	END=`wc -c < "$IMG"`
+	END=`expr $END / 512 - 1`
+
+	: > "$DIR/$NAME.stat"
+	run=0
+	while [ $run -lt $RUNS ]; do
+		rm -rf "$OUT" && mkdir "$OUT" || exit 1
+
+		if ! "$RUNSTAT" -o "$DIR/$NAME.run" "$SCROUNGE" $CHECK_ARGS $ARGS -o "$OUT" \
+			"$IMG" 0 $END > "$DIR/$NAME.log" 2>&1; then
+			echo "FAIL: $NAME: scrounge-ntfs failed, see $DIR/$NAME.log"
+			FAILED=1
+			return 1
+		fi
+
+		if ! "$MKNTFSIMG" -V "$MAN" "$OUT" > "$DIR/$NAME.verify" 2>&1; then
+			echo "FAIL: $NAME: rescued files are wrong, see $DIR/$NAME.verify"
+			FAILED=1
+			return 1
+		fi
+
+		cat "$DIR/$NAME.run" >> "$DIR/$NAME.stat"
+		run=`expr $run + 1`
+	done
+
+	rm -rf "$OUT"
+	return 0
+}
+
+# name generator-args [scrounge-args]
+scenario()
+{
+	measure "$@" || return
+
+	# The best of the runs, as anything slower is noise
+	awk -v name="$NAME" -v records="$RECORDS" -v empty="$EMPTY" '
+		FILENAME ~ /\.man$/ {
+			if($1 == "F") bytes += $2
+			next
+		}
+		{
+			for(i = 1; i <= NF; i++)
+			{
+				split($i, kv, "=")
+				stat[kv[1]] = kv[2]
+			}
+
+			wall = stat["wall"] > 0 ? stat["wall"] : 0.001
+			if(speed == "" || records / wall > speed)
+				speed = records / wall
+
+			syscalls = stat["syscr"] + stat["syscw"]
+			if(syscalls > 0 && (io == "" || bytes / syscalls > io))
+				io = bytes / syscalls
+
+			if(memory == "" || stat["maxrss"] < memory)
+				memory = stat["maxrss"]
+		}
+		END {
+			memory = (memory - empty) * 1000 / (records ? records : 1)
+			printf("%s %.0f %.0f %.0f\n", name, speed, io, memory > 1 ? memory : 1)
+		}' "$MAN" "$DIR/$NAME.stat" >> "$RESULTS"
+}
+
+# The peak memory of rescuing a nearly empty image, which every run has
+if measure empty "-r 10 -n 1 -w 1"; then
+	EMPTY=`awk '
+		{
+			for(i = 1; i <= NF; i++)
+			{
+				split($i, kv, "=")
+				stat[kv[1]] = kv[2]
+			}
+
+			if(memory == "" || stat["maxrss"] < memory)
+				memory = stat["maxrss"]
+		}
+		END {
+			print memory
+		}' "$DIR/empty.stat"`
+fi
+
+if [ -z "$EMPTY" ]; then
+	echo "perfcheck.sh: couldn't measure an empty run" >&2
+	exit 1
+fi
+
+for s in $SCENARIOS; do
+	case $s in
+	small)
+		# Lots of small files, the MFT dominates
+		scenario small "-r 11 -n 5000 -M 16384 -w 100 -d 4 -f 5" ;;
+	large)
+		# Fewer big files, the data copy dominates
+		scenario large "-r 12 -n 40 -m 262144 -M 4194304 -f 20 -s 0" ;;
+	frag)
+		# Fragmented files and MFT, with attribute lists, read in disk order
+		scenario frag "-r 13 -n 1000 -M 262144 -f 60 -F -a 10" "-D" ;;
+	links)
+		# Small files with a second name, so the names crowd the records
+		scenario links "-r 14 -n 2000 -M 1024 -w 50 -l 50 -u 20" ;;
+	*)
+		echo "perfcheck.sh: unknown scenario: $s" >&2
+		exit 2 ;;
+	esac
+done
+
+if [ $UPDATE -ne 0 ]; then
+	if [ $FAILED -ne 0 ]; then
+		echo "perfcheck.sh: not updating baselines, a scenario failed" >&2
+		exit 1
+	fi
+
+	{
+		echo "# scenario records/s bytes/syscall kB/1000-records"
+		echo "# Measured on `uname -n` by 'make baseline'"
+		cat "$RESULTS"
+	} > "$LOCAL" || exit 1
+	echo "perfcheck.sh: wrote $LOCAL"
+
+	if [ $UPDATE -eq 2 ]; then
+		{
+			echo "# scenario bytes/syscall kB/1000-records"
+			echo "# Written by 'make update-baseline' in the bench directory"
+			awk '{ print $1, $3, $4 }' "$RESULTS"
+		} > "$BASELINE" || exit 1
+		echo "perfcheck.sh: wrote $BASELINE"
+	fi
+
+	cat "$RESULTS"
+	exit 0
+fi
+
+# Without baselines everything is skipped
+[ -f "$BASELINE" ] || BASELINE=/dev/null
+if [ ! -f "$LOCAL" ]; then
+	echo "perfcheck.sh: speed NOT checked, there's no $LOCAL for this machine"
+	echo "perfcheck.sh: run 'make baseline' on a quiet machine to check it"
+	LOCAL=/dev/null
+fi
+
+awk -v speedtol="$SPEED_TOL" -v iotol="$IO_TOL" -v memtol="$MEMORY_TOL" '
+	FILENAME == local {
+		if($0 !~ /^#/ && NF == 4)
+			speed[$1] = $2
+		next
+	}
+
+	FILENAME != results {
+		if($0 !~ /^#/ && NF == 3)
+		{
+			io[$1] = $2
+			memory[$1] = $3
+		}
+		next
+	}
+
+	# Worse is lower for the first two, and higher for memory
+	function check(name, what, value, base, tol, higher)
+	{
+		if(base == "" || base == 0 || value == 0)
+		{
+			printf("SKIP: %s: %s %d, no baseline\n", name, what, value)
+			return
+		}
+
+		change = (value - base) * 100 / base
+		if(higher)
+			worse = change > tol
+		else
+			worse = -change > tol
+
+		printf("%s: %s: %s %d, baseline %d (%+.0f%%, tolerance %d%%)\n",
+		       worse ? "FAIL" : "PASS", name, what, value, base, change, tol)
+
+		if(worse)
+			failed = 1
+	}
+
+	{
+		check($1, "records/s", $2, speed[$1], speedtol, 0)
+		check($1, "bytes/syscall", $3, io[$1], iotol, 0)
+		check($1, "kB/1000 records", $4, memory[$1], memtol, 1)
+	}
+
+	END {
+		exit failed
+	}' results="$RESULTS" local="$LOCAL" "$BASELINE" "$LOCAL" "$RESULTS" || FAILED=1
+
+exit $FAILED
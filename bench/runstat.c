@@ -0,0 +1,141 @@
+/*
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ *
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+/*
+ * runstat runs a command and prints what it cost on one line: the
+ * wall clock and CPU time, the peak resident memory in kilobytes, and
+ * (where /proc has them) the number of read and write system calls
+ * made and the bytes they moved. The
+ * command's own output is left alone, so with -o the line goes to a
+ * file instead of standard output.
+ *
+ * The I/O counts are read from /proc/<pid>/io while the command is a
+ * zombie, so they include any threads and reaped children.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+typedef struct _iostats
+{
+  unsigned long long rchar;
+  unsigned long long wchar;
+  unsigned long long syscr;
+  unsigned long long syscw;
+}
+iostats;
+
+static void readStats(pid_t pid, iostats* io)
+{
+  char name[64];
+  char line[256];
+  FILE* f;
+
+  memset(io, 0, sizeof(*io));
+
+  sprintf(name, "/proc/%d/io", (int)pid);
+  f = fopen(name, "r");
+  if(!f)
+    return;
+
+  while(fgets(line, sizeof(line), f))
+  {
+    sscanf(line, "rchar: %llu", &(io->rchar));
+    sscanf(line, "wchar: %llu", &(io->wchar));
+    sscanf(line, "syscr: %llu", &(io->syscr));
+    sscanf(line, "syscw: %llu", &(io->syscw));
+  }
+
+  fclose(f);
+}
+
+static double seconds(struct timeval* tv)
+{
+  return (double)tv->tv_sec + (double)tv->tv_usec / 1000000.0;
+}
+
+int main(int argc, char* argv[])
+{
+  struct timeval start, end;
+  struct rusage usage;
+  siginfo_t info;
+  iostats io;
+  FILE* out = stdout;
+  pid_t pid;
+  int status;
+
+  if(argc > 2 && !strcmp(argv[1], "-o"))
+  {
+    out = fopen(argv[2], "w");
+    if(!out)
+      err(1, "couldn't open: %s", argv[2]);
+
+    argc -= 2;
+    argv += 2;
+  }
+
+  if(argc < 2)
+  {
+    fprintf(stderr, "usage: runstat [-o file] command [args ...]\n");
+    return 2;
+  }
+
+  gettimeofday(&start, NULL);
+
+  pid = fork();
+  if(pid == -1)
+    err(1, "couldn't fork");
+
+  if(pid == 0)
+  {
+    execvp(argv[1], argv + 1);
+    warn("couldn't run: %s", argv[1]);
+    _exit(127);
+  }
+
+  /* Look before it's reaped, while the counts are still there */
+  memset(&info, 0, sizeof(info));
+  if(waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == -1)
+    err(1, "couldn't wait for command");
+
+  gettimeofday(&end, NULL);
+  readStats(pid, &io);
+
+  if(wait4(pid, &status, 0, &usage) == -1)
+    err(1, "couldn't wait for command");
+
+  fprintf(out, "wall=%.3f user=%.3f sys=%.3f maxrss=%ld syscr=%llu syscw=%llu rchar=%llu wchar=%llu\n",
+         seconds(&end) - seconds(&start), seconds(&(usage.ru_utime)),
+         seconds(&(usage.ru_stime)), (long)usage.ru_maxrss, io.syscr, io.syscw, 
+         io.rchar, io.wchar);
+
+  if(out != stdout)
+    fclose(out);
+
+  if(WIFEXITED(status))
+    return WEXITSTATUS(status);
+  return 1;
+}
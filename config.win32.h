@@ -78,6 +78,9 @@
 /* Define to 1 if you have the `memset' function. */
 #define HAVE_MEMSET 1
 
+/* Define to 1 if you have the `pwrite' function. */
+/* #undef HAVE_PWRITE */
+
 /* Define to 1 if you have the `realloc' function. */
 #define HAVE_REALLOC 1
 
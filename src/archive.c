@@ -0,0 +1,454 @@
+/* 
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ * 
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+
+#include "usuals.h"
+#include "archive.h"
+#include "pack.h"
+#include "stats.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#define kArchive_Block      0x200
+
+/* The difference between NTFS and unix times in 100ns units */
+#define FT_EPOCH            116444736000000000LL
+#define FT_SECOND           10000000LL
+
+/* Largest size that fits in a plain ustar header */
+#define kArchive_MaxSize    077777777777LL
+
+#pragma pack(1)
+
+typedef struct _ustar_header
+{
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+}
+ustar_header;
+
+#pragma pack()
+
+/* Pax records are built up in here */
+typedef struct _paxbuf
+{
+  char* data;
+  size_t len;
+  size_t alloc;
+}
+paxbuf;
+
+static void writeData(archive* ar, const void* data, size_t len)
+{
+  uint64 entered = stats_enter(kStats_Write);
+
+  if(ar->pack)
+    pack_write(ar->pack, (const byte*)data, len);
+  else if(fwrite(data, 1, len, ar->f) != len)
+    err(1, "couldn't write to archive");
+
+  stats_count(kStats_BytesWritten, len);
+  stats_leave(kStats_Write, entered);
+}
+
+static void writePadding(archive* ar, uint64 len)
+{
+  static const byte zeros[kArchive_Block] = { 0 };
+  uint32 pad = (uint32)(len % kArchive_Block);
+
+  if(pad)
+    writeData(ar, zeros, kArchive_Block - pad);
+}
+
+static void putOctal(char* field, size_t len, uint64 val)
+{
+  /* Leaves room for the terminating null */
+  char buf[24];
+#ifdef _WIN32
+  sprintf(buf, "%0*I64o", (int)(len - 1), val);
+#else
+  sprintf(buf, "%0*llo", (int)(len - 1), (unsigned long long)val);
+#endif
+  memcpy(field, buf, len - 1);
+  field[len - 1] = 0;
+}
+
+static int printNumber(char* buf, uint64 val)
+{
+#ifdef _WIN32
+  return sprintf(buf, "%I64u", val);
+#else
+  return sprintf(buf, "%llu", (unsigned long long)val);
+#endif
+}
+
+static void addRecord(paxbuf* pax, const char* key, const char* val)
+{
+  size_t len = strlen(key) + strlen(val) + 3;
+  size_t total;
+  char digits[24];
+
+  /* The length includes its own digits */
+  sprintf(digits, "%u", (unsigned int)len);
+  total = len + strlen(digits);
+  sprintf(digits, "%u", (unsigned int)total);
+  if(strlen(digits) + len != total)
+  {
+    total++;
+    sprintf(digits, "%u", (unsigned int)total);
+  }
+
+  if(pax->len + total + 1 > pax->alloc)
+  {
+    pax->alloc = (pax->len + total + 1) * 2;
+    pax->data = (char*)reallocf(pax->data, pax->alloc);
+  }
+
+  sprintf(pax->data + pax->len, "%s %s=%s\n", digits, key, val);
+  pax->len += total;
+}
+
+static void addNumber(paxbuf* pax, const char* key, uint64 val)
+{
+  char buf[24];
+  printNumber(buf, val);
+  addRecord(pax, key, buf);
+}
+
+static void addTime(paxbuf* pax, const char* key, uint64 ft)
+{
+  char buf[48];
+  char* p = buf;
+  int64 t = (int64)ft - FT_EPOCH;
+
+  /* Times before 1970 are negative, fraction included */
+  if(t < 0)
+  {
+    *(p++) = '-';
+    t = -t;
+  }
+
+  printNumber(p, (uint64)(t / FT_SECOND));
+
+  if(t % FT_SECOND)
+    sprintf(p + strlen(p), ".%07d", (int)(t % FT_SECOND));
+
+  addRecord(pax, key, buf);
+}
+
+static void fillHeader(ustar_header* header, const char* name, char type, 
+                       int mode, uint64 size, uint64 mtime, const char* link)
+{
+  uint32 sum = 0;
+  size_t i;
+
+  memset(header, 0, sizeof(ustar_header));
+  memcpy(header->name, name, min(strlen(name), sizeof(header->name)));
+  putOctal(header->mode, sizeof(header->mode), mode & 07777);
+  putOctal(header->uid, sizeof(header->uid), 0);
+  putOctal(header->gid, sizeof(header->gid), 0);
+  putOctal(header->size, sizeof(header->size), size <= kArchive_MaxSize ? size : 0);
+  putOctal(header->mtime, sizeof(header->mtime), mtime <= kArchive_MaxSize ? mtime : 0);
+  header->typeflag = type;
+  if(link)
+    memcpy(header->linkname, link, min(strlen(link), sizeof(header->linkname)));
+  memcpy(header->magic, "ustar", 6);
+  memcpy(header->version, "00", 2);
+
+  /* Checksum is figured with the field as spaces */
+  memset(header->chksum, ' ', sizeof(header->chksum));
+  for(i = 0; i < sizeof(ustar_header); i++)
+    sum += ((unsigned char*)header)[i];
+
+  putOctal(header->chksum, 7, sum);
+  header->chksum[7] = ' ';
+}
+
+/* Names that a plain ustar header can hold as is */
+static bool fitsHeader(const char* name)
+{
+  const unsigned char* c;
+
+  if(strlen(name) >= 100)
+    return false;
+
+  for(c = (const unsigned char*)name; *c; c++)
+  {
+    if(*c >= 0x80)
+      return false;
+  }
+
+  return true;
+}
+
+/* Paths in the archive are always UTF-8 */
+static void utf8Path(const fchar_t* path, char* out, size_t len)
+{
+#ifdef FC_WIDE
+  if(!WideCharToMultiByte(CP_UTF8, 0, path, -1, out, (int)len, NULL, NULL))
+    out[0] = 0;
+#else
+  len = min(strlen(path), len - 1);
+  memcpy(out, path, len);
+  out[len] = 0;
+#endif
+}
+
+void archive_init(archive* ar, FILE* f)
+{
+  memset(ar, 0, sizeof(archive));
+  ar->f = f;
+}
+
+void archive_initpack(archive* ar, struct _pack* pack)
+{
+  memset(ar, 0, sizeof(archive));
+  ar->pack = pack;
+}
+
+/* What a pack stores is only the data present */
+static void beginPack(archive* ar, archive_entry* entry)
+{
+  uint32 i;
+
+  ar->_remaining = entry->dir ? 0 : entry->size;
+  ar->_written = 0;
+
+  if(entry->map)
+  {
+    ar->_remaining = 0;
+    for(i = 0; i < entry->mapCount; i++)
+      ar->_remaining += entry->map[(i * 2) + 1];
+  }
+
+  pack_begin(ar->pack, entry);
+}
+
+void archive_begin(archive* ar, archive_entry* entry)
+{
+  ustar_header header;
+  paxbuf pax;
+  char name[(MAX_PATH * 4) + 32];
+  char path[(MAX_PATH * 4) + 2];
+  const char* base;
+  uint64 stored;
+  uint64 mtime;
+  char num[24];
+  size_t mapLen = 0;
+  uint32 i;
+
+  ASSERT(ar->_remaining == 0);
+
+  if(ar->pack)
+  {
+    beginPack(ar, entry);
+    return;
+  }
+
+  utf8Path(entry->path, path, sizeof(path) - 1);
+
+  if(entry->dir)
+    strcat(path, "/");
+
+  memset(&pax, 0, sizeof(pax));
+  stored = entry->dir ? 0 : entry->size;
+
+  addTime(&pax, "mtime", entry->modified);
+  addTime(&pax, "atime", entry->accessed);
+
+  if(entry->map)
+  {
+    /* The map goes in front of the data, as text */
+    sprintf(num, "%u\n", entry->mapCount);
+    mapLen = strlen(num);
+    stored = 0;
+
+    for(i = 0; i < entry->mapCount; i++)
+    {
+      mapLen += printNumber(num, entry->map[i * 2]) + 1;
+      mapLen += printNumber(num, entry->map[(i * 2) + 1]) + 1;
+      stored += entry->map[(i * 2) + 1];
+    }
+
+    stored += mapLen + ((kArchive_Block - (mapLen % kArchive_Block)) % kArchive_Block);
+
+    addRecord(&pax, "GNU.sparse.major", "1");
+    addRecord(&pax, "GNU.sparse.minor", "0");
+    addRecord(&pax, "GNU.sparse.name", path);
+    addNumber(&pax, "GNU.sparse.realsize", entry->size);
+
+    base = strrchr(path, '/');
+    sprintf(name, "GNUSparseFile.0/%.80s", base ? base + 1 : path);
+  }
+  else
+  {
+    if(!fitsHeader(path))
+      addRecord(&pax, "path", path);
+
+    strcpy(name, path);
+  }
+
+  if(stored > kArchive_MaxSize)
+    addNumber(&pax, "size", stored);
+
+  /* The extended header first, then the entry itself */
+  fillHeader(&header, "././@PaxHeader", 'x', 0644, pax.len, 0, NULL);
+  writeData(ar, &header, sizeof(header));
+  writeData(ar, pax.data, pax.len);
+  writePadding(ar, pax.len);
+  free(pax.data);
+
+  mtime = entry->modified > FT_EPOCH ? (entry->modified - FT_EPOCH) / FT_SECOND : 0;
+  fillHeader(&header, name, entry->dir ? '5' : '0', entry->mode, stored, mtime, NULL);
+  writeData(ar, &header, sizeof(header));
+
+  ar->_remaining = stored;
+  ar->_written = 0;
+
+  if(entry->map)
+  {
+    fprintf(ar->f, "%u\n", entry->mapCount);
+    for(i = 0; i < entry->mapCount; i++)
+    {
+      printNumber(num, entry->map[i * 2]);
+      fprintf(ar->f, "%s\n", num);
+      printNumber(num, entry->map[(i * 2) + 1]);
+      fprintf(ar->f, "%s\n", num);
+    }
+
+    writePadding(ar, mapLen);
+    mapLen += (kArchive_Block - (mapLen % kArchive_Block)) % kArchive_Block;
+    ar->_remaining -= mapLen;
+    ar->_written += mapLen;
+  }
+}
+
+void archive_link(archive* ar, archive_entry* entry, const fchar_t* target)
+{
+  ustar_header header;
+  paxbuf pax;
+  char path[(MAX_PATH * 4) + 1];
+  char link[(MAX_PATH * 4) + 1];
+  uint64 mtime;
+
+  ASSERT(ar->_remaining == 0);
+
+  if(ar->pack)
+  {
+    pack_link(ar->pack, entry, target);
+    return;
+  }
+
+  utf8Path(entry->path, path, sizeof(path));
+  utf8Path(target, link, sizeof(link));
+
+  memset(&pax, 0, sizeof(pax));
+  addTime(&pax, "mtime", entry->modified);
+  addTime(&pax, "atime", entry->accessed);
+
+  if(!fitsHeader(path))
+    addRecord(&pax, "path", path);
+  if(!fitsHeader(link))
+    addRecord(&pax, "linkpath", link);
+
+  fillHeader(&header, "././@PaxHeader", 'x', 0644, pax.len, 0, NULL);
+  writeData(ar, &header, sizeof(header));
+  writeData(ar, pax.data, pax.len);
+  writePadding(ar, pax.len);
+  free(pax.data);
+
+  /* The link name goes in before the checksum is figured */
+  mtime = entry->modified > FT_EPOCH ? (entry->modified - FT_EPOCH) / FT_SECOND : 0;
+  fillHeader(&header, path, '1', entry->mode, 0, mtime, link);
+  writeData(ar, &header, sizeof(header));
+}
+
+void archive_write(archive* ar, const byte* data, size_t len)
+{
+  /* Never more than was promised in the header */
+  if(len > ar->_remaining)
+  {
+    ASSERT(false);
+    len = (size_t)ar->_remaining;
+  }
+
+  writeData(ar, data, len);
+  ar->_remaining -= len;
+  ar->_written += len;
+}
+
+void archive_zeros(archive* ar, uint64 len)
+{
+  static const byte zeros[kArchive_Block * 8] = { 0 };
+  size_t num;
+
+  while(len > 0)
+  {
+    num = len < sizeof(zeros) ? (size_t)len : sizeof(zeros);
+    archive_write(ar, zeros, num);
+    len -= num;
+  }
+}
+
+void archive_end(archive* ar)
+{
+  /* Whatever couldn't be read is filled in, the header said so */
+  if(ar->_remaining > 0)
+    archive_zeros(ar, ar->_remaining);
+
+  if(ar->pack)
+    pack_end(ar->pack);
+  else
+    writePadding(ar, ar->_written);
+
+  ar->_written = 0;
+}
+
+void archive_finish(archive* ar)
+{
+  static const byte zeros[kArchive_Block * 2] = { 0 };
+
+  if(ar->pack)
+  {
+    pack_finish(ar->pack);
+    return;
+  }
+
+  writeData(ar, zeros, sizeof(zeros));
+
+  if(fflush(ar->f) != 0)
+    err(1, "couldn't write to archive");
+}
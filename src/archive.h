@@ -0,0 +1,72 @@
+/* 
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ * 
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+
+#ifndef __ARCHIVE_H__
+#define __ARCHIVE_H__
+
+#include "usuals.h"
+
+/*
+ * Rescued files written as one pax (POSIX tar) archive instead of
+ * being created one by one. Holes in sparse files are left out, using 
+ * the GNU sparse 1.0 format. Or written to a pack, see pack.h
+ */
+struct _pack;
+typedef struct _archive
+{
+  FILE* f;
+  struct _pack* pack;       /* Goes to a pack instead */
+  uint64 _remaining;        /* Data still to come for this entry */
+  uint64 _written;          /* Data written for this entry so far */
+}
+archive;
+
+typedef struct _archive_entry
+{
+  const fchar_t* path;      /* Slash separated, below the top */
+  bool dir;
+  int mode;
+  uint64 size;              /* The full length of the file */
+  uint64 created;           /* NTFS times */
+  uint64 modified;
+  uint64 accessed;
+
+  /* Offset and length pairs of the data present, NULL if not sparse */
+  uint64* map;
+  uint32 mapCount;
+}
+archive_entry;
+
+void archive_init(archive* ar, FILE* f);
+void archive_initpack(archive* ar, struct _pack* pack);
+
+/* Start an entry. Data for the entry is then written in order */
+void archive_begin(archive* ar, archive_entry* entry);
+void archive_write(archive* ar, const byte* data, size_t len);
+void archive_zeros(archive* ar, uint64 len);
+void archive_end(archive* ar);
+
+/* Another name for a file already in the archive */
+void archive_link(archive* ar, archive_entry* entry, const fchar_t* target);
+
+/* Write the end of the archive */
+void archive_finish(archive* ar);
+
+#endif /* __ARCHIVE_H__ */
@@ -0,0 +1,256 @@
+/* 
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ * 
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+
+#include "usuals.h"
+#include "ntfs.h"
+#include "ntfsx.h"
+#include "catalog.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+/*
+ * The catalog is written as JSON lines, one object per file. Times
+ * are in UTC, extents are [vcn, lcn, length] in clusters, with a
+ * null lcn for sparse runs.
+ */
+
+#define FT_SECOND       10000000LL
+#define FT_DAY          (FT_SECOND * 86400)
+
+void catalog_string(FILE* f, const fchar_t* str)
+{
+  const unsigned char* c;
+#ifdef FC_WIDE
+  char buf[(MAX_PATH * 4) + 1];
+  if(!WideCharToMultiByte(CP_UTF8, 0, str, -1, buf, sizeof(buf), NULL, NULL))
+    buf[0] = 0;
+  c = (const unsigned char*)buf;
+#else
+  c = (const unsigned char*)str;
+#endif
+
+  fputc('"', f);
+
+  for(; *c; c++)
+  {
+    if(*c == '"' || *c == '\\')
+      fprintf(f, "\\%c", *c);
+    else if(*c < 0x20)
+      fprintf(f, "\\u%04x", *c);
+    else
+      fputc(*c, f);
+  }
+
+  fputc('"', f);
+}
+
+void catalog_time(FILE* f, const char* name, uint64 ft)
+{
+  int64 days, z, era, doe, yoe, doy, mp, y, m, d;
+  uint64 rem;
+
+  fprintf(f, ",\"%s\":", name);
+
+  if(ft == 0)
+  {
+    fprintf(f, "null");
+    return;
+  }
+
+  /* Days since 1601, then the civil date from days */
+  days = (int64)(ft / FT_DAY);
+  rem = ft % FT_DAY;
+
+  z = days - 134774 + 719468;
+  era = (z >= 0 ? z : z - 146096) / 146097;
+  doe = z - era * 146097;
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp = (5 * doy + 2) / 153;
+  d = doy - (153 * mp + 2) / 5 + 1;
+  m = mp < 10 ? mp + 3 : mp - 9;
+  y = yoe + era * 400 + (m <= 2);
+
+  fprintf(f, "\"%04d-%02d-%02dT%02d:%02d:%02d.%07dZ\"", 
+          (int)y, (int)m, (int)d, 
+          (int)(rem / (FT_SECOND * 3600)), (int)((rem / (FT_SECOND * 60)) % 60),
+          (int)((rem / FT_SECOND) % 60), (int)(rem % FT_SECOND));
+}
+
+void catalog_number(FILE* f, const char* name, uint64 num)
+{
+#ifdef _WIN32
+  fprintf(f, ",\"%s\":%I64u", name, num);
+#else
+  fprintf(f, ",\"%s\":%llu", name, (unsigned long long)num);
+#endif
+}
+
+static void writeExtents(FILE* f, ntfsx_record* record)
+{
+  ntfsx_attrib_enum* attrenum;
+  ntfsx_attribute* attr;
+  ntfsx_datarun* datarun;
+  ntfs_attribheader* attrhead;
+  ntfs_attribnonresident* nonres;
+  bool first = true;
+  uint64 vcn;
+
+  fprintf(f, ",\"extents\":[");
+
+  attrenum = ntfsx_attrib_enum_alloc(kNTFS_DATA, true);
+
+  while((attr = ntfsx_attrib_enum_all(attrenum, record)) != NULL)
+  {
+    attrhead = ntfsx_attribute_header(attr);
+
+    /* Only the main data stream, not named ones */
+    if(attrhead->cName == 0 && attrhead->bNonResident)
+    {
+      nonres = (ntfs_attribnonresident*)attrhead;
+      vcn = nonres->startVCN;
+
+      datarun = ntfsx_attribute_getdatarun(attr);
+      if(datarun && ntfsx_datarun_first(datarun))
+      {
+        do
+        {
+#ifdef _WIN32
+          fprintf(f, first ? "[%I64u," : ",[%I64u,", vcn);
+          if(datarun->sparse)
+            fprintf(f, "null,%I64u]", datarun->length);
+          else
+            fprintf(f, "%I64u,%I64u]", datarun->cluster, datarun->length);
+#else
+          fprintf(f, first ? "[%llu," : ",[%llu,", (unsigned long long)vcn);
+          if(datarun->sparse)
+            fprintf(f, "null,%llu]", (unsigned long long)datarun->length);
+          else
+            fprintf(f, "%llu,%llu]", (unsigned long long)datarun->cluster, 
+                    (unsigned long long)datarun->length);
+#endif
+          vcn += datarun->length;
+          first = false;
+        }
+        while(ntfsx_datarun_next(datarun));
+      }
+
+      if(datarun)
+        ntfsx_datarun_free(datarun);
+    }
+
+    ntfsx_attribute_free(attr);
+  }
+
+  ntfsx_attrib_enum_free(attrenum);
+
+  fprintf(f, "]");
+}
+
+static void writeSizes(FILE* f, ntfsx_record* record)
+{
+  ntfsx_attrib_enum* attrenum;
+  ntfsx_attribute* attr;
+  ntfs_attribheader* attrhead;
+  ntfs_attribnonresident* nonres;
+
+  attrenum = ntfsx_attrib_enum_alloc(kNTFS_DATA, true);
+
+  /* The sizes are in the first piece of the main data stream */
+  while((attr = ntfsx_attrib_enum_all(attrenum, record)) != NULL)
+  {
+    attrhead = ntfsx_attribute_header(attr);
+
+    if(attrhead->cName == 0)
+    {
+      if(attrhead->bNonResident)
+      {
+        nonres = (ntfs_attribnonresident*)attrhead;
+        catalog_number(f, "size", nonres->cbAttribData);
+        catalog_number(f, "initialized", nonres->cbInitData);
+        catalog_number(f, "allocated", nonres->cbAllocated);
+        fprintf(f, ",\"resident\":false");
+      }
+      else
+      {
+        catalog_number(f, "size", ntfsx_attribute_getresidentsize(attr));
+        fprintf(f, ",\"resident\":true");
+      }
+
+      if(attrhead->flags & kNTFS_AttrCompressed)
+        fprintf(f, ",\"compressed\":true");
+      if(attrhead->flags & kNTFS_AttrEncrypted)
+        fprintf(f, ",\"encrypted\":true");
+
+      ntfsx_attribute_free(attr);
+      break;
+    }
+
+    ntfsx_attribute_free(attr);
+  }
+
+  ntfsx_attrib_enum_free(attrenum);
+}
+
+void catalog_write(FILE* f, ntfsx_record* record, catalogentry* entry)
+{
+  ntfs_recordheader* header = ntfsx_record_header(record);
+  uint32 i;
+
+  fprintf(f, "{\"path\":");
+  catalog_string(f, entry->path);
+  fprintf(f, ",\"type\":\"%s\"", entry->dir ? "dir" : "file");
+
+  if(entry->ref != kInvalidSector)
+    catalog_number(f, "ref", entry->ref);
+  if(entry->parent != kInvalidSector)
+    catalog_number(f, "parent", entry->parent);
+
+  catalog_number(f, "sector", entry->sector);
+  catalog_number(f, "links", header->cHardlinks);
+
+  if(entry->numNames > 0)
+  {
+    fprintf(f, ",\"names\":[");
+    for(i = 0; i < entry->numNames; i++)
+    {
+      if(i > 0)
+        fputc(',', f);
+      catalog_string(f, entry->names[i]);
+    }
+    fputc(']', f);
+  }
+
+  catalog_number(f, "flags", entry->flags);
+
+  catalog_time(f, "created", entry->created);
+  catalog_time(f, "modified", entry->modified);
+  catalog_time(f, "accessed", entry->accessed);
+
+  if(!entry->dir)
+  {
+    writeSizes(f, record);
+    writeExtents(f, record);
+  }
+
+  fprintf(f, "}\n");
+}
@@ -0,0 +1,52 @@
+/* 
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ * 
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+
+#ifndef __CATALOG_H__
+#define __CATALOG_H__
+
+#include "drive.h"
+#include "ntfsx.h"
+
+/* What we know about a file apart from what's in its record */
+typedef struct _catalogentry
+{
+  uint64 sector;            /* Where the record is on the disk */
+  uint64 ref;               /* MFT index, or kInvalidSector */
+  uint64 parent;            /* MFT index of the parent directory */
+  const fchar_t* path;      /* Path below the partition root */
+  fchar_t** names;          /* Paths of the other hard links */
+  uint32 numNames;
+  bool dir;
+  uint64 created;
+  uint64 modified;
+  uint64 accessed;
+  uint32 flags;
+}
+catalogentry;
+
+/* JSON values, the latter two with a leading comma and name */
+void catalog_string(FILE* f, const fchar_t* str);
+void catalog_time(FILE* f, const char* name, uint64 ft);
+void catalog_number(FILE* f, const char* name, uint64 num);
+
+/* Writes one JSON line describing the file, with its data extents */
+void catalog_write(FILE* f, ntfsx_record* record, catalogentry* entry);
+
+#endif /* __CATALOG_H__ */
@@ -295,6 +295,19 @@ void* reallocf(void* ptr, size_t size)
 
 #endif
 
+#ifndef HAVE_PWRITE
+
+/* Not safe when the handle is shared, but no worse than seeking ourselves */
+int pwrite(int fd, const void* data, size_t len, int64 offset)
+{
+  if(lseek64(fd, offset, SEEK_SET) == -1)
+    return -1;
+
+  return write(fd, data, len);
+}
+
+#endif
+
 #ifndef HAVE_MALLOCF
 
 void* mallocf(size_t size)
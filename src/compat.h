@@ -195,6 +195,10 @@ void vwarnx(const char *fmt, va_list ap);
 void* reallocf(void* p, size_t sz);
 #endif
 
+#ifndef HAVE_PWRITE
+int pwrite(int fd, const void* data, size_t len, int64 offset);
+#endif
+
 #ifndef HAVE_MALLOCF
 void* mallocf(size_t sz);
 #endif
@@ -289,6 +293,9 @@ void* mallocf(size_t sz);
     #endif
   #endif
 
+  /* In win32.c, sets errno */
+  int fc_link(const fchar_t* from, const fchar_t* to);
+
   #define fcscpy wcscpy
   #define fcscat wcscat
   #define fcsncpy wcsncpy
@@ -297,6 +304,7 @@ void* mallocf(size_t sz);
   #define itofc itow
 
   #define FC_DOT L"."
+  #define FC_SLASH L'/'
 
 #else
 
@@ -306,6 +314,7 @@ void* mallocf(size_t sz);
   #define fc_chdir chdir
   #define fc_mkdir mkdir
   #define fc_getcwd getcwd
+  #define fc_link link
 
   #define fcscpy strcpy
   #define fcsncpy strncpy
@@ -315,6 +324,7 @@ void* mallocf(size_t sz);
   #define itofc itoa
 
   #define FC_DOT "."
+  #define FC_SLASH '/'
 
 #endif
 
@@ -334,6 +344,10 @@ void* mallocf(size_t sz);
   #endif
 #endif
 
+#ifdef _WIN32
+  #define ftruncate _chsize_s
+#endif
+
 #include <fcntl.h>
 #ifdef O_LARGEFILE
   #define OPEN_LARGE_OPTS O_LARGEFILE
@@ -0,0 +1,305 @@
+/* 
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ * 
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+#define _LARGEFILE_SOURCE
+#define _FILE_OFFSET_BITS 64
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE       /* For O_DIRECT */
+#endif
+
+#include "usuals.h"
+#include "device.h"
+#include "filter.h"
+#include "stats.h"
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+/* Kept just in front of each aligned buffer */
+typedef struct _device_buf
+{
+  void* mem;                /* What was actually allocated */
+  size_t len;
+}
+device_buf;
+
+static void* g_pool[kDevice_PoolSize];
+static uint32 g_poolCount = 0;
+
+#define BUF_HEADER(p)   (((device_buf*)(p)) - 1)
+#define ALIGN_DOWN(x)   ((x) & ~((uint64)kDevice_Align - 1))
+#define ALIGN_UP(x)     ALIGN_DOWN((x) + kDevice_Align - 1)
+#define IS_ALIGNED(x)   (((x) & (kDevice_Align - 1)) == 0)
+
+void* device_alloc(size_t len)
+{
+  device_buf* header;
+  byte* mem;
+  byte* buf;
+  uint32 i;
+
+  /* The most recently freed buffer that's big enough */
+  for(i = g_poolCount; i > 0; i--)
+  {
+    buf = (byte*)g_pool[i - 1];
+    if(BUF_HEADER(buf)->len >= len)
+    {
+      g_pool[i - 1] = g_pool[--g_poolCount];
+      return buf;
+    }
+  }
+
+  mem = (byte*)mallocf(len + kDevice_Align + sizeof(device_buf));
+  buf = mem + sizeof(device_buf);
+  buf += (kDevice_Align - ((size_t)buf & (kDevice_Align - 1))) & (kDevice_Align - 1);
+
+  header = BUF_HEADER(buf);
+  header->mem = mem;
+  header->len = len;
+  return buf;
+}
+
+void device_free(void* buf)
+{
+  uint32 smallest = 0;
+  uint32 i;
+
+  if(!buf)
+    return;
+
+  if(g_poolCount < kDevice_PoolSize)
+  {
+    g_pool[g_poolCount++] = buf;
+    return;
+  }
+
+  /* The pool is full, so keep the bigger buffers */
+  for(i = 1; i < g_poolCount; i++)
+  {
+    if(BUF_HEADER(g_pool[i])->len < BUF_HEADER(g_pool[smallest])->len)
+      smallest = i;
+  }
+
+  if(BUF_HEADER(g_pool[smallest])->len < BUF_HEADER(buf)->len)
+  {
+    free(BUF_HEADER(g_pool[smallest])->mem);
+    g_pool[smallest] = buf;
+  }
+  else
+  {
+    free(BUF_HEADER(buf)->mem);
+  }
+}
+
+void device_defaults(iogeometry* io)
+{
+  io->readSize = kDevice_ReadSize;
+  io->ahead = kDevice_Ahead;
+  io->writeSize = kDevice_WriteSize;
+  io->memory = kDevice_Memory;
+}
+
+bool device_setgeometry(iogeometry* io, const char* spec)
+{
+  const char* e = spec;
+  const char* key;
+  const char* value;
+  uint64 num;
+  char* end;
+  size_t len;
+
+  while(*e)
+  {
+    key = e;
+    len = strcspn(key, "=");
+    if(key[len] != '=')
+      return false;
+    value = key + len + 1;
+
+    /* The number of reads ahead is a plain number, the rest are sizes */
+    if(len == 5 && !strncmp(key, "ahead", len))
+    {
+      num = strtoull(value, &end, 10);
+      if(end == value || num > 0x100)
+        return false;
+
+      io->ahead = (uint32)num;
+      e = end;
+    }
+
+    else
+    {
+      if(!filter_parsesize(value, &e, &num))
+        return false;
+
+      /* Reads are whole sectors */
+      if(len == 4 && !strncmp(key, "read", len))
+      {
+        if(num < kSectorSize || num > 0x4000000 || num % kSectorSize)
+          return false;
+        io->readSize = (uint32)num;
+      }
+      else if(len == 5 && !strncmp(key, "write", len))
+      {
+        if(num < kSectorSize || num > 0x4000000)
+          return false;
+        io->writeSize = (uint32)num;
+      }
+      else if(len == 6 && !strncmp(key, "memory", len))
+      {
+        if(num < 0x100000)
+          return false;
+        io->memory = num;
+      }
+      else
+      {
+        return false;
+      }
+    }
+
+    if(*e == ',')
+      e++;
+    else if(*e)
+      return false;
+  }
+
+  /* Has to hold at least one write */
+  return io->memory >= io->writeSize;
+}
+
+static int readAt(int dd, uint64 pos, void* data, size_t len)
+{
+  if(lseek64(dd, pos, SEEK_SET) == -1)
+    return -1;
+
+  return read(dd, data, len);
+}
+
+int device_open(const char* name, bool* direct)
+{
+  int dd;
+#ifdef O_DIRECT
+  void* buf;
+#endif
+
+  if(*direct)
+  {
+#if defined(O_DIRECT)
+    dd = open(name, O_BINARY | O_RDONLY | OPEN_LARGE_OPTS | O_DIRECT);
+    if(dd != -1)
+    {
+      /* Some file systems let us open this way, but not read */
+      buf = device_alloc(kDevice_Align);
+      if(readAt(dd, 0, buf, kDevice_Align) != -1 || errno != EINVAL)
+      {
+        device_free(buf);
+        return dd;
+      }
+
+      device_free(buf);
+      close(dd);
+    }
+
+    else if(errno != EINVAL)
+      return -1;
+
+#elif defined(F_NOCACHE)
+    dd = open(name, O_BINARY | O_RDONLY | OPEN_LARGE_OPTS);
+    if(dd == -1 || fcntl(dd, F_NOCACHE, 1) != -1)
+      return dd;
+    close(dd);
+#endif
+
+    warnx("can't read the disk directly, using the system cache");
+    *direct = false;
+  }
+
+  return open(name, O_BINARY | O_RDONLY | OPEN_LARGE_OPTS);
+}
+
+void device_advise(int dd, bool direct, uint64 pos, uint64 len, int advice)
+{
+#ifdef HAVE_POSIX_FADVISE
+  if(direct)
+    return;
+
+  switch(advice)
+  {
+  case kDevice_WillNeed:
+    posix_fadvise(dd, pos, len, POSIX_FADV_WILLNEED);
+    break;
+  case kDevice_DontNeed:
+    posix_fadvise(dd, pos, len, POSIX_FADV_DONTNEED);
+    break;
+  case kDevice_Sequential:
+    posix_fadvise(dd, pos, len, POSIX_FADV_SEQUENTIAL);
+    break;
+  };
+#endif
+}
+
+static int readDevice(int dd, bool direct, uint64 pos, void* data, size_t len)
+{
+  uint64 start;
+  size_t whole;
+  int num;
+  byte* buf;
+
+  if(!direct || (IS_ALIGNED(pos) && IS_ALIGNED(len) && IS_ALIGNED((size_t)data)))
+    return readAt(dd, pos, data, len);
+
+  /* Read all of the blocks it's in, then copy out the part we want */
+  start = ALIGN_DOWN(pos);
+  whole = (size_t)(ALIGN_UP(pos + len) - start);
+  buf = (byte*)device_alloc(whole);
+
+  num = readAt(dd, start, buf, whole);
+
+  /* Short at the end of the disk */
+  if(num != -1)
+  {
+    if((uint64)num <= pos - start)
+      num = 0;
+    else
+      num = (int)min((uint64)num - (pos - start), (uint64)len);
+
+    memcpy(data, buf + (pos - start), num);
+  }
+
+  device_free(buf);
+  return num;
+}
+
+int device_read(int dd, bool direct, uint64 pos, void* data, size_t len)
+{
+  uint64 entered = stats_enter(kStats_Read);
+  int num = readDevice(dd, direct, pos, data, len);
+
+  stats_leave(kStats_Read, entered);
+  stats_read(pos, entered, num);
+  stats_count(kStats_Reads, 1);
+
+  if(num == -1)
+    stats_count(kStats_ReadErrors, 1);
+  else
+    stats_count(kStats_BytesRead, num);
+
+  return num;
+}
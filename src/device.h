@@ -0,0 +1,77 @@
+/* 
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ * 
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+#ifndef __DEVICE_H__
+#define __DEVICE_H__
+
+#include "usuals.h"
+#include "drive.h"
+
+/*
+ * Reading the disk directly (O_DIRECT) keeps a multi terabyte rescue 
+ * from pushing everything else out of the system cache. That needs 
+ * reads and buffers aligned to the disk's blocks. Reads that aren't 
+ * go through an aligned buffer of their own.
+ */
+
+/* What direct reads and buffers are aligned to */
+#define kDevice_Align       0x1000
+
+/* How many free buffers are kept around for reuse */
+#define kDevice_PoolSize    8
+
+/* Default I/O geometry */
+#define kDevice_ReadSize    0x100000
+#define kDevice_Ahead       8
+#define kDevice_WriteSize   0x40000
+#define kDevice_Memory      0x1000000
+
+/* Hints about how the disk is going to be read */
+#define kDevice_WillNeed    1     /* About to be read */
+#define kDevice_DontNeed    2     /* Done with, no need to keep it cached */
+#define kDevice_Sequential  3     /* Read from start to end */
+
+void device_defaults(iogeometry* io);
+
+/* 
+ * Change the geometry from a string like "read=4M,ahead=16". Returns
+ * false when it's not valid.
+ */
+bool device_setgeometry(iogeometry* io, const char* spec);
+
+/* 
+ * Open the disk for reading. When direct is set we try to read it 
+ * directly, and it's cleared if that's not supported.
+ */
+int device_open(const char* name, bool* direct);
+
+/* Read from the disk like read(). Returns -1 and sets errno on failure */
+int device_read(int dd, bool direct, uint64 pos, void* data, size_t len);
+
+/* 
+ * Pass on a hint to the system about reading the disk. Without the 
+ * system cache (when reading directly) there's no point.
+ */
+void device_advise(int dd, bool direct, uint64 pos, uint64 len, int advice);
+
+/* Aligned buffers, reused where possible. Not thread safe */
+void* device_alloc(size_t len);
+void device_free(void* buf);
+
+#endif /* __DEVICE_H__ */
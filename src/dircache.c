@@ -0,0 +1,844 @@
+/* 
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ * 
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+#include "usuals.h"
+#include "drive.h"
+#include "dircache.h"
+#include "stats.h"
+
+#include <sys/stat.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_DIRENT_H
+#include <dirent.h>
+#endif
+
+#ifdef _WIN32
+#include <wctype.h>
+#define namecmp _wcsicmp
+#define namechar(c) towlower(c)
+#else
+#define namecmp fcscmp
+#define namechar(c) (c)
+#endif
+
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0
+#endif
+
+#define DIRCACHE_PENDING    0       /* Not made yet */
+#define DIRCACHE_MADE       1       /* We made it */
+#define DIRCACHE_EXISTED    2       /* Was already there */
+
+/* Deeper than this and the parents must be looping */
+#define kDirCache_MaxDepth  0x100
+
+/* The names used in a directory */
+typedef struct _dircache_name
+{
+  struct _dircache_name* _next;
+  uint32 hash;
+  uint32 suffix;                    /* The next suffix to try for this name */
+  fchar_t name[1];
+}
+dircache_name;
+
+typedef struct _dircache_names
+{
+  dircache_name** _buckets;
+  uint32 _numBuckets;
+  uint32 _count;
+}
+dircache_names;
+
+typedef struct _dircache_entry
+{
+  uint64 ref;
+  uint64 parent;
+  fchar_t* name;                    /* NULL when just an alias for the parent */
+  int fd;                           /* Open directory or -1 */
+  int state;                        /* Whether it's been made yet */
+  dircache_names* names;            /* Loaded when files are created */
+
+  struct _dircache_entry* _next;    /* In the hash bucket */
+  struct _dircache_entry* _older;   /* In the open list */
+  struct _dircache_entry* _newer;
+}
+dircache_entry;
+
+static uint32 hashRef(uint64 ref, uint32 buckets)
+{
+  /* Buckets is always a power of two */
+  return (uint32)((ref * 0x9E3779B97F4A7C15ULL) >> 32) & (buckets - 1);
+}
+
+static dircache_entry* findEntry(dircache* cache, uint64 ref)
+{
+  dircache_entry* entry;
+
+  if(!cache->_buckets)
+    return NULL;
+
+  for(entry = cache->_buckets[hashRef(ref, cache->_numBuckets)];
+      entry; entry = entry->_next)
+  {
+    if(entry->ref == ref)
+      return entry;
+  }
+
+  return NULL;
+}
+
+static void growBuckets(dircache* cache)
+{
+  dircache_entry** buckets;
+  dircache_entry* entry;
+  dircache_entry* next;
+  uint32 num;
+  uint32 i, h;
+
+  num = cache->_numBuckets ? cache->_numBuckets * 2 : 0x100;
+  buckets = (dircache_entry**)mallocf(sizeof(dircache_entry*) * num);
+  memset(buckets, 0, sizeof(dircache_entry*) * num);
+
+  for(i = 0; i < cache->_numBuckets; i++)
+  {
+    for(entry = cache->_buckets[i]; entry; entry = next)
+    {
+      next = entry->_next;
+      h = hashRef(entry->ref, num);
+      entry->_next = buckets[h];
+      buckets[h] = entry;
+    }
+  }
+
+  if(cache->_buckets)
+    free(cache->_buckets);
+
+  cache->_buckets = buckets;
+  cache->_numBuckets = num;
+}
+
+static uint32 hashName(const fchar_t* name)
+{
+  /* FNV-1a */
+  uint32 h = 0x811C9DC5;
+
+  for(; *name; name++)
+  {
+    h ^= (uint32)namechar(*name);
+    h *= 0x01000193;
+  }
+
+  return h;
+}
+
+static dircache_name* findName(dircache_names* names, const fchar_t* name, uint32 h)
+{
+  dircache_name* n;
+
+  if(!names->_buckets)
+    return NULL;
+
+  for(n = names->_buckets[h & (names->_numBuckets - 1)]; n; n = n->_next)
+  {
+    if(n->hash == h && !namecmp(n->name, name))
+      return n;
+  }
+
+  return NULL;
+}
+
+static dircache_name* addName(dircache_names* names, const fchar_t* name, uint32 h)
+{
+  dircache_name** buckets;
+  dircache_name* n;
+  dircache_name* next;
+  uint32 num;
+  uint32 i;
+
+  n = findName(names, name, h);
+  if(n)
+    return n;
+
+  if(names->_count >= names->_numBuckets)
+  {
+    num = names->_numBuckets ? names->_numBuckets * 2 : 0x20;
+    buckets = (dircache_name**)mallocf(sizeof(dircache_name*) * num);
+    memset(buckets, 0, sizeof(dircache_name*) * num);
+
+    for(i = 0; i < names->_numBuckets; i++)
+    {
+      for(n = names->_buckets[i]; n; n = next)
+      {
+        next = n->_next;
+        n->_next = buckets[n->hash & (num - 1)];
+        buckets[n->hash & (num - 1)] = n;
+      }
+    }
+
+    if(names->_buckets)
+      free(names->_buckets);
+
+    names->_buckets = buckets;
+    names->_numBuckets = num;
+  }
+
+  n = (dircache_name*)mallocf(sizeof(dircache_name) + (sizeof(fchar_t) * fcslen(name)));
+  n->hash = h;
+  n->suffix = 0;
+  fcscpy(n->name, name);
+
+  n->_next = names->_buckets[h & (names->_numBuckets - 1)];
+  names->_buckets[h & (names->_numBuckets - 1)] = n;
+  names->_count++;
+  return n;
+}
+
+static void freeNames(dircache_names* names)
+{
+  dircache_name* n;
+  dircache_name* next;
+  uint32 i;
+
+  for(i = 0; i < names->_numBuckets; i++)
+  {
+    for(n = names->_buckets[i]; n; n = next)
+    {
+      next = n->_next;
+      free(n);
+    }
+  }
+
+  if(names->_buckets)
+    free(names->_buckets);
+  free(names);
+}
+
+void dircache_init(dircache* cache, uint64 rootRef, int mode)
+{
+  memset(cache, 0, sizeof(dircache));
+  cache->rootRef = rootRef;
+  cache->mode = mode;
+  cache->root = -1;
+
+#ifdef DIRCACHE_AT
+  /* The output directory is the current directory */
+  cache->root = open(".", O_RDONLY | O_DIRECTORY);
+  if(cache->root == -1)
+    err(1, "couldn't open output directory");
+#endif
+}
+
+void dircache_destroy(dircache* cache)
+{
+  dircache_entry* entry;
+  dircache_entry* next;
+  uint32 i;
+
+  for(i = 0; i < cache->_numBuckets; i++)
+  {
+    for(entry = cache->_buckets[i]; entry; entry = next)
+    {
+      next = entry->_next;
+
+      if(entry->fd != -1)
+        close(entry->fd);
+      if(entry->name)
+        free(entry->name);
+      if(entry->names)
+        freeNames(entry->names);
+      free(entry);
+    }
+  }
+
+  if(cache->_buckets)
+    free(cache->_buckets);
+
+  if(cache->_rootNames)
+    freeNames(cache->_rootNames);
+
+  if(cache->root != -1)
+    close(cache->root);
+
+  memset(cache, 0, sizeof(dircache));
+  cache->root = -1;
+}
+
+bool dircache_known(dircache* cache, uint64 ref)
+{
+  return ref == cache->rootRef || findEntry(cache, ref) != NULL;
+}
+
+void dircache_add(dircache* cache, uint64 ref, uint64 parent, const fchar_t* name)
+{
+  dircache_entry* entry;
+  uint32 h;
+
+  ASSERT(ref != cache->rootRef);
+
+  if(cache->_count >= cache->_numBuckets)
+    growBuckets(cache);
+
+  entry = (dircache_entry*)mallocf(sizeof(dircache_entry));
+  memset(entry, 0, sizeof(dircache_entry));
+  entry->ref = ref;
+  entry->parent = parent;
+  entry->fd = -1;
+  entry->state = DIRCACHE_PENDING;
+
+  if(name)
+  {
+    entry->name = (fchar_t*)mallocf(sizeof(fchar_t) * (fcslen(name) + 1));
+    fcscpy(entry->name, name);
+  }
+
+  h = hashRef(ref, cache->_numBuckets);
+  entry->_next = cache->_buckets[h];
+  cache->_buckets[h] = entry;
+  cache->_count++;
+}
+
+/* Follows aliases to the directory things actually go in */
+static dircache_entry* realEntry(dircache* cache, uint64 ref)
+{
+  dircache_entry* entry;
+  int depth;
+
+  for(depth = 0; depth < kDirCache_MaxDepth; depth++)
+  {
+    if(ref == cache->rootRef)
+      return NULL;
+
+    entry = findEntry(cache, ref);
+    if(!entry || entry->name)
+      return entry;
+
+    ref = entry->parent;
+  }
+
+  return NULL;
+}
+
+static int buildPath(dircache* cache, uint64 ref, fchar_t sep, fchar_t* path,
+                     size_t len, int depth)
+{
+  dircache_entry* entry;
+  size_t nlen;
+  int pos;
+
+  entry = realEntry(cache, ref);
+  if(!entry || depth >= kDirCache_MaxDepth)
+  {
+    path[0] = 0;
+    return 0;
+  }
+
+  pos = buildPath(cache, entry->parent, sep, path, len, depth + 1);
+  if(pos == -1)
+    return -1;
+
+  nlen = fcslen(entry->name);
+  if(pos + nlen + 2 > len)
+    return -1;
+
+  if(pos > 0)
+    path[pos++] = sep;
+
+  fcscpy(path + pos, entry->name);
+  return pos + nlen;
+}
+
+bool dircache_path(dircache* cache, uint64 ref, fchar_t sep, fchar_t* path, size_t len)
+{
+  return buildPath(cache, ref, sep, path, len, 0) != -1;
+}
+
+/* Remember something we made, if the directory's names are loaded */
+static void madeName(dircache* cache, uint64 parent, const fchar_t* name)
+{
+  dircache_entry* entry;
+  dircache_names* names;
+
+  entry = realEntry(cache, parent);
+  names = entry ? entry->names : cache->_rootNames;
+
+  if(names)
+    addName(names, name, hashName(name));
+}
+
+#ifdef DIRCACHE_AT
+
+static void unlinkOpen(dircache* cache, dircache_entry* entry)
+{
+  if(entry->_newer)
+    entry->_newer->_older = entry->_older;
+  else
+    cache->_first = entry->_older;
+
+  if(entry->_older)
+    entry->_older->_newer = entry->_newer;
+  else
+    cache->_last = entry->_newer;
+
+  entry->_newer = entry->_older = NULL;
+}
+
+static void linkOpen(dircache* cache, dircache_entry* entry)
+{
+  entry->_older = cache->_first;
+  entry->_newer = NULL;
+
+  if(cache->_first)
+    cache->_first->_newer = entry;
+  cache->_first = entry;
+
+  if(!cache->_last)
+    cache->_last = entry;
+}
+
+static int entryHandle(dircache* cache, uint64 ref, int depth)
+{
+  dircache_entry* entry;
+  dircache_entry* old;
+  int pfd;
+
+  entry = realEntry(cache, ref);
+  if(!entry || depth >= kDirCache_MaxDepth)
+    return cache->root;
+
+  /* Most recently used goes to the front */
+  if(entry->fd != -1)
+  {
+    unlinkOpen(cache, entry);
+    linkOpen(cache, entry);
+    return entry->fd;
+  }
+
+  pfd = entryHandle(cache, entry->parent, depth + 1);
+  if(pfd == -1)
+    return -1;
+
+  entry->fd = openat(pfd, entry->name, O_RDONLY | O_DIRECTORY);
+  if(entry->fd == -1)
+    return -1;
+
+  /* Close the least recently used, but never this one */
+  if(cache->_open >= kDirCache_MaxOpen)
+  {
+    old = cache->_last;
+    unlinkOpen(cache, old);
+    close(old->fd);
+    old->fd = -1;
+    cache->_open--;
+  }
+
+  linkOpen(cache, entry);
+  cache->_open++;
+  return entry->fd;
+}
+
+static int makeDirectory(dircache* cache, uint64 parent, const fchar_t* name)
+{
+  int pfd = entryHandle(cache, parent, 0);
+  if(pfd == -1)
+    return -1;
+
+  return mkdirat(pfd, name, cache->mode);
+}
+
+static int makeLink(dircache* cache, uint64 fromParent, const fchar_t* fromName,
+                    uint64 parent, const fchar_t* name)
+{
+  int pfd = entryHandle(cache, parent, 0);
+  int ffd = entryHandle(cache, fromParent, 0);
+  if(pfd == -1 || ffd == -1)
+    return -1;
+
+  return linkat(ffd, fromName, pfd, name, 0);
+}
+
+int dircache_open(dircache* cache, uint64 parent, const fchar_t* name, int flags, int mode)
+{
+  int pfd = entryHandle(cache, parent, 0);
+  if(pfd == -1)
+    return -1;
+
+  return openat(pfd, name, flags, mode);
+}
+
+#else /* DIRCACHE_AT */
+
+static bool fullPath(dircache* cache, uint64 parent, const fchar_t* name,
+                     fchar_t* path, size_t len)
+{
+  size_t pos;
+
+  if(!dircache_path(cache, parent, FC_SLASH, path, len))
+    return false;
+
+  pos = fcslen(path);
+  if(pos + fcslen(name) + 2 > len)
+    return false;
+
+  if(pos > 0)
+    path[pos++] = FC_SLASH;
+
+  fcscpy(path + pos, name);
+  return true;
+}
+
+static int makeDirectory(dircache* cache, uint64 parent, const fchar_t* name)
+{
+  fchar_t path[MAX_PATH + 1];
+
+  if(!fullPath(cache, parent, name, path, MAX_PATH))
+  {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+#ifdef _WIN32
+  return fc_mkdir(path);
+#else
+  return fc_mkdir(path, cache->mode);
+#endif
+}
+
+static int makeLink(dircache* cache, uint64 fromParent, const fchar_t* fromName,
+                    uint64 parent, const fchar_t* name)
+{
+  fchar_t from[MAX_PATH + 1];
+  fchar_t path[MAX_PATH + 1];
+
+  if(!fullPath(cache, fromParent, fromName, from, MAX_PATH) ||
+     !fullPath(cache, parent, name, path, MAX_PATH))
+  {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  return fc_link(from, path);
+}
+
+int dircache_open(dircache* cache, uint64 parent, const fchar_t* name, int flags, int mode)
+{
+  fchar_t path[MAX_PATH + 1];
+
+  if(!fullPath(cache, parent, name, path, MAX_PATH))
+  {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  return fc_open(path, flags, mode);
+}
+
+#endif /* DIRCACHE_AT */
+
+static void ensureEntry(dircache* cache, dircache_entry* entry, int depth)
+{
+  uint64 entered;
+  int r = -1;
+
+  if(!entry || entry->state != DIRCACHE_PENDING)
+    return;
+
+  /* Something's looping, so put it in the top directory */
+  if(depth >= kDirCache_MaxDepth)
+    entry->parent = cache->rootRef;
+  else
+    ensureEntry(cache, realEntry(cache, entry->parent), depth + 1);
+
+  if(!cache->pretend)
+  {
+    entered = stats_enter(kStats_Dirs);
+    r = makeDirectory(cache, entry->parent, entry->name);
+    stats_leave(kStats_Dirs, entered);
+  }
+
+  if(cache->pretend)
+  {
+    entry->state = DIRCACHE_MADE;
+    madeName(cache, entry->parent, entry->name);
+  }
+
+  else if(r != -1)
+  {
+    entry->state = DIRCACHE_MADE;
+    madeName(cache, entry->parent, entry->name);
+    stats_count(kStats_Directories, 1);
+  }
+
+  /* An existing directory with the same name is used as is */
+  else if(errno == EEXIST)
+  {
+    entry->state = DIRCACHE_EXISTED;
+  }
+
+  else
+  {
+    warn("couldn't create directory '" FC_PRINTF "' putting files in parent directory", entry->name);
+    free(entry->name);
+    entry->name = NULL;
+  }
+}
+
+void dircache_make(dircache* cache, uint64 ref)
+{
+  ensureEntry(cache, realEntry(cache, ref), 0);
+}
+
+bool dircache_made(dircache* cache, uint64 ref)
+{
+  dircache_entry* entry = findEntry(cache, ref);
+  return entry && entry->name && entry->state == DIRCACHE_MADE;
+}
+
+/* Fill in the names already in a directory */
+static void loadNames(dircache* cache, uint64 ref, dircache_names* names)
+{
+#if defined(DIRCACHE_AT) && defined(HAVE_FDOPENDIR)
+  struct dirent* ent;
+  DIR* dir;
+  int fd;
+
+  fd = entryHandle(cache, ref, 0);
+  if(fd == -1 || (fd = dup(fd)) == -1)
+    return;
+
+  dir = fdopendir(fd);
+  if(!dir)
+  {
+    close(fd);
+    return;
+  }
+
+  /* The duplicate handle shares the position */
+  rewinddir(dir);
+
+  while((ent = readdir(dir)) != NULL)
+    addName(names, ent->d_name, hashName(ent->d_name));
+
+  closedir(dir);
+
+#elif defined(_WIN32)
+  fchar_t path[MAX_PATH + 1];
+  struct _wfinddata_t data;
+  intptr_t find;
+  size_t len;
+
+  if(!dircache_path(cache, ref, FC_SLASH, path, MAX_PATH - 2))
+    return;
+
+  len = fcslen(path);
+  if(len == 0)
+    path[len++] = L'.';
+  path[len++] = FC_SLASH;
+  path[len++] = L'*';
+  path[len] = 0;
+
+  find = _wfindfirst(path, &data);
+  if(find == -1)
+    return;
+
+  do
+    addName(names, data.name, hashName(data.name));
+  while(_wfindnext(find, &data) == 0);
+
+  _findclose(find);
+
+#elif defined(HAVE_DIRENT_H)
+  fchar_t path[MAX_PATH + 1];
+  struct dirent* ent;
+  DIR* dir;
+
+  if(!dircache_path(cache, ref, FC_SLASH, path, MAX_PATH))
+    return;
+
+  dir = opendir(path[0] ? path : FC_DOT);
+  if(!dir)
+    return;
+
+  while((ent = readdir(dir)) != NULL)
+    addName(names, ent->d_name, hashName(ent->d_name));
+
+  closedir(dir);
+#endif
+}
+
+/* The names in a directory, read in the first time they're needed */
+static dircache_names* directoryNames(dircache* cache, uint64 ref)
+{
+  dircache_entry* entry;
+  dircache_names** names;
+
+  entry = realEntry(cache, ref);
+  names = entry ? &(entry->names) : &(cache->_rootNames);
+
+  if(!*names)
+  {
+    *names = (dircache_names*)mallocf(sizeof(dircache_names));
+    memset(*names, 0, sizeof(dircache_names));
+
+    /* Nothing's on the disk when we only pretend */
+    if(!cache->pretend)
+      loadNames(cache, entry ? entry->ref : cache->rootRef, *names);
+  }
+
+  return *names;
+}
+
+/* What's being made with a free name */
+typedef struct _dircache_new
+{
+  int flags;
+  int mode;
+  uint64 fromParent;          /* For links */
+  const fchar_t* fromName;
+}
+dircache_new;
+
+static int makeNamed(dircache* cache, uint64 parent, const fchar_t* name, 
+                     dircache_new* what)
+{
+  /* The name is only taken in the registry */
+  if(cache->pretend)
+    return 0;
+
+  if(what->fromName)
+  {
+    if(makeLink(cache, what->fromParent, what->fromName, parent, name) == -1)
+      return -1;
+
+    /* Something to return that's not an error */
+    return 0;
+  }
+
+  return dircache_open(cache, parent, name, what->flags | O_CREAT | O_EXCL, what->mode);
+}
+
+static int makeFreeName(dircache* cache, uint64 parent, fchar_t* name, size_t len, 
+                        dircache_new* what)
+{
+  fchar_t base[MAX_PATH + 1];
+  fchar_t num[0x10];
+  dircache_names* names;
+  dircache_name* first;
+  dircache_name* n;
+  uint32 h;
+  size_t blen;
+  int fd;
+
+  /* Parent directories are only made when something goes in them */
+  dircache_make(cache, parent);
+  names = directoryNames(cache, parent);
+
+  fcsncpy(base, name, MAX_PATH);
+  base[MAX_PATH] = 0;
+  blen = fcslen(base);
+
+  h = hashName(base);
+  first = findName(names, base, h);
+
+  for(;;)
+  {
+    /* 
+     * When the name is taken, go straight to the next suffix 
+     * that hasn't been used for it.
+     */
+    if(first)
+    {
+      do
+      {
+        itofc(first->suffix, num, 10);
+        first->suffix++;
+
+        if(blen + fcslen(num) + 2 > len)
+        {
+          errno = ENAMETOOLONG;
+          return -1;
+        }
+
+        fcscpy(name, base);
+        name[blen] = FC_DOT[0];
+        fcscpy(name + blen + 1, num);
+        h = hashName(name);
+      }
+      while(findName(names, name, h));
+    }
+
+    fd = makeNamed(cache, parent, name, what);
+
+    /* Something was there that we didn't know about */
+    if(fd == -1 && errno == EEXIST)
+    {
+      n = addName(names, name, h);
+      if(!first)
+        first = n;
+      continue;
+    }
+
+    if(fd != -1)
+    {
+      n = addName(names, name, h);
+      if(!first)
+        first = n;
+    }
+
+    return fd;
+  }
+}
+
+int dircache_create(dircache* cache, uint64 parent, fchar_t* name, size_t len, 
+                    int flags, int mode)
+{
+  dircache_new what;
+
+  memset(&what, 0, sizeof(what));
+  what.flags = flags;
+  what.mode = mode;
+
+  return makeFreeName(cache, parent, name, len, &what);
+}
+
+int dircache_link(dircache* cache, uint64 fromParent, const fchar_t* fromName, 
+                  uint64 parent, fchar_t* name, size_t len)
+{
+  dircache_new what;
+
+  memset(&what, 0, sizeof(what));
+  what.fromParent = fromParent;
+  what.fromName = fromName;
+
+  return makeFreeName(cache, parent, name, len, &what);
+}
+
+bool dircache_reserve(dircache* cache, uint64 parent, fchar_t* name, size_t len)
+{
+  dircache_new what;
+
+  ASSERT(cache->pretend);
+  memset(&what, 0, sizeof(what));
+
+  return makeFreeName(cache, parent, name, len, &what) != -1;
+}
@@ -0,0 +1,103 @@
+/* 
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ * 
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+#ifndef __DIRCACHE_H__
+#define __DIRCACHE_H__
+
+#include "usuals.h"
+
+/*
+ * Where we can, output directories are opened once and files are
+ * created relative to them. Otherwise we fall back to building paths.
+ */
+#if defined(HAVE_OPENAT) && defined(HAVE_MKDIRAT) && defined(HAVE_LINKAT) && \
+    !defined(FC_WIDE)
+  #define DIRCACHE_AT 1
+#endif
+
+/* How many directory handles are kept open at once */
+#define kDirCache_MaxOpen   0x80
+
+/*
+ * The output directories, keyed by the MFT reference of the
+ * directory they were rescued from.
+ */
+struct _dircache_entry;
+struct _dircache_names;
+typedef struct _dircache
+{
+  uint64 rootRef;                   /* The reference that is the output directory */
+  int root;                         /* Handle to the output directory */
+  int mode;                         /* Mode for new directories */
+  bool pretend;                     /* Only track what would be made */
+  struct _dircache_names* _rootNames;
+
+  struct _dircache_entry** _buckets;
+  uint32 _numBuckets;
+  uint32 _count;
+
+  /* Open directories, most recently used first */
+  struct _dircache_entry* _first;
+  struct _dircache_entry* _last;
+  uint32 _open;
+}
+dircache;
+
+void dircache_init(dircache* cache, uint64 rootRef, int mode);
+void dircache_destroy(dircache* cache);
+
+/* Whether a directory has been seen yet */
+bool dircache_known(dircache* cache, uint64 ref);
+
+/* 
+ * Add a directory. With no name files go in the parent directory. 
+ * It's not made until something is created in it.
+ */
+void dircache_add(dircache* cache, uint64 ref, uint64 parent, const fchar_t* name);
+
+/* Make a directory (and its parents) if not already there */
+void dircache_make(dircache* cache, uint64 ref);
+
+/* Whether we made a directory, rather than it being there already */
+bool dircache_made(dircache* cache, uint64 ref);
+
+/* The path of a directory below the output directory */
+bool dircache_path(dircache* cache, uint64 ref, fchar_t sep, fchar_t* path, size_t len);
+
+/* Open things in a directory. These return -1 and set errno */
+int dircache_open(dircache* cache, uint64 parent, const fchar_t* name, int flags, int mode);
+
+/* 
+ * Create a new file, adding a numeric suffix to the name when 
+ * it's already taken. The name buffer gets the name used. 
+ */
+int dircache_create(dircache* cache, uint64 parent, fchar_t* name, size_t len, 
+                    int flags, int mode);
+
+/* Hard link to a file already made, picking a free name the same way */
+int dircache_link(dircache* cache, uint64 fromParent, const fchar_t* fromName, 
+                  uint64 parent, fchar_t* name, size_t len);
+
+/* 
+ * When only pretending, take a free name the same way without 
+ * making anything. For archives, where names have to be unique too.
+ */
+bool dircache_reserve(dircache* cache, uint64 parent, fchar_t* name, size_t len);
+
+#endif /* __DIRCACHE_H__ */
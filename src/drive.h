@@ -33,6 +33,23 @@
 
 struct _ntfsx_mftmap;
 struct _drivelocks;
+struct _deferredmeta;
+struct _dircache;
+struct _filefilter;
+struct _mftsnapshot;
+struct _archive;
+struct _sweep;
+struct _writer;
+
+/* How the disk gets read and the output written */
+typedef struct _iogeometry
+{
+	uint32 readSize;       /* Most read from the disk at once (in bytes) */
+	uint32 ahead;          /* How many reads the disk is told about ahead */
+	uint32 writeSize;      /* Output is gathered into writes this big */
+	uint64 memory;         /* Memory for output waiting to be written, or data to sweep */
+}
+iogeometry;
 
 typedef struct _partitioninfo
 {
@@ -40,11 +57,23 @@ typedef struct _partitioninfo
 	uint64 end;            /* The end sector (in sectors) */
 	uint64 mft;            /* Offset into the MFT (in sectors) */
 	byte cluster;          /* Cluster size (in sectors) */
+	uint32 record;         /* MFT record size (in bytes) */
 	int device;            /* A handle to an open device */
+	bool direct;           /* Device reads bypass the system cache */
+	iogeometry io;
 
 	/* Some other context stuff about the drive */
 	struct _drivelocks* locks;
 	struct _ntfsx_mftmap* mftmap;
+	struct _ntfsx_records* records; /* MFT records already read from the disk */
+	struct _deferredmeta* deferred;
+	struct _dircache* dirs;
+	struct _filefilter* filter;
+	struct _mftsnapshot* snapshot;
+	struct _archive* archive;  /* Files go in here rather than the disk */
+	FILE* catalog;         /* Only list files, don't rescue them */
+	struct _sweep* sweep;  /* File data is read afterwards in disk order */
+	struct _writer* writer; /* Writes output files in the background */
 } 
 partitioninfo;
 
@@ -53,6 +82,7 @@ partitioninfo;
 #define kPartition_Invalid      0
 #define kPartition_Extended     5
 #define kPartition_ExtendedLBA 15
+#define kPartition_GPT       0xEE
 
 
 /* Partition table entry */
@@ -67,7 +97,7 @@ typedef struct _drive_partentry
 	byte endsector;	  	/* ending sector and 2 MS bits of cylinder */
 	byte endcylinder; 	/* ending cylinder (low 8 bits) */
 	uint32 startsec;	  /* absolute starting sector */
-	uint32 endsec;		  /* absolute ending sector */
+	uint32 endsec;		  /* number of sectors */
 }
 drive_partentry;
 
@@ -82,6 +112,41 @@ typedef struct _drive_mbr
 }
 drive_mbr;
 
+#define kGPT_Sig        "EFI PART"
+#define kGPT_MaxEntries 0x1000
+
+/* GUID Partition Table header */
+typedef struct _drive_gptheader
+{
+	char sig[8];                /* "EFI PART" */
+	uint32 revision;            /* Header version */
+	uint32 headerSize;          /* Size of this header */
+	uint32 headerCRC;           /* CRC32 of header, with this zeroed */
+	uint32 reserved;            /* Unused */
+	uint64 myLBA;               /* Sector of this header */
+	uint64 alternateLBA;        /* Sector of the other header */
+	uint64 firstUsable;         /* First sector usable by partitions */
+	uint64 lastUsable;          /* Last sector usable by partitions */
+	byte diskGUID[16];          /* Disk GUID */
+	uint64 entriesLBA;          /* First sector of the entry array */
+	uint32 numEntries;          /* Number of entries in the array */
+	uint32 entrySize;           /* Size of each entry */
+	uint32 entriesCRC;          /* CRC32 of the entry array */
+}
+drive_gptheader;
+
+/* GUID Partition Table entry */
+typedef struct _drive_gptentry
+{
+	byte typeGUID[16];          /* Partition type, zero when unused */
+	byte partGUID[16];          /* Unique partition GUID */
+	uint64 firstLBA;            /* First sector */
+	uint64 lastLBA;             /* Last sector (inclusive) */
+	uint64 attributes;          /* Attribute flags */
+	uint16 name[36];            /* Partition name (UTF-16) */
+}
+drive_gptentry;
+
 #pragma pack()
 
 #define CLUSTER_TO_SECTOR(info, clus) (((clus) * (info).cluster) + (info).first)
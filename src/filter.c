@@ -0,0 +1,350 @@
+/* 
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ * 
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+
+#include "usuals.h"
+#include "filter.h"
+
+#include <ctype.h>
+#include <time.h>
+
+#ifdef FC_WIDE
+#include <wctype.h>
+#define fctolower(c) towlower(c)
+#else
+#define fctolower(c) tolower((unsigned char)(c))
+#endif
+
+/* NTFS time is in 100ns units since 1601 */
+#define FT_SECOND       10000000LL
+#define FT_DAY          (FT_SECOND * 86400)
+#define FT_UNIX_EPOCH   116444736000000000LL
+
+void filter_init(filefilter* filter)
+{
+  memset(filter, 0, sizeof(filefilter));
+  filter->maxSize = kFilter_NoLimit;
+  filter->before = kFilter_NoLimit;
+}
+
+void filter_destroy(filefilter* filter)
+{
+  uint32 i;
+
+  for(i = 0; i < filter->_numPaths; i++)
+    free(filter->_paths[i]);
+  for(i = 0; i < filter->_numExts; i++)
+    free(filter->_exts[i]);
+
+  if(filter->_paths)
+    free(filter->_paths);
+  if(filter->_exts)
+    free(filter->_exts);
+
+  filter_init(filter);
+}
+
+bool filter_active(filefilter* filter)
+{
+  return filter->_numPaths || filter->_numExts || 
+         filter->minSize != 0 || filter->maxSize != kFilter_NoLimit ||
+         filter->after != 0 || filter->before != kFilter_NoLimit;
+}
+
+static fchar_t* makeString(const char* str, size_t len)
+{
+  fchar_t* ret = (fchar_t*)mallocf(sizeof(fchar_t) * (len + 1));
+
+#ifdef FC_WIDE
+  len = mbstowcs(ret, str, len);
+  if(len == (size_t)-1)
+    len = 0;
+#else
+  memcpy(ret, str, len);
+#endif
+
+  ret[len] = 0;
+  return ret;
+}
+
+static void addString(fchar_t*** list, uint32* count, fchar_t* str)
+{
+  *list = (fchar_t**)reallocf(*list, sizeof(fchar_t*) * (*count + 1));
+  if(!*list)
+    errx(1, "out of memory");
+
+  (*list)[(*count)++] = str;
+}
+
+bool filter_addpath(filefilter* filter, const char* pattern)
+{
+  fchar_t* pat;
+  fchar_t* p;
+
+  if(!pattern[0])
+    return false;
+
+  /* Either slash works as a separator, and leading ones are ignored */
+  while(*pattern == '/' || *pattern == '\\')
+    pattern++;
+
+  pat = makeString(pattern, strlen(pattern));
+  for(p = pat; *p; p++)
+  {
+    if(*p == '\\')
+      *p = '/';
+  }
+
+  addString(&(filter->_paths), &(filter->_numPaths), pat);
+  return true;
+}
+
+bool filter_addexts(filefilter* filter, const char* exts)
+{
+  const char* e;
+
+  while(*exts)
+  {
+    e = strchr(exts, ',');
+    if(!e)
+      e = exts + strlen(exts);
+
+    /* The dot is optional */
+    if(*exts == '.')
+      exts++;
+
+    if(e == exts)
+      return false;
+
+    addString(&(filter->_exts), &(filter->_numExts), makeString(exts, e - exts));
+
+    exts = *e ? e + 1 : e;
+  }
+
+  return true;
+}
+
+bool filter_parsesize(const char* str, const char** end, uint64* size)
+{
+  char* e;
+
+  *size = strtoull(str, &e, 10);
+  if(e == str)
+    return false;
+
+  switch(*e)
+  {
+  case 'k': case 'K':
+    *size *= 1024;
+    e++;
+    break;
+  case 'm': case 'M':
+    *size *= 1024 * 1024;
+    e++;
+    break;
+  case 'g': case 'G':
+    *size *= 1024 * 1024 * 1024;
+    e++;
+    break;
+  }
+
+  *end = e;
+  return true;
+}
+
+bool filter_setsize(filefilter* filter, const char* range)
+{
+  const char* e = range;
+
+  /* min, min-max, min- or -max */
+  if(*range != '-')
+  {
+    if(!filter_parsesize(range, &e, &(filter->minSize)))
+      return false;
+  }
+
+  if(*e == '-')
+  {
+    e++;
+    if(*e && !filter_parsesize(e, &e, &(filter->maxSize)))
+      return false;
+  }
+
+  return *e == 0 && filter->minSize <= filter->maxSize;
+}
+
+/* Days since the unix epoch for a date on the gregorian calendar */
+static int64 daysFromCivil(int y, int m, int d)
+{
+  int era, yoe, doy, doe;
+
+  y -= m <= 2;
+  era = (y >= 0 ? y : y - 399) / 400;
+  yoe = y - era * 400;
+  doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return (int64)era * 146097 + doe - 719468;
+}
+
+bool filter_settime(filefilter* filter, const char* when, bool after)
+{
+  int y, mo, d, h = 0, mi = 0, s = 0;
+  int64 secs;
+  uint64 ft;
+  char* e;
+  long days;
+
+  /* A number of days ago */
+  days = strtol(when, &e, 10);
+  if(e != when && (*e == 'd' || *e == 'D') && e[1] == 0 && days >= 0)
+  {
+    secs = (int64)time(NULL) - ((int64)days * 86400);
+  }
+
+  /* Or a date and time, in UTC */
+  else
+  {
+    if(sscanf(when, "%d-%d-%d", &y, &mo, &d) != 3 ||
+       mo < 1 || mo > 12 || d < 1 || d > 31)
+      return false;
+
+    e = strpbrk(when, "T ");
+    if(e && sscanf(e + 1, "%d:%d:%d", &h, &mi, &s) < 2)
+      return false;
+
+    secs = daysFromCivil(y, mo, d) * 86400 + (h * 3600) + (mi * 60) + s;
+  }
+
+  /* Before NTFS time began */
+  if(secs < -(FT_UNIX_EPOCH / FT_SECOND))
+    ft = 0;
+  else
+    ft = (uint64)(secs * FT_SECOND + FT_UNIX_EPOCH);
+
+  if(after)
+    filter->after = ft;
+  else
+    filter->before = ft;
+
+  return filter->after <= filter->before;
+}
+
+/* Shell style matching with '*' and '?', ignoring case */
+static bool matchPattern(const fchar_t* pat, const fchar_t* str)
+{
+  const fchar_t* star = NULL;
+  const fchar_t* back = NULL;
+
+  while(*str)
+  {
+    if(*pat == '*')
+    {
+      star = ++pat;
+      back = str;
+    }
+    else if(*pat == '?' || (*pat && fctolower(*pat) == fctolower(*str)))
+    {
+      pat++;
+      str++;
+    }
+
+    /* Go back and let the last star take one more character */
+    else if(star)
+    {
+      pat = star;
+      str = ++back;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+  while(*pat == '*')
+    pat++;
+
+  return *pat == 0;
+}
+
+static bool matchExtension(const fchar_t* ext, const fchar_t* path)
+{
+  const fchar_t* dot = NULL;
+  const fchar_t* p;
+
+  for(p = path; *p; p++)
+  {
+    if(*p == '.')
+      dot = p;
+    else if(*p == '/')
+      dot = NULL;
+  }
+
+  if(!dot)
+    return false;
+
+  for(dot++; *dot && *ext; dot++, ext++)
+  {
+    if(fctolower(*dot) != fctolower(*ext))
+      return false;
+  }
+
+  return *dot == 0 && *ext == 0;
+}
+
+bool filter_matchname(filefilter* filter, const fchar_t* path)
+{
+  uint32 i;
+
+  if(filter->_numExts)
+  {
+    for(i = 0; i < filter->_numExts; i++)
+    {
+      if(matchExtension(filter->_exts[i], path))
+        break;
+    }
+
+    if(i == filter->_numExts)
+      return false;
+  }
+
+  if(filter->_numPaths)
+  {
+    for(i = 0; i < filter->_numPaths; i++)
+    {
+      if(matchPattern(filter->_paths[i], path))
+        break;
+    }
+
+    if(i == filter->_numPaths)
+      return false;
+  }
+
+  return true;
+}
+
+bool filter_matchinfo(filefilter* filter, uint64 size, uint64 modified)
+{
+  if(size < filter->minSize || size > filter->maxSize)
+    return false;
+
+  if(modified < filter->after || modified > filter->before)
+    return false;
+
+  return true;
+}
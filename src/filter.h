@@ -0,0 +1,64 @@
+/* 
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ * 
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+
+#ifndef __FILTER_H__
+#define __FILTER_H__
+
+#include "usuals.h"
+
+/*
+ * Decides which files get rescued. Everything here is checked
+ * against what's in the MFT record, before any file data is read.
+ */
+/* No upper limit on size or time */
+#define kFilter_NoLimit   (~((uint64)0))
+
+typedef struct _filefilter
+{
+  fchar_t** _paths;               /* Patterns for the path */
+  uint32 _numPaths;
+  fchar_t** _exts;                /* File extensions */
+  uint32 _numExts;
+
+  uint64 minSize;                 /* Size range (in bytes) */
+  uint64 maxSize;
+  uint64 after;                   /* Modified time range (NTFS time) */
+  uint64 before;
+}
+filefilter;
+
+void filter_init(filefilter* filter);
+void filter_destroy(filefilter* filter);
+bool filter_active(filefilter* filter);
+
+/* These parse the command line arguments, returning false if invalid */
+bool filter_addpath(filefilter* filter, const char* pattern);
+bool filter_addexts(filefilter* filter, const char* exts);
+bool filter_setsize(filefilter* filter, const char* range);
+bool filter_settime(filefilter* filter, const char* when, bool after);
+
+/* A size in bytes with an optional k, M or G suffix */
+bool filter_parsesize(const char* str, const char** end, uint64* size);
+
+/* Path is relative to the output directory, separated by slashes */
+bool filter_matchname(filefilter* filter, const fchar_t* path);
+bool filter_matchinfo(filefilter* filter, uint64 size, uint64 modified);
+
+#endif /* __FILTER_H__ */
@@ -17,10 +17,18 @@
  * Send bug reports to: <stef@memberwebs.com>
  */
 
+#define _LARGEFILE_SOURCE
+#define _LARGEFILE64_SOURCE   /* For lseek64 */
+#define _FILE_OFFSET_BITS 64
+
 #include "usuals.h"
 #include "drive.h"
 #include "ntfs.h"
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
 const char kPrintData[]		= "\
     Start Sector    End Sector      Cluster Size    MFT Offset    \n\
 ==================================================================\n\
@@ -29,62 +37,210 @@ const char kPrintData[]		= "\
 const char kPrintDrive[]		= "\nDrive: %u\n";
 const char kPrintDrivePath[]		= "\nDrive: %s\n";
 
-int printNTFSInfo(int dd, uint64 tblSector)
+/* Probing is done with at most this many threads */
+#define LIST_MAX_THREADS  16
+
+typedef struct _listdrive
+{
+  char name[MAX_PATH + 1];      /* Path to open the drive */
+  int number;                   /* Drive number or -1 */
+}
+listdrive;
+
+typedef struct _listpart
+{
+  uint32 drive;                 /* Index into the drives */
+  uint64 first;                 /* First sector */
+  uint64 end;                   /* Last sector */
+
+  /* Filled in when probing */
+  bool ntfs;
+  uint32 cluster;               /* Cluster size (in sectors) */
+  uint64 mft;                   /* Offset to the MFT (in sectors) */
+  int error;                    /* errno when the probe failed */
+}
+listpart;
+
+typedef struct _listinfo
+{
+  listdrive* drives;
+  uint32 numDrives;
+  listpart* parts;
+  uint32 numParts;
+  uint32 _allocParts;
+
+  /* Next partition to probe */
+  uint32 _probe;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t _lock;
+#endif
+}
+listinfo;
+
+static bool readSectors(int dd, uint64 sector, void* data, size_t len)
 {
-	byte sector[kSectorSize];
   int64 pos;
   size_t sz;
-  ntfs_bootsector* boot;
-
-  /* TODO: Check the range and don't print if out of range */
-	pos = SECTOR_TO_BYTES(tblSector);
 
+  pos = SECTOR_TO_BYTES(sector);
   if(lseek64(dd, pos, SEEK_SET) == -1)
-    err(1, "couldn't seek drive");
+    return false;
 
-  sz = read(dd, &sector, kSectorSize);
+  sz = read(dd, data, len);
   if(sz == -1)
-    err(1, "couldn't read drive");
+    return false;
 
-  if(sz != kSectorSize)
-    errx(1, "unexpected end of drive");
+  if(sz != len)
+  {
+    errno = ERANGE;
+    return false;
+  }
 
-  boot = (ntfs_bootsector*)sector;
-	if(!memcmp(boot->sysId, kNTFS_SysId, sizeof(boot->sysId)))
-	{
-#ifdef _WIN32
-		printf("%-15u %-15I64u", (unsigned int)boot->secPerClus,
-		       boot->offMFT * (uint64)boot->secPerClus);
-#else
-		printf("%-15u %-15llu", (unsigned int)boot->secPerClus,
-		       (unsigned long long)(boot->offMFT * (uint64)boot->secPerClus));
-#endif
-	}
+  return true;
+}
+
+static void addPartition(listinfo* li, uint32 drive, uint64 first, uint64 end)
+{
+  listpart* part;
 
-	printf("\n");
-	return 0;
+  if(li->numParts >= li->_allocParts)
+  {
+    li->_allocParts += 16;
+    li->parts = (listpart*)reallocf(li->parts, li->_allocParts * sizeof(listpart));
+  }
+
+  part = li->parts + li->numParts++;
+  memset(part, 0, sizeof(listpart));
+  part->drive = drive;
+  part->first = first;
+  part->end = end;
 }
 
-int printPartitionInfo(int dd, uint64 tblSector)
+static uint32 crc32(const byte* data, size_t len)
 {
-	drive_mbr mbr;
-  int64 pos;
-  size_t sz;
-  int i;
+  static uint32 table[0x100];
+  static bool inited = false;
+  uint32 c;
+  uint32 i, j;
 
-	ASSERT(sizeof(drive_mbr) == kSectorSize);
+  if(!inited)
+  {
+    for(i = 0; i < 0x100; i++)
+    {
+      c = i;
+      for(j = 0; j < 8; j++)
+        c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : (c >> 1);
+      table[i] = c;
+    }
 
-	pos = SECTOR_TO_BYTES(tblSector);
+    inited = true;
+  }
 
-  if(lseek64(dd, pos, SEEK_SET) == -1)
-    err(1, "couldn't seek drive");
+  c = 0xFFFFFFFF;
+  while(len--)
+    c = table[(c ^ *data++) & 0xFF] ^ (c >> 8);
 
-  sz = read(dd, &mbr, sizeof(drive_mbr));
-  if(sz == -1)
-    err(1, "couldn't read drive");
+  return c ^ 0xFFFFFFFF;
+}
+
+/* Reads and validates a GPT header and entry array at the given sector */
+static byte* readGPT(int dd, uint64 sector, drive_gptheader* header)
+{
+  byte buf[kSectorSize];
+  byte* entries = NULL;
+  uint32 crc;
+  size_t len;
+
+  if(!readSectors(dd, sector, buf, kSectorSize))
+    return NULL;
+
+  memcpy(header, buf, sizeof(drive_gptheader));
+
+  if(memcmp(header->sig, kGPT_Sig, sizeof(header->sig)) ||
+     header->headerSize < sizeof(drive_gptheader) || 
+     header->headerSize > kSectorSize || header->myLBA != sector)
+    return NULL;
+
+  /* The CRC is calculated with the CRC field zeroed */
+  crc = header->headerCRC;
+  ((drive_gptheader*)buf)->headerCRC = 0;
+  if(crc32(buf, header->headerSize) != crc)
+    return NULL;
+
+  if(header->entrySize < sizeof(drive_gptentry) || header->entrySize > kSectorSize ||
+     header->numEntries == 0 || header->numEntries > kGPT_MaxEntries)
+    return NULL;
+
+  /* Read in the whole entry array, rounded up to a sector */
+  len = header->numEntries * header->entrySize;
+  len = ((len + kSectorSize - 1) / kSectorSize) * kSectorSize;
+  entries = (byte*)mallocf(len);
+
+  if(!readSectors(dd, header->entriesLBA, entries, len) ||
+     crc32(entries, header->numEntries * header->entrySize) != header->entriesCRC)
+  {
+    free(entries);
+    return NULL;
+  }
+
+  return entries;
+}
+
+static void listGPTPartitions(listinfo* li, uint32 drive, int dd)
+{
+  static const byte kUnused[16] = { 0 };
+  drive_gptheader header;
+  drive_gptentry* entry;
+  byte* entries;
+  int64 last;
+  uint32 i;
+
+  /* The primary header is right after the protective MBR */
+  entries = readGPT(dd, 1, &header);
 
-  if(sz != sizeof(drive_mbr))
-    errx(1, "unexpected end of drive");
+  /* Otherwise use the backup at the end of the disk */
+  if(!entries)
+  {
+    last = lseek64(dd, 0, SEEK_END);
+    if(last > kSectorSize)
+      entries = readGPT(dd, (last / kSectorSize) - 1, &header);
+
+    if(!entries)
+    {
+      warnx("couldn't find a valid GPT partition table on drive: %s", 
+            li->drives[drive].name);
+      return;
+    }
+
+    warnx("primary GPT partition table damaged, using backup on drive: %s", 
+          li->drives[drive].name);
+  }
+
+  for(i = 0; i < header.numEntries; i++)
+  {
+    entry = (drive_gptentry*)(entries + (i * header.entrySize));
+
+    /* Unused entries have no type */
+    if(!memcmp(entry->typeGUID, kUnused, sizeof(kUnused)))
+      continue;
+    if(entry->lastLBA < entry->firstLBA)
+      continue;
+
+    addPartition(li, drive, entry->firstLBA, entry->lastLBA);
+  }
+
+  free(entries);
+}
+
+static void listPartitions(listinfo* li, uint32 drive, int dd, uint64 tblSector)
+{
+	drive_mbr mbr;
+  int i;
+
+	ASSERT(sizeof(drive_mbr) == kSectorSize);
+
+  if(!readSectors(dd, tblSector, &mbr, sizeof(drive_mbr)))
+    err(1, "couldn't read drive: %s", li->drives[drive].name);
 
 	if(mbr.sig == kMBR_Sig)
 	{
@@ -93,41 +249,197 @@ int printPartitionInfo(int dd, uint64 tblSector)
 			if(mbr.partitions[i].system == kPartition_Extended ||
 			   mbr.partitions[i].system == kPartition_ExtendedLBA)
 			{
-				printPartitionInfo(dd, tblSector + mbr.partitions[i].startsec);
+				listPartitions(li, drive, dd, tblSector + mbr.partitions[i].startsec);
 			}
-			else if(tblSector + mbr.partitions[i].startsec == 1UL &&
-			        tblSector + mbr.partitions[i].endsec == 0xFFFFFFFFUL)
+			else if(mbr.partitions[i].system == kPartition_GPT)
 			{
-				printf("    large partition, perhaps using gpt\n");
+				listGPTPartitions(li, drive, dd);
 			}
-			else if(!mbr.partitions[i].system == kPartition_Invalid)
+			/* Listed by their last sector, the same as GPT partitions */
+			else if(mbr.partitions[i].system != kPartition_Invalid &&
+			        mbr.partitions[i].endsec != 0)
 			{
+				addPartition(li, drive, tblSector + mbr.partitions[i].startsec,
+				             tblSector + mbr.partitions[i].startsec + 
+				             mbr.partitions[i].endsec - 1);
+			}
+		}
+	}
+}
+
+static void probePartition(listinfo* li, listpart* part)
+{
+  ntfs_bootsector boot;
+  int dd;
+
+  /* Each probe has its own handle so they don't share a file position */
+  dd = open(li->drives[part->drive].name, O_BINARY | O_RDONLY | OPEN_LARGE_OPTS);
+  if(dd == -1)
+  {
+    part->error = errno;
+    return;
+  }
+
+  if(!readSectors(dd, part->first, &boot, sizeof(boot)))
+    part->error = errno;
+
+  else if(ntfs_isbootsector(&boot))
+  {
+    part->ntfs = true;
+    part->cluster = (boot.secPerClus * boot.bytePerSec) / kSectorSize;
+    part->mft = boot.offMFT * part->cluster;
+  }
+
+  close(dd);
+}
+
+static void* probeThread(void* arg)
+{
+  listinfo* li = (listinfo*)arg;
+  listpart* part;
+
+  for(;;)
+  {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&(li->_lock));
+#endif
+
+    part = NULL;
+    if(li->_probe < li->numParts)
+      part = li->parts + li->_probe++;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&(li->_lock));
+#endif
+
+    if(!part)
+      break;
+
+    probePartition(li, part);
+  }
+
+  return NULL;
+}
+
+static void probePartitions(listinfo* li)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_t threads[LIST_MAX_THREADS];
+  uint32 numThreads;
+  uint32 i;
+
+  li->_probe = 0;
+  pthread_mutex_init(&(li->_lock), NULL);
+
+  /* 
+   * Each partition is probed on its own thread, so slow or 
+   * spun down drives are waited on all at once.
+   */
+  numThreads = min(li->numParts, LIST_MAX_THREADS);
+  for(i = 0; i < numThreads; i++)
+  {
+    if(pthread_create(threads + i, NULL, probeThread, li) != 0)
+      break;
+  }
+
+  numThreads = i;
+
+  /* Anything left over if threads couldn't be created */
+  probeThread(li);
+
+  for(i = 0; i < numThreads; i++)
+    pthread_join(threads[i], NULL);
+
+  pthread_mutex_destroy(&(li->_lock));
+#else
+  li->_probe = 0;
+  probeThread(li);
+#endif
+}
+
+static void printPartitions(listinfo* li)
+{
+  listpart* part;
+  listdrive* drive;
+  uint32 d, i;
+
+  printf(kPrintData);
+
+  for(d = 0; d < li->numDrives; d++)
+  {
+    drive = li->drives + d;
+
+    if(drive->number >= 0)
+      printf(kPrintDrive, drive->number);
+    else
+      printf(kPrintDrivePath, drive->name);
+
+    for(i = 0; i < li->numParts; i++)
+    {
+      part = li->parts + i;
+      if(part->drive != d)
+        continue;
+
 #ifdef _WIN32
-				printf("    %-15I64u %-15I64u ",
-				       tblSector + mbr.partitions[i].startsec,
-				       tblSector + mbr.partitions[i].endsec);
+      printf("    %-15I64u %-15I64u ", part->first, part->end);
 #else
-				printf("    %-15llu %-15llu ",
-				       (unsigned long long)(tblSector + mbr.partitions[i].startsec),
-				       (unsigned long long)(tblSector + mbr.partitions[i].endsec));
+      printf("    %-15llu %-15llu ", (unsigned long long)part->first,
+             (unsigned long long)part->end);
 #endif
 
-				printNTFSInfo(dd, tblSector + (uint64)mbr.partitions[i].startsec);
-			}
-		}
-	}
+      if(part->ntfs)
+      {
+#ifdef _WIN32
+        printf("%-15u %-15I64u", part->cluster, part->mft);
+#else
+        printf("%-15u %-15llu", part->cluster, (unsigned long long)part->mft);
+#endif
+      }
+      else if(part->error)
+      {
+        printf("(couldn't read: %s)", strerror(part->error));
+      }
+
+      printf("\n");
+    }
+  }
+}
+
+static void listDrives(listinfo* li)
+{
+  uint32 i;
+  int dd;
+
+  /* Reading the partition tables is quick */
+  for(i = 0; i < li->numDrives; i++)
+  {
+    dd = open(li->drives[i].name, O_BINARY | O_RDONLY | OPEN_LARGE_OPTS);
+    if(dd == -1)
+      err(1, "couldn't open drive: %s", li->drives[i].name);
+
+    listPartitions(li, i, dd, 0);
+    close(dd);
+  }
+
+  /* Probing partitions may be slow, so is done concurrently */
+  probePartitions(li);
+  printPartitions(li);
 
-	return 0;
+  if(li->parts)
+    free(li->parts);
+  free(li->drives);
 }
 
 #ifdef _WIN32
 void scroungeList()
 {
+  listinfo li;
 	char driveName[MAX_PATH];
   int dd = -1;
   int i;
 
-  printf(kPrintData);
+  memset(&li, 0, sizeof(li));
+  li.drives = (listdrive*)mallocf(sizeof(listdrive) * 0x100);
 
 	/* LIMIT: 256 Drives */
 	for(i = 0; i < 0x100; i++)
@@ -137,22 +449,33 @@ void scroungeList()
     dd = open(driveName, O_BINARY | O_RDONLY | OPEN_LARGE_OPTS);
     if(dd != -1)
     {
-			printf(kPrintDrive, i);
-			printPartitionInfo(dd, 0);
+      strncpy(li.drives[li.numDrives].name, driveName, MAX_PATH);
+      li.drives[li.numDrives].name[MAX_PATH] = 0;
+      li.drives[li.numDrives].number = i;
+      li.numDrives++;
 			close(dd);
 		}
 	}
+
+  listDrives(&li);
 }
 #endif
 
-void scroungeListDrive(char* drive)
+void scroungeListDrives(char** drives, int count)
 {
-  int dd = open(drive, O_BINARY | O_RDONLY | OPEN_LARGE_OPTS);
-  if(dd == -1)
-    err(1, "couldn't open drive: %s", drive);
+  listinfo li;
+  int i;
 
-  printf(kPrintData);
-  printf(kPrintDrivePath, drive);
-  printPartitionInfo(dd, 0);
-  close(dd);
+  memset(&li, 0, sizeof(li));
+  li.drives = (listdrive*)mallocf(sizeof(listdrive) * count);
+  li.numDrives = count;
+
+  for(i = 0; i < count; i++)
+  {
+    strncpy(li.drives[i].name, drives[i], MAX_PATH);
+    li.drives[i].name[MAX_PATH] = 0;
+    li.drives[i].number = -1;
+  }
+
+  listDrives(&li);
 }
@@ -20,6 +20,15 @@
 #include "usuals.h"
 #include "scrounge.h"
 #include "compat.h"
+#include "filter.h"
+#include "snapshot.h"
+#include "archive.h"
+#include "pack.h"
+#include "sweep.h"
+#include "writer.h"
+#include "device.h"
+#include "stats.h"
+#include "memref.h"
 
 #ifdef _WIN32
 
@@ -27,13 +36,36 @@ const char kPrintHelp[]       = "\
 usage: scrounge -l                                                   \n\
   List all drive partition information.                              \n\
                                                                      \n\
-usage: scrounge [-d drive] [-m mftoffset] [-c clustersize] [-o outdir] start end  \n\
+usage: scrounge [-d drive] [-u] -s [start end]                       \n\
+  Search a drive for NTFS partitions.                                \n\
+                                                                     \n\
+usage: scrounge [-d drive] [-m mftoffset] [-c clustersize] [-o outdir] \n\
+                [-p path] [-e ext,...] [-z size] [-a date] [-b date] \n\
+                [-C catalog] [-S snapshot] [-t archive] [-P pack]   \n\
+                [-D] [-u] [-w threads] [-g geometry] [-j stats]      \n\
+                [-H heatmap] [-J seconds] start end                  \n\
   Scrounge data from a partition                                     \n\
-  -c         Cluster size (in sectors, default of 8)                 \n\
+  -a         Only files modified after date (YYYY-MM-DD or days: 30d)\n\
+  -b         Only files modified before date                         \n\
+  -C         Only list files to a catalog (JSON lines, - for stdout) \n\
+  -c         Cluster size (in sectors, default from boot sector)     \n\
+  -D         Read file data in disk order, in one pass over the disk \n\
   -d         Drive number                                            \n\
+  -e         Only files with these extensions                        \n\
+  -g         I/O geometry (ie: read=4M,ahead=16,write=1M,memory=64M) \n\
+  -H         Write read speed and errors per GiB of disk to a CSV    \n\
+  -J         Also write the stats every so many seconds              \n\
+  -j         Write timings and counts to a file (JSON, - for stderr) \n\
   -k         Number of sectors to skip when in mft not specified.    \n\
-  -m         Offset to mft (in sectors)                              \n\
+  -m         Offset to mft (in sectors, default from boot sector)    \n\
   -o         Directory to put scrounged files in                     \n\
+  -P         Store each distinct file once in a pack, with manifest  \n\
+  -p         Only files whose path matches (ie: Users/*/*.pst)       \n\
+  -S         MFT snapshot file, made on first use and read after     \n\
+  -t         Write files to a pax archive instead (- for stdout)     \n\
+  -u         Read the disk directly, bypassing the system cache      \n\
+  -w         Number of threads writing files in the background       \n\
+  -z         Only files in a size range (ie: 10k-2M, 1G-, -100k)     \n\
   start      First sector of partition                               \n\
   end        Last sector of partition                                \n\
                                                                      \n\
@@ -42,15 +74,38 @@ usage: scrounge [-d drive] [-m mftoffset] [-c clustersize] [-o outdir] start end
 #else /* Not WIN32 */
 
 const char kPrintHelp[]       = "\
-usage: scrounge -l disk                                              \n\
+usage: scrounge -l disk ...                                          \n\
   List all drive partition information.                              \n\
                                                                      \n\
-usage: scrounge [-m mftoffset] [-c clustersize] [-o outdir] disk start end  \n\
+usage: scrounge [-u] -s disk [start end]                             \n\
+  Search a disk for NTFS partitions.                                 \n\
+                                                                     \n\
+usage: scrounge [-m mftoffset] [-c clustersize] [-o outdir] [-p path]\n\
+                [-e ext,...] [-z size] [-a date] [-b date] [-C catalog] \n\
+                [-S snapshot] [-t archive] [-P pack] [-D] [-u]       \n\
+                [-w threads] [-g geometry] [-j stats] [-H heatmap]   \n\
+                [-J seconds] disk start end                          \n\
   Scrounge data from a partition                                     \n\
-  -c         Cluster size (in sectors, default of 8)                 \n\
+  -a         Only files modified after date (YYYY-MM-DD or days: 30d)\n\
+  -b         Only files modified before date                         \n\
+  -C         Only list files to a catalog (JSON lines, - for stdout) \n\
+  -c         Cluster size (in sectors, default from boot sector)     \n\
+  -D         Read file data in disk order, in one pass over the disk \n\
+  -e         Only files with these extensions                        \n\
+  -g         I/O geometry (ie: read=4M,ahead=16,write=1M,memory=64M) \n\
+  -H         Write read speed and errors per GiB of disk to a CSV    \n\
+  -J         Also write the stats every so many seconds              \n\
+  -j         Write timings and counts to a file (JSON, - for stderr) \n\
   -k         Number of sectors to skip when in mft not specified.    \n\
-  -m         Offset to mft (in sectors)                              \n\
+  -m         Offset to mft (in sectors, default from boot sector)    \n\
   -o         Directory to put scrounged files in                     \n\
+  -P         Store each distinct file once in a pack, with manifest  \n\
+  -p         Only files whose path matches (ie: Users/*/*.pst)       \n\
+  -S         MFT snapshot file, made on first use and read after     \n\
+  -t         Write files to a pax archive instead (- for stdout)     \n\
+  -u         Read the disk directly, bypassing the system cache      \n\
+  -w         Number of threads writing files in the background       \n\
+  -z         Only files in a size range (ie: 10k-2M, 1G-, -100k)     \n\
   disk       The raw disk partitions (ie: /dev/hda)                  \n\
   start      First sector of partition                               \n\
   end        Last sector of partition                                \n\
@@ -79,6 +134,23 @@ int main(int argc, char* argv[])
   uint64 skip = 0;
   unsigned long long ull;
   partitioninfo pi;
+  filefilter filter;
+  mftsnapshot snapshot;
+  archive ar;
+  FILE* arfile = NULL;
+  pack pk;
+  const char* packName = NULL;
+  char manifestName[MAX_PATH + 1];
+  FILE* manifest;
+  int packfd;
+  const char* snapshotName = NULL;
+  const char* statsName = NULL;
+  const char* heatmapName = NULL;
+  uint32 statsInterval = 0;
+  bool diskOrder = false;
+  sweep sw;
+  int writers = 0;
+  writer wr;
   char driveName[MAX_PATH + 1];
   char *end;
 #ifdef _WIN32
@@ -86,19 +158,53 @@ int main(int argc, char* argv[])
 #endif
 
   memset(&pi, 0, sizeof(pi));
-
-  /* TODO: We need to be able to autodetect the cluster size */
-  pi.cluster = 8;
+  device_defaults(&pi.io);
+  filter_init(&filter);
 
 #ifdef _WIN32
-  while((ch = getopt(argc, argv, "c:d:hk:lm:o:sv")) != -1)
+  while((ch = getopt(argc, argv, "a:b:C:c:Dd:e:g:H:hJ:j:k:lm:o:P:p:S:st:uvw:z:")) != -1)
 #else
-  while((ch = getopt(argc, argv, "c:hk:lm:o:sv")) != -1)
+  while((ch = getopt(argc, argv, "a:b:C:c:De:g:H:hJ:j:k:lm:o:P:p:S:st:uvw:z:")) != -1)
 #endif
   {
     switch(ch)
     {
 
+    /* modified after */
+    case 'a':
+      {
+        if(!filter_settime(&filter, optarg, true))
+          errx(2, "invalid date (must be YYYY-MM-DD[THH:MM:SS] or a number of days)");
+
+        mode = MODE_SCROUNGE;
+      }
+      break;
+
+    /* modified before */
+    case 'b':
+      {
+        if(!filter_settime(&filter, optarg, false))
+          errx(2, "invalid date (must be YYYY-MM-DD[THH:MM:SS] or a number of days)");
+
+        mode = MODE_SCROUNGE;
+      }
+      break;
+
+    /* catalog only */
+    case 'C':
+      {
+        if(pi.catalog && pi.catalog != stdout)
+          fclose(pi.catalog);
+
+        if(!strcmp(optarg, "-"))
+          pi.catalog = stdout;
+        else if(!(pi.catalog = fopen(optarg, "w")))
+          err(1, "couldn't open catalog file: %s", optarg);
+
+        mode = MODE_SCROUNGE;
+      }
+      break;
+
     /* cluster size */
     case 'c':
       {
@@ -111,6 +217,53 @@ int main(int argc, char* argv[])
       }
       break;
 
+    /* read in disk order */
+    case 'D':
+      {
+        diskOrder = true;
+        mode = MODE_SCROUNGE;
+      }
+      break;
+
+    /* file extensions */
+    case 'e':
+      {
+        if(!filter_addexts(&filter, optarg))
+          errx(2, "invalid extension list (must be separated by commas)");
+
+        mode = MODE_SCROUNGE;
+      }
+      break;
+
+    /* i/o geometry */
+    case 'g':
+      {
+        if(!device_setgeometry(&pi.io, optarg))
+          errx(2, "invalid i/o geometry (ie: read=4M,ahead=16,write=1M,memory=64M)");
+      }
+      break;
+
+    /* read heatmap */
+    case 'H':
+      heatmapName = optarg;
+      break;
+
+    /* stats file */
+    case 'j':
+      statsName = optarg;
+      break;
+
+    /* stats interval */
+    case 'J':
+      {
+        temp = atoi(optarg);
+        if(temp <= 0)
+          errx(2, "invalid stats interval (must be a number of seconds)");
+
+        statsInterval = (uint32)temp;
+      }
+      break;
+
 #ifdef _WIN32
     /* drive number */
     case 'd':
@@ -163,6 +316,32 @@ int main(int argc, char* argv[])
         err(2, "couldn't change to output directory");
       break;
 
+    /* dedup pack */
+    case 'P':
+      {
+        packName = optarg;
+        mode = MODE_SCROUNGE;
+      }
+      break;
+
+    /* path pattern */
+    case 'p':
+      {
+        if(!filter_addpath(&filter, optarg))
+          errx(2, "invalid path pattern");
+
+        mode = MODE_SCROUNGE;
+      }
+      break;
+
+    /* mft snapshot */
+    case 'S':
+      {
+        snapshotName = optarg;
+        mode = MODE_SCROUNGE;
+      }
+      break;
+
     /* search mode */
     case 's':
       {
@@ -173,12 +352,59 @@ int main(int argc, char* argv[])
       }
       break;
 
+    /* archive output */
+    case 't':
+      {
+        if(arfile && arfile != stdout)
+          fclose(arfile);
+
+        if(!strcmp(optarg, "-"))
+        {
+          arfile = stdout;
+#ifdef _WIN32
+          _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        }
+        else if(!(arfile = fopen(optarg, "wb")))
+          err(1, "couldn't open archive file: %s", optarg);
+
+        mode = MODE_SCROUNGE;
+      }
+      break;
+
+    /* bypass the system cache */
+    case 'u':
+      pi.direct = true;
+      break;
+
 #ifdef _DEBUG
     case 'v':
       g_verifyMode = true;
       break;
 #endif
 
+    /* writer threads */
+    case 'w':
+      {
+        temp = atoi(optarg);
+        if(temp < 0 || temp > kWriter_MaxThreads)
+          errx(2, "invalid number of writer threads (must be between 0 and 16)");
+
+        writers = temp;
+        mode = MODE_SCROUNGE;
+      }
+      break;
+
+    /* file size */
+    case 'z':
+      {
+        if(!filter_setsize(&filter, optarg))
+          errx(2, "invalid size range (must be min-max, with optional k, M or G)");
+
+        mode = MODE_SCROUNGE;
+      }
+      break;
+
     /* help mode */
     case '?':
     case 'h':
@@ -194,6 +420,11 @@ int main(int argc, char* argv[])
   argc -= optind;
   argv += optind;
 
+  if(statsName || heatmapName)
+    stats_init(statsName, heatmapName, statsInterval);
+  else if(statsInterval)
+    errx(2, "the stats interval needs a stats or heatmap file (-j or -H)");
+
 #ifdef _WIN32
   /* Under windows we format the drive number */
   makeDriveName(driveName, drive);
@@ -234,27 +465,145 @@ int main(int argc, char* argv[])
     pi.end = ull;
 
     /* Open the device */
-    pi.device = open(driveName, O_BINARY | O_RDONLY | OPEN_LARGE_OPTS);
+    pi.device = device_open(driveName, &(pi.direct));
     if(pi.device == -1)
       err(1, "couldn't open drive: %s", driveName);
 
+    /* An existing snapshot has everything we need about the MFT */
+    if(snapshotName)
+    {
+      snapshot_init(&snapshot, snapshotName);
+      snapshot_open(&snapshot, &pi);
+      pi.snapshot = &snapshot;
+    }
+
+    /* 
+     * Fill in anything not specified from the boot sector. When 
+     * that's intact we end up with the MFT location too.
+     */
+    if(pi.cluster == 0 || pi.mft == 0)
+      scroungeDetect(&pi);
+
+    if(pi.cluster == 0)
+    {
+      warnx("couldn't detect cluster size, using default of 8 sectors");
+      pi.cluster = 8;
+    }
+
+    if(filter_active(&filter))
+      pi.filter = &filter;
+
+    if(arfile && packName)
+      errx(2, "only one of an archive or a pack can be written");
+
+    /* Content is stored once in the pack, with a manifest of the files */
+    if(packName && !pi.catalog)
+    {
+      packfd = open(packName, O_BINARY | O_RDWR | O_CREAT | O_TRUNC | OPEN_LARGE_OPTS, 0644);
+      if(packfd == -1)
+        err(1, "couldn't create pack: %s", packName);
+
+      if(strlen(packName) + 10 > MAX_PATH)
+        errx(2, "pack name too long");
+
+      strcpy(manifestName, packName);
+      strcat(manifestName, ".manifest");
+
+      if(!(manifest = fopen(manifestName, "w")))
+        err(1, "couldn't create pack manifest: %s", manifestName);
+
+      pack_init(&pk, packfd, manifest);
+      archive_initpack(&ar, &pk);
+      pi.archive = &ar;
+    }
+
+    /* Written in big sequential pieces */
+    else if(arfile && !pi.catalog)
+    {
+      setvbuf(arfile, NULL, _IOFBF, pi.io.writeSize);
+      archive_init(&ar, arfile);
+      pi.archive = &ar;
+    }
+
+#ifdef _DEBUG
+    /* Verifying compares the files a piece at a time */
+    if(g_verifyMode)
+    {
+      diskOrder = false;
+      writers = 0;
+    }
+#endif
+
+    /* Files on the disk get written in the background */
+    if(writers > 0 && !pi.archive && !pi.catalog)
+    {
+      writer_init(&wr, writers, pi.io.writeSize, (size_t)pi.io.memory);
+      pi.writer = &wr;
+    }
+
     /* Use mft type search */
     if(pi.mft != 0)
     {
+      /* Only files on the disk can be written out of order */
+      if(diskOrder && !pi.archive && !pi.catalog)
+      {
+        sweep_init(&sw);
+        pi.sweep = &sw;
+      }
+
       scroungeUsingMFT(&pi);
+
+      if(pi.sweep)
+        sweep_destroy(pi.sweep);
     }
 
     /* Otherwise it's a raw search */
     else
     {
+      if(snapshotName)
+        warnx("no mft to make a snapshot of");
+      if(diskOrder)
+        warnx("no mft to read files in disk order with");
+
       warnx("Scrounging via raw search. Directory info will be discarded.");
       scroungeUsingRaw(&pi, skip);
     }
+
+    /* Waits for the last of the files to be written */
+    if(pi.writer)
+      writer_destroy(pi.writer);
+
+    filter_destroy(&filter);
+
+    if(snapshotName)
+      snapshot_close(&snapshot);
+
+    if(pi.archive)
+    {
+      archive_finish(pi.archive);
+
+      if(packName)
+      {
+        close(pk.fd);
+        fclose(pk.manifest);
+      }
+      else if(arfile != stdout)
+        fclose(arfile);
+    }
+
+    if(pi.catalog)
+    {
+      if(fflush(pi.catalog) != 0)
+        err(1, "couldn't write catalog file");
+
+      if(pi.catalog != stdout)
+        fclose(pi.catalog);
+    }
   }
 
   else
   {
-    if(argc > 0)
+    if(argc > (mode == MODE_SEARCH ? 2 : 0) && mode != MODE_LIST)
       warnx("ignoring extra arguments");
 
     /* List partition and drive info */
@@ -262,14 +611,42 @@ int main(int argc, char* argv[])
 #ifdef _WIN32
       scroungeList();
 #else
-      scroungeListDrive(driveName);
+    {
+      /* Any further arguments are more drives to list */
+      scroungeListDrives(argv - 1, argc + 1);
+    }
 #endif
 
     /* Search for NTFS partitions */
     if(mode == MODE_SEARCH)
+    {
+      pi.device = device_open(driveName, &(pi.direct));
+      if(pi.device == -1)
+        err(1, "couldn't open drive: %s", driveName);
+
+      /* Search the whole disk unless a range is given */
+      pi.first = 0;
+      pi.end = kInvalidSector;
+
+      if(argc >= 2)
+      {
+        pi.first = strtoull(argv[0], &end, 10);
+        if(*end != 0)
+          errx(2, "invalid start sector (must be positive)");
+
+        pi.end = strtoull(argv[1], &end, 10);
+        if(*end != 0 || pi.end <= pi.first)
+          errx(2, "invalid end sector (must be positive and greater than first)");
+      }
+
       scroungeSearch(&pi);
+    }
   }
 
+  stats_finish();
+
+  /* Everything should have been freed by now */
+  memref_leaks();
   return 0;
 }
 
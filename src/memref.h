@@ -42,4 +42,33 @@ void _refrelease(void* buf);
 
 #endif
 
+/*
+ * Memory is counted by the kind of object it's for, in release
+ * builds too, so that leaks and growth show up. Like the reference
+ * counting, this isn't thread safe.
+ */
+#define kMemRef_Blocks      0     /* Memory from refalloc */
+#define kMemRef_Records     1
+#define kMemRef_Attributes  2
+#define kMemRef_Enums       3
+#define kMemRef_Dataruns    4
+#define kMemRef_MaxType     5
+#define kMemRef_Total       kMemRef_MaxType   /* All of the above */
+
+typedef struct _memref_count
+{
+  uint64 allocs;      /* Allocated so far */
+  uint64 live;        /* Not freed yet */
+  uint64 bytes;       /* Live bytes */
+  uint64 peak;        /* Most live bytes at any one time */
+}
+memref_count;
+
+void memref_alloc(int type, size_t sz);
+void memref_free(int type, size_t sz);
+const memref_count* memref_counts(int type);
+
+/* Warns about anything that hasn't been freed, returns how many */
+uint64 memref_leaks();
+
 #endif /* __MEMREF_H__ */
@@ -102,19 +102,82 @@ void dumpLocationLocks(drivelocks* locks)
  * amounts of memory allocations
  */
 
+static memref_count g_memCounts[kMemRef_MaxType + 1];
+
+static const char* kMemNames[kMemRef_MaxType] =
+  { "blocks", "records", "attributes", "attribute enumerators", "data runs" };
+
+static void countAlloc(memref_count* count, size_t sz)
+{
+  count->allocs++;
+  count->live++;
+  count->bytes += sz;
+
+  if(count->bytes > count->peak)
+    count->peak = count->bytes;
+}
+
+void memref_alloc(int type, size_t sz)
+{
+  ASSERT(type >= 0 && type < kMemRef_MaxType);
+  countAlloc(g_memCounts + type, sz);
+  countAlloc(g_memCounts + kMemRef_Total, sz);
+}
+
+void memref_free(int type, size_t sz)
+{
+  ASSERT(type >= 0 && type < kMemRef_MaxType);
+  ASSERT(g_memCounts[type].live > 0 && g_memCounts[type].bytes >= sz);
+
+  g_memCounts[type].live--;
+  g_memCounts[type].bytes -= sz;
+  g_memCounts[kMemRef_Total].live--;
+  g_memCounts[kMemRef_Total].bytes -= sz;
+}
+
+const memref_count* memref_counts(int type)
+{
+  ASSERT(type >= 0 && type <= kMemRef_Total);
+  return g_memCounts + type;
+}
+
+uint64 memref_leaks()
+{
+  int i;
+
+  for(i = 0; i < kMemRef_MaxType; i++)
+  {
+    if(g_memCounts[i].live)
+    {
+#ifdef _WIN32
+      warnx("memory leak: %I64u %s not freed (%I64u bytes)", 
+            g_memCounts[i].live, kMemNames[i], g_memCounts[i].bytes);
+#else
+      warnx("memory leak: %llu %s not freed (%llu bytes)", 
+            (unsigned long long)g_memCounts[i].live, kMemNames[i], 
+            (unsigned long long)g_memCounts[i].bytes);
+#endif
+    }
+  }
+
+  return g_memCounts[kMemRef_Total].live;
+}
+
 #ifdef _DEBUG
 const size_t kRefSig = 0x1F2F3F4F;
 
 void* _refalloc_dbg(size_t sz)
 {
-	/* Allocate extra counter value before memory */
-	size_t* mem = (size_t*)mallocf(sz * sizeof(size_t) * 2);
+	/* Allocate signature, size and counter values before memory */
+	size_t* mem = (size_t*)mallocf(sz + sizeof(size_t) * 3);
 
 	if(mem)
 	{
 		mem[0] = kRefSig;
-		mem[1] = 1;
-		return mem + 2;
+		mem[1] = sz;
+		mem[2] = 1;
+		memref_alloc(kMemRef_Blocks, sz);
+		return mem + 3;
 	}
 
 	return mem;
@@ -123,13 +186,15 @@ void* _refalloc_dbg(size_t sz)
 
 void* _refalloc(size_t sz)
 {
-	/* Allocate extra counter value before memory */
-	size_t* mem = (size_t*)mallocf(sz * sizeof(size_t) * 1);
+	/* Allocate size and counter values before memory */
+	size_t* mem = (size_t*)mallocf(sz + sizeof(size_t) * 2);
 
 	if(mem)
 	{
-		mem[0] = 1;
-		return mem + 1;
+		mem[0] = sz;
+		mem[1] = 1;
+		memref_alloc(kMemRef_Blocks, sz);
+		return mem + 2;
 	}
 
 	return mem;
@@ -141,9 +206,9 @@ void* _refadd_dbg(void* buf)
 	if(buf)
 	{
 		/* Increment the counter value */
-		size_t* mem = (size_t*)buf - 2;
+		size_t* mem = (size_t*)buf - 3;
 		assert(mem[0] == kRefSig);
-		mem[1]++;
+		mem[2]++;
 	}
 
 	return buf;
@@ -165,11 +230,14 @@ void _refrelease_dbg(void* buf)
 	if(buf)
 	{
 		/* Decrement the counter value */
-		size_t* mem = (size_t*)buf - 2;
+		size_t* mem = (size_t*)buf - 3;
 		assert(mem[0] == kRefSig);
 
-		if(!--mem[1])
+		if(!--mem[2])
+		{
+			memref_free(kMemRef_Blocks, mem[1]);
 			free(mem);
+		}
 	}
 }
 #endif
@@ -179,10 +247,13 @@ void _refrelease(void* buf)
 	if(buf)
 	{
 		/* Decrement the counter value */
-		size_t* mem = (size_t*)buf - 1;
+		size_t* mem = (size_t*)buf - 2;
 
-		if(!--mem[0])
+		if(!--mem[1])
+		{
+			memref_free(kMemRef_Blocks, mem[0]);
 			free(mem);
+		}
 	}
 }
 
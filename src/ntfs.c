@@ -32,6 +32,10 @@ ntfs_attribheader* ntfs_searchattribute(byte* location, uint32 attrType, byte* e
 	{
 		ntfs_attribheader* attrib = (ntfs_attribheader*)location;
 
+		/* Corrupted records would loop forever */
+		if(attrib->cbAttribute == 0)
+			break;
+
 		if(!skip)
 		{
 			if(attrib->type == attrType)
@@ -75,6 +79,60 @@ byte* ntfs_getattributedata(ntfs_attribresident* attrib, byte* end)
 	return data;
 }
 
+bool ntfs_isbootsector(ntfs_bootsector* boot)
+{
+  uint32 clusterSize;
+  signed char clusPerMFT;
+
+  if(memcmp(boot->sysId, kNTFS_SysId, sizeof(boot->sysId)) ||
+     boot->endMarker != kNTFS_BootMarker)
+    return false;
+
+  /* Sector size must be a power of two we can work with */
+  if(boot->bytePerSec < kSectorSize || boot->bytePerSec > 0x1000 ||
+     (boot->bytePerSec & (boot->bytePerSec - 1)))
+    return false;
+
+  /* Same for sectors per cluster */
+  if(boot->secPerClus == 0 || (boot->secPerClus & (boot->secPerClus - 1)))
+    return false;
+
+  clusterSize = boot->secPerClus * boot->bytePerSec;
+  if(clusterSize > 128 * kSectorSize)
+    return false;
+
+  if(boot->cSectors == 0)
+    return false;
+
+  /* The MFT and its mirror have to be inside the volume */
+  if(boot->offMFT == 0 || boot->offMFTMirr == 0 ||
+     boot->offMFT * boot->secPerClus >= boot->cSectors ||
+     boot->offMFTMirr * boot->secPerClus >= boot->cSectors)
+    return false;
+
+  /*
+   * The MFT record size is either in clusters, or when negative
+   * a power of two in bytes.
+   */
+  clusPerMFT = (signed char)(boot->clusPerMFT & 0xFF);
+  if(clusPerMFT < 0 && (clusPerMFT < -31 || (1U << -clusPerMFT) < kSectorSize))
+    return false;
+  if(clusPerMFT == 0)
+    return false;
+
+  return true;
+}
+
+uint32 ntfs_bootrecordsize(ntfs_bootsector* boot)
+{
+  signed char clusPerMFT = (signed char)(boot->clusPerMFT & 0xFF);
+
+  if(clusPerMFT < 0)
+    return 1U << -clusPerMFT;
+
+  return (uint32)clusPerMFT * boot->secPerClus * boot->bytePerSec;
+}
+
 bool ntfs_isbetternamespace(byte n1, byte n2)
 {
   /*
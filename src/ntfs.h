@@ -32,7 +32,11 @@ typedef int16 ntfs_char;
 /* WARNING Assumptions: */
 #define kNTFS_RecordLen   0x0400
 
+/* The record size found in the boot sector, or the above */
+#define RECORD_SIZE(info) ((info).record ? (info).record : kNTFS_RecordLen)
+
 #define kNTFS_SysId       "NTFS    "
+#define kNTFS_BootMarker  0xAA55
 
 typedef struct ntfs_bootsector
 {
@@ -53,6 +57,9 @@ typedef struct ntfs_bootsector
 	uint32 clusPerMFT;		/* Clusters per MFT Record (b) */
 	uint32 clusPerIndex;	/* Clusters per Index Record */
 	uint64 serialNum;		  /* Volume serial number */
+	uint32 checksum;		  /* Boot sector checksum */
+	byte bootCode[426];		/* Boot loader code */
+	uint16 endMarker;		  /* Always 55 AA */
 }
 ntfs_bootsector;
 
@@ -63,6 +70,9 @@ ntfs_bootsector;
 #define kNTFS_RecFlagUse    0x01
 #define kNTFS_RecFlagDir    0x02
 
+/* The MFT index of the root directory */
+#define kNTFS_RootIndex     5
+
 #ifdef _WIN32
   #define kNTFS_RefMask 0xFFFFFFFFFFFF
 #else
@@ -132,6 +142,7 @@ typedef struct _ntfs_attribnonresident
 ntfs_attribnonresident;
 
 
+#define kNTFS_STDINFO           0x10
 #define kNTFS_ATTRIBUTE_LIST    0x20
 #define kNTFS_FILENAME          0x30
 #define kNTFS_DATA              0x80
@@ -181,6 +192,20 @@ typedef struct _ntfs_attribfilename
 }
 ntfs_attribfilename;
 
+typedef struct _ntfs_attribstdinfo
+{
+	uint64 timeCreated;		/* C Time - File Creation */
+	uint64 timeAltered;		/* A Time - File Altered */
+	uint64 timeModified;	/* M Time - MFT Changed */
+	uint64 timeRead;		  /* R Time - File Read */
+	uint32 flags;			    /* DOS File Permissions */
+	uint32 maxVersions;		/* Maximum Number of Versions */
+	uint32 version;			  /* Version Number */
+	uint32 classId;			  /* Class Id */
+						          /* (3.0) Owner, security, quota and USN follow */
+}
+ntfs_attribstdinfo;
+
 typedef struct _ntfs_attriblistrecord
 {
 	uint32 type;		    /* Type */
@@ -201,11 +226,13 @@ ntfs_attribheader* ntfs_nextattribute(ntfs_attribheader* attrib, uint32 attrType
 byte* ntfs_getattributeheaders(ntfs_recordheader* record);
 byte* ntfs_getattributedata(ntfs_attribresident* attrib, byte* end);
 
+bool ntfs_isbootsector(ntfs_bootsector* boot);
+uint32 ntfs_bootrecordsize(ntfs_bootsector* boot);
 bool ntfs_isbetternamespace(byte n1, byte n2);
 bool ntfs_dofixups(byte* cluster, uint32 size);
 
 /* TODO: Move these declarations elsewhere */
-char* unicode_transcode16to8(const ntfs_char* src, size_t len);
+size_t unicode_transcode16to8(const ntfs_char* src, size_t len, char* out, size_t outlen);
 ntfs_char* unicode_transcode8to16(const char* src, ntfs_char* out, size_t len);
 
 #endif /* __NTFS_H__ */
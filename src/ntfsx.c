@@ -21,10 +21,13 @@
 #include "memref.h"
 #include "ntfs.h"
 #include "ntfsx.h"
+#include "snapshot.h"
+#include "device.h"
 
 ntfsx_datarun* ntfsx_datarun_alloc(byte* mem, byte* datarun)
 {
   ntfsx_datarun* dr = (ntfsx_datarun*)mallocf(sizeof(ntfsx_datarun));
+  memref_alloc(kMemRef_Dataruns, sizeof(ntfsx_datarun));
 
   ASSERT(datarun);
 	dr->_mem = (byte*)refadd(mem);
@@ -46,6 +49,7 @@ void ntfsx_datarun_free(ntfsx_datarun* dr)
     dr->_mem = NULL;
   }
 
+  memref_free(kMemRef_Dataruns, sizeof(ntfsx_datarun));
   free(dr);
 }
 
@@ -87,8 +91,8 @@ bool ntfsx_datarun_next(ntfsx_datarun* dr)
 	(dr->_curpos) += length;
 
 
-	/* Note that offset can be negative */
-	if(*((dr->_curpos) + (roffset - 1)) & 0x80)
+	/* Note that offset can be negative. Sparse runs have none */
+	if(roffset > 0 && *((dr->_curpos) + (roffset - 1)) & 0x80)
 		memset(&offset, ~0, sizeof(int64));
 	else
 		memset(&offset, 0, sizeof(int64));
@@ -132,10 +136,7 @@ bool ntfsx_cluster_read(ntfsx_cluster* clus, partitioninfo* info, uint64 begSect
     ntfsx_cluster_reserve(clus, info);
 
   pos = SECTOR_TO_BYTES(begSector);
-  if(lseek64(dd, pos, SEEK_SET) == -1)
-    return false;
-
-  sz = read(dd, clus->data, clus->size);
+  sz = device_read(dd, info->direct, pos, clus->data, clus->size);
   if(sz == -1)
     return false;
 
@@ -163,6 +164,7 @@ void ntfsx_cluster_release(ntfsx_cluster* clus)
 ntfsx_attribute* ntfsx_attribute_alloc(ntfsx_cluster* clus, ntfs_attribheader* header)
 {
   ntfsx_attribute* attr = (ntfsx_attribute*)mallocf(sizeof(ntfsx_attribute));
+  memref_alloc(kMemRef_Attributes, sizeof(ntfsx_attribute));
   attr->_header = header;
   attr->_mem = (byte*)refadd(clus->data);
   attr->_length = clus->size;
@@ -177,6 +179,7 @@ void ntfsx_attribute_free(ntfsx_attribute* attr)
     attr->_mem = NULL;
   }
 
+  memref_free(kMemRef_Attributes, sizeof(ntfsx_attribute));
   free(attr);
 }
 
@@ -229,6 +232,7 @@ bool ntfsx_attribute_next(ntfsx_attribute* attr, uint32 attrType)
 ntfsx_attrib_enum* ntfsx_attrib_enum_alloc(uint32 type, bool normal)
 {
   ntfsx_attrib_enum* attrenum = (ntfsx_attrib_enum*)mallocf(sizeof(ntfsx_attrib_enum));
+  memref_alloc(kMemRef_Enums, sizeof(ntfsx_attrib_enum));
   attrenum->type = type;
   attrenum->_attrhead = NULL;
   attrenum->_listrec = NULL;
@@ -289,6 +293,7 @@ ntfsx_attribute* ntfsx_attrib_enum_list(ntfsx_attrib_enum* attrenum, ntfsx_recor
   ntfs_recordheader* rechead;
   ntfs_attribresident* resident;
   ntfs_attribheader* attrhead;
+  ntfs_attribheader* first;
   ntfsx_attribute* attr;
   uint64 mftRecord;
   ntfsx_record* r2;
@@ -376,6 +381,17 @@ ntfsx_attribute* ntfsx_attrib_enum_list(ntfsx_attrib_enum* attrenum, ntfsx_recor
           attrhead = ntfs_findattribute(rechead, attrenum->type,
                                           c2->data + c2->size);
 
+          /* 
+           * A record can have several attributes of a type (ie: the 
+           * names of a hard linked file) so find the one listed.
+           */
+          first = attrhead;
+          while(attrhead && attrhead->idAttribute != attrenum->_listrec->idAttribute)
+            attrhead = ntfs_nextattribute(attrhead, attrenum->type, c2->data + c2->size);
+
+          if(!attrhead)
+            attrhead = first;
+
           if(attrhead)
             attr = ntfsx_attribute_alloc(c2, attrhead);
         }
@@ -437,6 +453,7 @@ ntfsx_attribute* ntfsx_attrib_enum_all(ntfsx_attrib_enum* attrenum, ntfsx_record
 
 void ntfsx_attrib_enum_free(ntfsx_attrib_enum* attrenum)
 {
+  memref_free(kMemRef_Enums, sizeof(ntfsx_attrib_enum));
   free(attrenum);
 } 
 
@@ -445,6 +462,7 @@ void ntfsx_attrib_enum_free(ntfsx_attrib_enum* attrenum)
 ntfsx_record* ntfsx_record_alloc(partitioninfo* info)
 {
   ntfsx_record* rec = (ntfsx_record*)mallocf(sizeof(ntfsx_record));
+  memref_alloc(kMemRef_Records, sizeof(ntfsx_record));
   rec->info = info;
   memset(&(rec->_clus), 0, sizeof(ntfsx_cluster));
   return rec;
@@ -453,6 +471,7 @@ ntfsx_record* ntfsx_record_alloc(partitioninfo* info)
 void ntfsx_record_free(ntfsx_record* record)
 {
     ntfsx_cluster_release(&(record->_clus));
+    memref_free(kMemRef_Records, sizeof(ntfsx_record));
     free(record);
 }
 
@@ -460,7 +479,26 @@ bool ntfsx_record_read(ntfsx_record* record, uint64 begSector, int dd)
 {
     ntfs_recordheader* rechead;
 
-    if(!ntfsx_cluster_read(&(record->_clus), record->info, begSector, dd))
+    /* Records aren't necessarily the same size as a cluster */
+    if(!record->_clus.data)
+    {
+      record->_clus.size = RECORD_SIZE(*(record->info));
+      record->_clus.data = (byte*)refalloc(record->_clus.size);
+    }
+
+    /* Records in a snapshot don't need the disk */
+    if(record->info->snapshot && record->info->mftmap &&
+       snapshot_read(record->info->snapshot, record->info->mftmap, begSector, 
+                     record->_clus.data, record->_clus.size))
+      ;
+
+    /* Nor do ones read along with the records before them */
+    else if(record->info->records &&
+            ntfsx_records_get(record->info->records, begSector,
+                              record->_clus.data, record->_clus.size))
+      ;
+
+    else if(!ntfsx_cluster_read(&(record->_clus), record->info, begSector, dd))
     {
         warn("couldn't read mft record from drive");
         return false;
@@ -621,7 +659,7 @@ bool ntfsx_mftmap_load(ntfsx_mftmap* map, ntfsx_record* record, int dd)
 
                 ASSERT(map->info->cluster != 0);
 
-                length = datarun->length * ((map->info->cluster * kSectorSize) / kNTFS_RecordLen);
+                length = (datarun->length * CLUSTER_SIZE(*(map->info))) / RECORD_SIZE(*(map->info));
                 if(length == 0)
                   continue;
 
@@ -702,7 +740,7 @@ uint64 ntfsx_mftmap_sectorforindex(ntfsx_mftmap* map, uint64 index)
     }
     else
     {
-      sector = index * (kNTFS_RecordLen / kSectorSize);
+      sector = index * (RECORD_SIZE(*(map->info)) / kSectorSize);
       sector += p->firstSector;
 
       if(sector >= map->info->end)
@@ -714,3 +752,117 @@ uint64 ntfsx_mftmap_sectorforindex(ntfsx_mftmap* map, uint64 index)
 
   return kInvalidSector;
 }
+
+uint64 ntfsx_mftmap_indexforsector(ntfsx_mftmap* map, uint64 sector)
+{
+  uint32 i;
+  struct _ntfsx_mftmap_block* p;
+  uint64 index = 0;
+  uint64 perRecord = RECORD_SIZE(*(map->info)) / kSectorSize;
+
+  for(i = 0; i < map->_count; i++)
+  {
+    p = map->_blocks + i;
+
+    /* Only the start of a record counts */
+    if(sector >= p->firstSector && sector < p->firstSector + (p->length * perRecord))
+    {
+      if((sector - p->firstSector) % perRecord)
+        return kInvalidSector;
+
+      return index + ((sector - p->firstSector) / perRecord);
+    }
+
+    index += p->length;
+  }
+
+  return kInvalidSector;
+}
+
+bool ntfsx_mftmap_block(ntfsx_mftmap* map, uint32 i, uint64* firstSector, uint64* length)
+{
+  if(i >= map->_count)
+    return false;
+
+  *firstSector = map->_blocks[i].firstSector;
+  *length = map->_blocks[i].length;
+  return true;
+}
+
+void ntfsx_mftmap_addblock(ntfsx_mftmap* map, uint64 firstSector, uint64 length)
+{
+  map->_blocks = (struct _ntfsx_mftmap_block*)reallocf(map->_blocks, 
+                  (map->_count + 1) * sizeof(struct _ntfsx_mftmap_block));
+
+  map->_blocks[map->_count].firstSector = firstSector;
+  map->_blocks[map->_count].length = length;
+  map->_count++;
+}
+
+
+
+void ntfsx_records_init(ntfsx_records* recs, partitioninfo* info, uint32 max)
+{
+  recs->info = info;
+  recs->_data = NULL;
+  recs->_sector = kInvalidSector;
+  recs->_count = 0;
+  recs->_max = max > 0 ? max : 1;
+}
+
+void ntfsx_records_destroy(ntfsx_records* recs)
+{
+  device_free(recs->_data);
+  recs->_data = NULL;
+  recs->_count = 0;
+}
+
+bool ntfsx_records_has(ntfsx_records* recs, uint64 sector)
+{
+  uint64 sectors = RECORD_SIZE(*(recs->info)) / kSectorSize;
+
+  return recs->_count > 0 && sector >= recs->_sector &&
+         sector < recs->_sector + (recs->_count * sectors);
+}
+
+void ntfsx_records_load(ntfsx_records* recs, ntfsx_mftmap* map, uint64 index)
+{
+  uint32 size = RECORD_SIZE(*(recs->info));
+  uint64 length = ntfsx_mftmap_length(map);
+  uint64 sector;
+  uint32 num;
+
+  recs->_count = 0;
+  recs->_sector = ntfsx_mftmap_sectorforindex(map, index);
+  if(recs->_sector == kInvalidSector)
+    return;
+
+  /* Only the records that follow on from this one on the disk */
+  for(num = 1; num < recs->_max && index + num < length; num++)
+  {
+    sector = ntfsx_mftmap_sectorforindex(map, index + num);
+    if(sector != recs->_sector + ((uint64)num * size) / kSectorSize)
+      break;
+  }
+
+  if(!recs->_data)
+    recs->_data = (byte*)device_alloc(recs->_max * size);
+
+  /* 
+   * When they can't be read together the records are left to 
+   * be read one at a time, so a bad sector only loses its own
+   */
+  if(device_read(recs->info->device, recs->info->direct, 
+                 SECTOR_TO_BYTES(recs->_sector), recs->_data, 
+                 num * size) == (int)(num * size))
+    recs->_count = num;
+}
+
+bool ntfsx_records_get(ntfsx_records* recs, uint64 sector, byte* data, uint32 size)
+{
+  if(size != RECORD_SIZE(*(recs->info)) || !ntfsx_records_has(recs, sector))
+    return false;
+
+  memcpy(data, recs->_data + SECTOR_TO_BYTES(sector - recs->_sector), size);
+  return true;
+}
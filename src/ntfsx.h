@@ -126,5 +126,30 @@ void ntfsx_mftmap_destroy(ntfsx_mftmap* map);
 bool ntfsx_mftmap_load(ntfsx_mftmap* map, ntfsx_record* record, int dd);
 uint64 ntfsx_mftmap_length(ntfsx_mftmap* map);
 uint64 ntfsx_mftmap_sectorforindex(ntfsx_mftmap* map, uint64 index);
+uint64 ntfsx_mftmap_indexforsector(ntfsx_mftmap* map, uint64 sector);
+
+/* The map itself, for keeping it somewhere else */
+bool ntfsx_mftmap_block(ntfsx_mftmap* map, uint32 i, uint64* firstSector, uint64* length);
+void ntfsx_mftmap_addblock(ntfsx_mftmap* map, uint64 firstSector, uint64 length);
+
+
+
+/* used as a stack based object */
+typedef struct _ntfsx_records
+{
+  partitioninfo* info;
+  byte* _data;
+  uint64 _sector;   /* Where the records in data start on the disk */
+  uint32 _count;    /* The records in data */
+  uint32 _max;      /* The most records read at once */
+}
+ntfsx_records;
+
+/* MFT records read from the disk several at a time */
+void ntfsx_records_init(ntfsx_records* recs, partitioninfo* info, uint32 max);
+void ntfsx_records_destroy(ntfsx_records* recs);
+bool ntfsx_records_has(ntfsx_records* recs, uint64 sector);
+void ntfsx_records_load(ntfsx_records* recs, ntfsx_mftmap* map, uint64 index);
+bool ntfsx_records_get(ntfsx_records* recs, uint64 sector, byte* data, uint32 size);
 
 #endif 
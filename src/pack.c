@@ -0,0 +1,268 @@
+/* 
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ * 
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+
+#define _LARGEFILE_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include "usuals.h"
+#include "pack.h"
+#include "catalog.h"
+
+/* Files up to this size are held in memory until their hash is known */
+#define kPack_Buffer      0x100000
+
+typedef struct _pack_blob
+{
+  byte digest[kSHA256_Length];
+  uint64 offset;
+  uint64 length;
+  bool used;
+}
+pack_blob;
+
+static void writeBlob(pack* p, uint64 offset, const byte* data, size_t len)
+{
+  if(pwrite(p->fd, data, len, offset) != (int)len)
+    err(1, "couldn't write to pack");
+}
+
+static pack_blob* findBlob(pack* p, const byte* digest)
+{
+  uint32 i;
+
+  /* The digest is already as random as it gets */
+  memcpy(&i, digest, sizeof(i));
+
+  for(i &= (p->_size - 1); p->_table[i].used; i = (i + 1) & (p->_size - 1))
+  {
+    if(!memcmp(p->_table[i].digest, digest, kSHA256_Length))
+      break;
+  }
+
+  return p->_table + i;
+}
+
+static void growTable(pack* p)
+{
+  pack_blob* old = p->_table;
+  uint32 size = p->_size;
+  pack_blob* blob;
+  uint32 i;
+
+  p->_size = size ? size * 2 : 0x400;
+  p->_table = (pack_blob*)mallocf(p->_size * sizeof(pack_blob));
+  memset(p->_table, 0, p->_size * sizeof(pack_blob));
+
+  for(i = 0; i < size; i++)
+  {
+    if(old[i].used)
+    {
+      blob = findBlob(p, old[i].digest);
+      memcpy(blob, old + i, sizeof(pack_blob));
+    }
+  }
+
+  if(old)
+    free(old);
+}
+
+void pack_init(pack* p, int fd, FILE* manifest)
+{
+  memset(p, 0, sizeof(pack));
+  p->fd = fd;
+  p->manifest = manifest;
+  p->_buf = (byte*)mallocf(kPack_Buffer);
+  growTable(p);
+}
+
+void pack_begin(pack* p, archive_entry* entry)
+{
+  size_t len;
+
+  memcpy(&(p->_entry), entry, sizeof(archive_entry));
+
+  /* Hang on to what we need for the manifest */
+  len = (fcslen(entry->path) + 1) * sizeof(fchar_t);
+  p->_entry.path = (fchar_t*)mallocf(len);
+  memcpy((fchar_t*)p->_entry.path, entry->path, len);
+
+  if(entry->map)
+  {
+    len = entry->mapCount * 2 * sizeof(uint64);
+    p->_entry.map = (uint64*)mallocf(len);
+    memcpy(p->_entry.map, entry->map, len);
+  }
+
+  sha256_init(&(p->_hash));
+  p->_used = 0;
+  p->_streaming = false;
+  p->_length = 0;
+}
+
+void pack_write(pack* p, const byte* data, size_t len)
+{
+  sha256_update(&(p->_hash), data, len);
+
+  if(!p->_streaming)
+  {
+    if(p->_used + len <= kPack_Buffer)
+    {
+      memcpy(p->_buf + p->_used, data, len);
+      p->_used += len;
+      p->_length += len;
+      return;
+    }
+
+    /* 
+     * Too big to wait for the hash. Write it out, and if it turns
+     * out to be a duplicate, the next file goes over it.
+     */
+    writeBlob(p, p->end, p->_buf, p->_used);
+    p->_streaming = true;
+  }
+
+  writeBlob(p, p->end + p->_length, data, len);
+  p->_length += len;
+}
+
+static void writeManifest(pack* p, const byte* digest, uint64 offset)
+{
+  archive_entry* entry = &(p->_entry);
+  char hex[(kSHA256_Length * 2) + 1];
+  uint32 i;
+
+  fprintf(p->manifest, "{\"path\":");
+  catalog_string(p->manifest, entry->path);
+  fprintf(p->manifest, ",\"type\":\"%s\"", entry->dir ? "dir" : "file");
+  catalog_number(p->manifest, "mode", entry->mode);
+
+  if(!entry->dir)
+  {
+    for(i = 0; i < kSHA256_Length; i++)
+      sprintf(hex + (i * 2), "%02x", digest[i]);
+
+    fprintf(p->manifest, ",\"sha256\":\"%s\"", hex);
+    catalog_number(p->manifest, "offset", offset);
+    catalog_number(p->manifest, "length", p->_length);
+    catalog_number(p->manifest, "size", entry->size);
+
+    /* The pack has only what's not a hole */
+    if(entry->map)
+    {
+      fprintf(p->manifest, ",\"map\":[");
+      for(i = 0; i < entry->mapCount; i++)
+      {
+#ifdef _WIN32
+        fprintf(p->manifest, i ? ",[%I64u,%I64u]" : "[%I64u,%I64u]", 
+                entry->map[i * 2], entry->map[(i * 2) + 1]);
+#else
+        fprintf(p->manifest, i ? ",[%llu,%llu]" : "[%llu,%llu]", 
+                (unsigned long long)entry->map[i * 2], 
+                (unsigned long long)entry->map[(i * 2) + 1]);
+#endif
+      }
+      fprintf(p->manifest, "]");
+    }
+  }
+
+  catalog_time(p->manifest, "created", entry->created);
+  catalog_time(p->manifest, "modified", entry->modified);
+  catalog_time(p->manifest, "accessed", entry->accessed);
+  fprintf(p->manifest, "}\n");
+}
+
+void pack_end(pack* p)
+{
+  byte digest[kSHA256_Length];
+  pack_blob* blob;
+  uint64 offset = 0;
+
+  if(!p->_entry.dir)
+  {
+    sha256_final(&(p->_hash), digest);
+    blob = findBlob(p, digest);
+
+    if(blob->used && blob->length == p->_length)
+    {
+      offset = blob->offset;
+      p->saved += p->_length;
+    }
+
+    else
+    {
+      if(!p->_streaming)
+        writeBlob(p, p->end, p->_buf, p->_used);
+
+      offset = p->end;
+      p->end += p->_length;
+
+      memcpy(blob->digest, digest, kSHA256_Length);
+      blob->offset = offset;
+      blob->length = p->_length;
+      blob->used = true;
+
+      /* Keep the table at most half full */
+      if(++(p->_count) * 2 > p->_size)
+        growTable(p);
+    }
+
+    p->files++;
+  }
+
+  writeManifest(p, digest, offset);
+
+  free((fchar_t*)p->_entry.path);
+  if(p->_entry.map)
+    free(p->_entry.map);
+
+  memset(&(p->_entry), 0, sizeof(archive_entry));
+}
+
+void pack_link(pack* p, archive_entry* entry, const fchar_t* target)
+{
+  fprintf(p->manifest, "{\"path\":");
+  catalog_string(p->manifest, entry->path);
+  fprintf(p->manifest, ",\"type\":\"link\",\"target\":");
+  catalog_string(p->manifest, target);
+  fprintf(p->manifest, "}\n");
+}
+
+void pack_finish(pack* p)
+{
+  /* A duplicate written out last is left past the end */
+  if(ftruncate(p->fd, p->end) == -1)
+    warn("couldn't trim pack");
+
+  if(fflush(p->manifest) != 0)
+    err(1, "couldn't write pack manifest");
+
+#ifdef _WIN32
+  fprintf(stderr, "[Packed %I64u files, %u distinct, %I64u bytes not written]\n", 
+          p->files, p->_count, p->saved);
+#else
+  fprintf(stderr, "[Packed %llu files, %u distinct, %llu bytes not written]\n", 
+          (unsigned long long)p->files, p->_count, (unsigned long long)p->saved);
+#endif
+
+  free(p->_buf);
+  free(p->_table);
+  p->_buf = NULL;
+  p->_table = NULL;
+}
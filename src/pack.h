@@ -0,0 +1,69 @@
+/* 
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ * 
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+
+#ifndef __PACK_H__
+#define __PACK_H__
+
+#include "usuals.h"
+#include "archive.h"
+#include "sha256.h"
+
+/*
+ * Rescued files stored by their content. Each distinct content is 
+ * stored once in the pack file, and a manifest (JSON lines) maps the 
+ * paths of files to where their content is.
+ */
+
+struct _pack_blob;
+typedef struct _pack
+{
+  int fd;                       /* The pack file */
+  FILE* manifest;
+  uint64 end;                   /* Where the next content goes */
+
+  /* The file being written */
+  archive_entry _entry;
+  sha256 _hash;
+  byte* _buf;                   /* Small files wait here until known to be new */
+  size_t _used;
+  bool _streaming;              /* Too big to wait, already going to the pack */
+  uint64 _length;
+
+  /* Content already in the pack, by hash */
+  struct _pack_blob* _table;
+  uint32 _size;
+  uint32 _count;
+
+  uint64 files;
+  uint64 saved;                 /* Bytes that didn't need writing */
+}
+pack;
+
+void pack_init(pack* p, int fd, FILE* manifest);
+
+void pack_begin(pack* p, archive_entry* entry);
+void pack_write(pack* p, const byte* data, size_t len);
+void pack_end(pack* p);
+void pack_link(pack* p, archive_entry* entry, const fchar_t* target);
+
+/* Trims the pack and frees everything */
+void pack_finish(pack* p);
+
+#endif /* __PACK_H__ */
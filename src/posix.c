@@ -20,6 +20,7 @@
 
 #include "usuals.h"
 #include "ntfs.h"
+#include "stats.h"
 
 #include <sys/stat.h>
 #include <unistd.h>
@@ -43,64 +44,113 @@
 /* The unix epoch in NTFS ft */
 #define UNIX_EPOCH    116444736000000000LL
 
-void ntfs_maketvs(uint64* ft, struct timeval* tv)
+/* NTFS ft units in a second */
+#define FT_SECOND     10000000LL
+
+void ntfs_maketvs(uint64* ft, struct timespec* ts)
 {
   /* Anything before the unix epoch is stupid */
   if(*ft < UNIX_EPOCH)
   {
-    tv->tv_sec = 0;
-    tv->tv_usec = 0;
+    ts->tv_sec = 0;
+    ts->tv_nsec = 0;
   }
 
   /* Anything later than we can represent is a bummer */
-  else if(sizeof(tv->tv_sec) == 32)
+  else if(sizeof(ts->tv_sec) == 4 && 
+          (*ft - UNIX_EPOCH) / FT_SECOND > 0x7FFFFFFF)
   {
-    tv->tv_sec = 0x7FFFFFFF;
-    tv->tv_usec = 0x7FFFFFFF;
+    ts->tv_sec = 0x7FFFFFFF;
+    ts->tv_nsec = 0;
   }
 
   /* Now convert the valid range of dates */
   else
   {
-    uint mod = (*ft % 1000000000);
-    tv->tv_sec = ((*ft - mod) / 1000000000);
-    tv->tv_usec = mod / 1000;
+    ts->tv_sec = (time_t)((*ft - UNIX_EPOCH) / FT_SECOND);
+    ts->tv_nsec = (long)(((*ft - UNIX_EPOCH) % FT_SECOND) * 100);
   }
-};
+}
 
-void setFileTime(fchar_t* filename, uint64* created, 
-                  uint64* accessed, uint64* modified)
+static void applyFileTime(int fd, fchar_t* filename, uint64* created, 
+                          uint64* accessed, uint64* modified)
 {
-  int r;
+  struct timespec ts[2];
+#ifndef HAVE_FUTIMENS
   struct timeval tvs[2];
-  char* encoded;
+#endif
+
+  ntfs_maketvs(accessed, ts);
+  ntfs_maketvs(modified, ts + 1);
+
+#ifdef HAVE_FUTIMENS
+  /* Prefer the open file, so the path isn't looked up again */
+  if(fd != -1)
+  {
+    if(futimens(fd, ts) == -1)
+      warn("couldn't set file times on: " FC_PRINTF, filename);
+    return;
+  }
+
+  if(utimensat(AT_FDCWD, filename, ts, 0) == -1)
+    warn("couldn't set file times on: " FC_PRINTF, filename);
+#else
+  tvs[0].tv_sec = ts[0].tv_sec;
+  tvs[0].tv_usec = ts[0].tv_nsec / 1000;
+  tvs[1].tv_sec = ts[1].tv_sec;
+  tvs[1].tv_usec = ts[1].tv_nsec / 1000;
 
-  ntfs_maketvs(accessed, tvs);
-  ntfs_maketvs(modified, tvs + 1);
   if(utimes(filename, tvs) == -1)
-    warn("couldn't set file times on: %s", encoded);
+    warn("couldn't set file times on: " FC_PRINTF, filename);
+#endif
 }
 
-void setFileAttributes(fchar_t* filename, uint32 flags)
+static void applyFileAttributes(int fd, fchar_t* filename, uint32 flags)
 {
-  char* encoded;
   struct stat st;
+  int r;
 
   if(flags & kNTFS_FileReadOnly)
   {
-    if(stat(filename, &st) == -1)
+#ifdef HAVE_FCHMOD
+    if(fd != -1)
+      r = fstat(fd, &st);
+    else
+#endif
+      r = stat(filename, &st);
+
+    if(r == -1)
     {
-      warn("couldn't read file status for: " FC_PRINTF, encoded);
+      warn("couldn't read file status for: " FC_PRINTF, filename);
     }
     else
     {
       st.st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
-	fprintf(stderr, "mode: %x", st.st_mode);
 
-      if(chmod(filename, st.st_mode) == -1)
-        warn("couldn't set file attributes for: " FC_PRINTF, encoded);
+#ifdef HAVE_FCHMOD
+      if(fd != -1)
+        r = fchmod(fd, st.st_mode);
+      else
+#endif
+        r = chmod(filename, st.st_mode);
+
+      if(r == -1)
+        warn("couldn't set file attributes for: " FC_PRINTF, filename);
     }
   }
 }
 
+void setFileTime(int fd, fchar_t* filename, uint64* created, 
+                  uint64* accessed, uint64* modified)
+{
+  uint64 entered = stats_enter(kStats_Meta);
+  applyFileTime(fd, filename, created, accessed, modified);
+  stats_leave(kStats_Meta, entered);
+}
 
+void setFileAttributes(int fd, fchar_t* filename, uint32 flags)
+{
+  uint64 entered = stats_enter(kStats_Meta);
+  applyFileAttributes(fd, filename, flags);
+  stats_leave(kStats_Meta, entered);
+}
@@ -25,8 +25,19 @@
 #include "ntfs.h"
 #include "ntfsx.h"
 #include "locks.h"
+#include "dircache.h"
+#include "filter.h"
+#include "catalog.h"
+#include "snapshot.h"
+#include "archive.h"
+#include "sweep.h"
+#include "writer.h"
+#include "device.h"
+#include "stats.h"
+
+/* Parent directories nested deeper than this are looping */
+#define MAX_DIR_DEPTH             0x100
 
-#define PROCESS_MFT_FLAG_SUB      1 << 1
 #define DEF_FILE_MODE 0x180
 #define DEF_DIR_MODE 0x1C0
 
@@ -41,21 +52,219 @@ typedef struct _filebasics
 }
 filebasics;
 
+/* Another name of a hard linked file */
+typedef struct _filelink
+{
+  uint64 parent;
+  fchar_t filename[MAX_PATH + 1];
+}
+filelink;
+
+typedef struct _dirmeta
+{
+  uint64 ref;             /* The directory in the cache */
+  uint64 created;
+  uint64 modified;
+  uint64 accessed;
+  uint32 flags;
+}
+dirmeta;
+
+typedef struct _deferredmeta
+{
+  dirmeta* _dirs;
+  uint32 _count;
+  uint32 _alloc;
+}
+deferredmeta;
+
+void deferDirectory(deferredmeta* deferred, uint64 ref, filebasics* basics)
+{
+  dirmeta* dir;
+
+  if(deferred->_count >= deferred->_alloc)
+  {
+    deferred->_alloc += 0x100;
+    deferred->_dirs = (dirmeta*)reallocf(deferred->_dirs, 
+                              deferred->_alloc * sizeof(dirmeta));
+    if(!deferred->_dirs)
+      errx(1, "out of memory");
+  }
+
+  dir = deferred->_dirs + deferred->_count;
+  dir->ref = ref;
+  dir->created = basics->created;
+  dir->modified = basics->modified;
+  dir->accessed = basics->accessed;
+  dir->flags = basics->flags;
+
+  deferred->_count++;
+}
+
+void archiveDirectory(archive* ar, const fchar_t* path, dirmeta* dir)
+{
+  archive_entry entry;
+
+  memset(&entry, 0, sizeof(entry));
+  entry.path = path;
+  entry.dir = true;
+  entry.mode = DEF_DIR_MODE;
+  entry.created = dir->created;
+  entry.modified = dir->modified;
+  entry.accessed = dir->accessed;
+
+  archive_begin(ar, &entry);
+  archive_end(ar);
+}
+
+void applyDirectories(partitioninfo* pi)
+{
+  deferredmeta* deferred = pi->deferred;
+  dircache* dirs = pi->dirs;
+  fchar_t path[MAX_PATH + 1];
+  dirmeta* dir;
+  uint32 i;
+  int fd;
+
+  /* 
+   * Parents are always added before their children, so going 
+   * backwards sets the children first. That way making a parent
+   * read-only or touching it happens last.
+   */
+  for(i = deferred->_count; i > 0; i--)
+  {
+    dir = deferred->_dirs + (i - 1);
+
+    /* Only directories we made, not ones that were already there */
+    if(!dircache_made(dirs, dir->ref))
+      continue;
+
+    /* 
+     * In an archive the directories go at the end, otherwise
+     * they'd get extracted before the files go in them.
+     */
+    if(pi->archive)
+    {
+      if(dircache_path(dirs, dir->ref, '/', path, MAX_PATH))
+        archiveDirectory(pi->archive, path, dir);
+      continue;
+    }
+
+    /* The path is needed where there's no handle, and for messages */
+    if(!dircache_path(dirs, dir->ref, FC_SLASH, path, MAX_PATH))
+      continue;
+
+    fd = -1;
+
+#if !defined(FC_WIDE) && defined(O_DIRECTORY)
+    fd = dircache_open(dirs, dir->ref, FC_DOT, O_RDONLY | O_DIRECTORY, 0);
+#endif
+
+    setFileTime(fd, path, &(dir->created), 
+                &(dir->accessed), &(dir->modified));
+    setFileAttributes(fd, path, dir->flags);
+
+    if(fd != -1)
+      close(fd);
+  }
+
+  if(deferred->_dirs)
+    free(deferred->_dirs);
+
+  memset(deferred, 0, sizeof(deferredmeta));
+}
+
+/* The path of a file below the output directory */
+bool makePath(partitioninfo* pi, uint64 parent, const fchar_t* filename, 
+              fchar_t sep, fchar_t* path)
+{
+  uint64 entered = stats_enter(kStats_Names);
+  bool ret = false;
+  size_t len;
+
+  if(dircache_path(pi->dirs, parent, sep, path, MAX_PATH))
+  {
+    len = fcslen(path);
+    if(len + fcslen(filename) + 2 <= MAX_PATH)
+    {
+      if(len > 0)
+        path[len++] = sep;
+
+      fcscpy(path + len, filename);
+      ret = true;
+    }
+  }
+
+  stats_leave(kStats_Names, entered);
+  return ret;
+}
+
+bool makeFilePath(partitioninfo* pi, filebasics* basics, fchar_t sep, fchar_t* path)
+{
+  return makePath(pi, basics->parent, basics->filename, sep, path);
+}
+
+/* The length of a file's main data stream */
+uint64 recordDataSize(ntfsx_record* record)
+{
+  ntfsx_attrib_enum* attrenum;
+  ntfsx_attribute* attr;
+  ntfs_attribheader* attrhead;
+  uint64 size = 0;
+
+  attrenum = ntfsx_attrib_enum_alloc(kNTFS_DATA, true);
+  attr = ntfsx_attrib_enum_all(attrenum, record);
+
+  if(attr)
+  {
+    attrhead = ntfsx_attribute_header(attr);
+
+    if(attrhead->bNonResident)
+      size = ((ntfs_attribnonresident*)attrhead)->cbAttribData;
+    else
+      size = ntfsx_attribute_getresidentsize(attr);
+
+    ntfsx_attribute_free(attr);
+  }
+
+  ntfsx_attrib_enum_free(attrenum);
+  return size;
+}
+
+/* Which way a rescued record went, for the stats */
+int recordKind(ntfsx_record* record)
+{
+  ntfsx_cluster* cluster = ntfsx_record_cluster(record);
+  ntfs_recordheader* header = ntfsx_record_header(record);
+  byte* end = cluster->data + cluster->size;
+  ntfs_attribheader* attrhead;
+
+  if(header->flags & kNTFS_RecFlagDir)
+    return kStats_RecDirectory;
+
+  if(ntfs_findattribute(header, kNTFS_ATTRIBUTE_LIST, end))
+    return kStats_RecAttrList;
+
+  attrhead = ntfs_findattribute(header, kNTFS_DATA, end);
+  if(attrhead && attrhead->bNonResident)
+    return kStats_RecNonResident;
+
+  return kStats_RecResident;
+}
+
 void processRecordFileBasics(partitioninfo* pi, ntfsx_record* record, filebasics* basics)
 {
   /* Data Attribute */
 	ntfsx_attribute* attr = NULL; 
   ntfsx_attrib_enum* attrenum = NULL;
+  uint64 entered = stats_enter(kStats_Names);
 
   {
-    byte* resident = NULL;
     ntfs_attribfilename* filename;
+    ntfs_attribstdinfo* stdinfo;
     byte nameSpace;
     ntfs_char* name;
     size_t len;
-#ifndef FC_WIDE
-    char* temp;
-#endif
 
     ASSERT(record);
     memset(basics, 0, sizeof(filebasics));
@@ -64,98 +273,806 @@ void processRecordFileBasics(partitioninfo* pi, ntfsx_record* record, filebasics
 	  /* Now get the name and info... */
   	attrenum = ntfsx_attrib_enum_alloc(kNTFS_FILENAME, true);
 
-		nameSpace = kNTFS_NameSpacePOSIX;
-		memset(basics->filename, 0, sizeof(basics->filename));
+		nameSpace = kNTFS_NameSpacePOSIX;
+		memset(basics->filename, 0, sizeof(basics->filename));
+
+		while((attr = ntfsx_attrib_enum_all(attrenum, record)) != NULL)
+		{
+			/* TODO ASSUMPTION: File name is always resident */
+			if(!ntfsx_attribute_header(attr)->bNonResident)
+      {
+  			/* Get out all the info we need */
+		  	filename = (ntfs_attribfilename*)ntfsx_attribute_getresidentdata(attr);
+        ASSERT(filename);
+		
+  			/*
+         * There can be multiple filenames with different 
+         * namespaces so choose the best one
+         */
+			  if(ntfs_isbetternamespace(nameSpace, filename->nameSpace))
+			  {
+				  /* Dates */
+          basics->created = filename->timeCreated;
+          basics->modified = filename->timeAltered;
+          basics->accessed = filename->timeRead;
+
+				  /* File Name */
+          name = (ntfs_char*)(((byte*)filename) + sizeof(ntfs_attribfilename));
+          len = filename->cFileName;
+          if(len > MAX_PATH)
+            len = MAX_PATH;
+
+#ifdef FC_WIDE
+          wcsncpy(basics->filename, name, len);
+          basics->filename[len] = 0;
+#else
+          unicode_transcode16to8(name, len, basics->filename, MAX_PATH + 1);
+#endif
+
+
+				  /* Attributes */
+          basics->flags = filename->flags;
+
+
+				  /* Parent Directory */
+          basics->parent = filename->refParent & kNTFS_RefMask;
+
+
+				  /* Namespace */
+				  nameSpace = filename->nameSpace;
+			  }
+      }
+
+      ntfsx_attribute_free(attr);
+      attr = NULL;
+		}
+
+    /* 
+     * The times and attributes in the file name are only updated 
+     * when it's renamed, so prefer the standard information.
+     */
+    attr = ntfsx_record_findattribute(record, kNTFS_STDINFO, pi->device);
+    if(attr)
+    {
+      if(!ntfsx_attribute_header(attr)->bNonResident &&
+         ntfsx_attribute_getresidentsize(attr) >= sizeof(ntfs_attribstdinfo))
+      {
+        stdinfo = (ntfs_attribstdinfo*)ntfsx_attribute_getresidentdata(attr);
+        ASSERT(stdinfo);
+
+        basics->created = stdinfo->timeCreated;
+        basics->modified = stdinfo->timeAltered;
+        basics->accessed = stdinfo->timeRead;
+        basics->flags = stdinfo->flags;
+      }
+
+      ntfsx_attribute_free(attr);
+      attr = NULL;
+    }
+  }
+
+  if(attr)
+    ntfsx_attribute_free(attr);
+
+  if(attrenum)
+    ntfsx_attrib_enum_free(attrenum);
+
+  stats_leave(kStats_Names, entered);
+}
+
+/* 
+ * Hard linked files have a file name for each link. Returns the 
+ * names other than the one in basics.
+ */
+uint32 processRecordLinks(partitioninfo* pi, ntfsx_record* record, 
+                          filebasics* basics, filelink** links)
+{
+  ntfsx_attrib_enum* attrenum;
+  ntfsx_attribute* attr;
+  ntfs_attribfilename* filename;
+  filelink link;
+  uint32 count = 0;
+  uint64 entered = stats_enter(kStats_Names);
+  uint32 i;
+
+  *links = NULL;
+  attrenum = ntfsx_attrib_enum_alloc(kNTFS_FILENAME, true);
+
+  while((attr = ntfsx_attrib_enum_all(attrenum, record)) != NULL)
+  {
+    filename = NULL;
+    if(!ntfsx_attribute_header(attr)->bNonResident)
+      filename = (ntfs_attribfilename*)ntfsx_attribute_getresidentdata(attr);
+
+    /* DOS names are just short versions of another one */
+    if(filename && filename->nameSpace != kNTFS_NameSpaceDOS)
+    {
+#ifdef FC_WIDE
+      i = min(filename->cFileName, MAX_PATH);
+      wcsncpy(link.filename, (ntfs_char*)(filename + 1), i);
+      link.filename[i] = 0;
+#else
+      unicode_transcode16to8((ntfs_char*)(filename + 1), filename->cFileName, 
+                             link.filename, MAX_PATH + 1);
+#endif
+
+      link.parent = filename->refParent & kNTFS_RefMask;
+      if(!pi->mftmap)
+        link.parent = pi->dirs->rootRef;
+
+      /* Skip the name we already have, and any we've seen */
+      for(i = 0; i < count; i++)
+      {
+        if((*links)[i].parent == link.parent && 
+           !fcscmp((*links)[i].filename, link.filename))
+          break;
+      }
+
+      if(i == count && link.filename[0] &&
+         (link.parent != basics->parent || fcscmp(link.filename, basics->filename)))
+      {
+        *links = (filelink*)reallocf(*links, (count + 1) * sizeof(filelink));
+        memcpy(*links + count, &link, sizeof(filelink));
+        count++;
+      }
+    }
+
+    ntfsx_attribute_free(attr);
+  }
+
+  ntfsx_attrib_enum_free(attrenum);
+
+  stats_leave(kStats_Names, entered);
+  return count;
+}
+
+/* 
+ * A file is rescued when any of its names gets past the filter, and 
+ * only those names are made. When the name in basics doesn't, the 
+ * first of the others that does takes its place.
+ */
+bool filterRecord(partitioninfo* pi, ntfsx_record* record, filebasics* basics, 
+                  filelink* links, uint32* numLinks)
+{
+  fchar_t path[MAX_PATH + 1];
+  bool matched;
+  uint32 i, n;
+
+  if(!filter_matchinfo(pi->filter, recordDataSize(record), basics->modified))
+    return false;
+
+  matched = makeFilePath(pi, basics, '/', path) &&
+            filter_matchname(pi->filter, path);
+
+  for(i = 0, n = 0; i < *numLinks; i++)
+  {
+    if(!makePath(pi, links[i].parent, links[i].filename, '/', path) ||
+       !filter_matchname(pi->filter, path))
+      continue;
+
+    if(!matched)
+    {
+      basics->parent = links[i].parent;
+      fcscpy(basics->filename, links[i].filename);
+      matched = true;
+      continue;
+    }
+
+    if(n != i)
+      memcpy(links + n, links + i, sizeof(filelink));
+    n++;
+  }
+
+  *numLinks = n;
+  return matched;
+}
+
+void catalogRecord(partitioninfo* pi, ntfsx_record* record, uint64 sector, 
+                   uint64 index, filebasics* basics, filelink* links, 
+                   uint32 numLinks, bool dir)
+{
+  ntfs_recordheader* header = ntfsx_record_header(record);
+  fchar_t path[MAX_PATH + 1];
+  catalogentry entry;
+  uint32 i;
+
+  if(!makeFilePath(pi, basics, '/', path))
+  {
+    warnx("path too long: " FC_PRINTF, basics->filename);
+    return;
+  }
+
+  /* The other names, as extraction would make them */
+  entry.names = NULL;
+  entry.numNames = 0;
+
+  if(numLinks > 0)
+  {
+    entry.names = (fchar_t**)mallocf(numLinks * sizeof(fchar_t*));
+    for(i = 0; i < numLinks; i++)
+    {
+      entry.names[entry.numNames] = (fchar_t*)mallocf((MAX_PATH + 1) * sizeof(fchar_t));
+      if(makePath(pi, links[i].parent, links[i].filename, '/', entry.names[entry.numNames]))
+        entry.numNames++;
+      else
+        free(entry.names[entry.numNames]);
+    }
+  }
+
+  entry.sector = sector;
+  entry.ref = index;
+  entry.parent = pi->mftmap ? basics->parent : kInvalidSector;
+  entry.path = path;
+  entry.dir = dir;
+  entry.created = basics->created;
+  entry.modified = basics->modified;
+  entry.accessed = basics->accessed;
+  entry.flags = basics->flags;
+
+  /* Newer records know where they are in the MFT */
+  if(entry.ref == kInvalidSector && header->offUpdSeq >= 0x30)
+    entry.ref = header->recordNum;
+
+  catalog_write(pi->catalog, record, &entry);
+
+  for(i = 0; i < entry.numNames; i++)
+    free(entry.names[i]);
+  if(entry.names)
+    free(entry.names);
+}
+
+/* Pass on what we know about reading the disk */
+void adviseClusters(partitioninfo* pi, uint64 cluster, uint64 length, int advice)
+{
+  /* Asking for too much just pushes out what we asked for earlier */
+  if(advice == kDevice_WillNeed)
+  {
+    if(pi->io.ahead == 0)
+      return;
+    length = min(length, (uint64)pi->io.readSize * pi->io.ahead);
+  }
+
+  device_advise(pi->device, pi->direct, SECTOR_TO_BYTES(CLUSTER_TO_SECTOR(*pi, cluster)), 
+                length, advice);
+}
+
+/* 
+ * Read clusters from the disk, as many at once as the geometry allows. 
+ * When that fails they're read one at a time. Returns how many were 
+ * read before the first bad one.
+ */
+uint32 readClusters(partitioninfo* pi, uint64 cluster, uint32 count, byte* data)
+{
+  uint32 size = CLUSTER_SIZE(*pi);
+  uint32 i;
+
+  if(device_read(pi->device, pi->direct, SECTOR_TO_BYTES(CLUSTER_TO_SECTOR(*pi, cluster)),
+                 data, count * size) == (int)(count * size))
+    return count;
+
+  /* Something in there is bad, find out where */
+  stats_count(kStats_Retries, 1);
+
+  for(i = 0; i < count; i++)
+  {
+    if(device_read(pi->device, pi->direct, SECTOR_TO_BYTES(CLUSTER_TO_SECTOR(*pi, cluster + i)),
+                   data + (i * size), size) != (int)size)
+      break;
+  }
+
+  return i;
+}
+
+/* How many clusters go in one read */
+uint32 clustersPerRead(partitioninfo* pi)
+{
+  return max(pi->io.readSize / CLUSTER_SIZE(*pi), 1);
+}
+
+/* Output goes through the writer threads when there are some */
+void writeOutput(partitioninfo* pi, int fd, fchar_t* filename, void* data, uint32 len)
+{
+  uint64 entered;
+
+  if(pi->writer)
+  {
+    writer_write(pi->writer, fd, -1, data, len);
+    return;
+  }
+
+  entered = stats_enter(kStats_Write);
+  if(write(fd, data, len) != (int32)len)
+    err(1, "couldn't write to output file: " FC_PRINTF, filename);
+  stats_count(kStats_BytesWritten, len);
+  stats_leave(kStats_Write, entered);
+}
+
+/* Files can't be closed until the writer is done with them */
+void closeOutput(partitioninfo* pi, int fd)
+{
+  if(pi->writer)
+    writer_close(pi->writer, fd);
+  else
+    close(fd);
+}
+
+/* File names are printed unless something else is on stdout */
+bool printing(partitioninfo* pi)
+{
+  return !pi->catalog && !(pi->archive && pi->archive->f == stdout);
+}
+
+/* Where part of a file's data is on the disk */
+typedef struct _datapiece
+{
+  uint64 offset;          /* In the file (in bytes) */
+  uint64 cluster;
+  uint64 length;          /* In bytes */
+}
+datapiece;
+
+
+bool archiveRecord(partitioninfo* pi, ntfsx_record* record, filebasics* basics)
+{
+  bool ret = false;
+  ntfsx_attrib_enum* attrenum = NULL;
+  ntfsx_attribute* attribdata = NULL;
+  ntfsx_datarun* datarun = NULL;
+  datapiece* pieces = NULL;
+  uint64* map = NULL;
+  byte* buffer = NULL;
+
+  {
+    ntfs_attribheader* attrhead;
+    ntfs_attribnonresident* nonres;
+    fchar_t path[MAX_PATH + 1];
+    archive_entry entry;
+    byte* resident = NULL;
+    uint32 numPieces = 0;
+    uint32 numMap = 0;
+    uint64 dataSize = 0;      /* Length of initialized file data */
+    uint64 offset = 0;        /* How much of that we've found */
+    uint64 present = 0;       /* How much of that is on the disk */
+    uint64 length;
+    uint64 i;
+    uint32 j;
+    uint32 num;
+    uint32 size = CLUSTER_SIZE(*pi);
+    uint32 perRead;
+    uint32 count;
+    uint32 got;
+    bool haddata = false;
+
+    /* Archives can't hold two files with the same path */
+    if(!dircache_reserve(pi->dirs, basics->parent, basics->filename, MAX_PATH) ||
+       !makeFilePath(pi, basics, '/', path))
+      RETWARNX("path too long");
+
+    memset(&entry, 0, sizeof(entry));
+    entry.path = path;
+    entry.mode = DEF_FILE_MODE;
+    entry.created = basics->created;
+    entry.modified = basics->modified;
+    entry.accessed = basics->accessed;
+
+    if(basics->flags & kNTFS_FileReadOnly)
+      entry.mode &= ~0222;
+
+    /* 
+     * The header has to have the size and holes of the file, so 
+     * first find out where all the data is. 
+     */
+    attrenum = ntfsx_attrib_enum_alloc(kNTFS_DATA, true);
+
+    while((attribdata = ntfsx_attrib_enum_all(attrenum, record)) != NULL)
+    {
+      attrhead = ntfsx_attribute_header(attribdata);
+
+      if(attrhead->flags & kNTFS_AttrCompressed)
+        RETWARNX("compressed file. skipping.");
+
+      if(attrhead->flags & kNTFS_AttrEncrypted)
+        RETWARNX("encrypted file. skipping.");
+
+      if(!haddata)
+      {
+        haddata = true;
+
+        /* Resident data is all there is, and there's no holes */
+        if(!attrhead->bNonResident)
+        {
+          resident = ntfsx_attribute_getresidentdata(attribdata);
+          entry.size = ntfsx_attribute_getresidentsize(attribdata);
+
+          if(!resident)
+            RETWARNX("invalid mft record. resident data screwed up");
+
+          break;
+        }
+
+        nonres = (ntfs_attribnonresident*)attrhead;
+
+        if(nonres->cbInitData > nonres->cbAttribData)
+          RETWARNX("invalid file length.");
+
+        dataSize = nonres->cbInitData;
+        entry.size = nonres->cbAttribData;
+      }
+
+      if(attrhead->bNonResident)
+      {
+        datarun = ntfsx_attribute_getdatarun(attribdata);
+
+        if(datarun && ntfsx_datarun_first(datarun))
+        {
+          do
+          {
+            /* Extra runs are sometimes left mapped past the end */
+            if(offset >= dataSize)
+              break;
+
+            length = datarun->length * CLUSTER_SIZE(*pi);
+            if(length > dataSize - offset)
+              length = dataSize - offset;
+
+            if(!datarun->sparse)
+            {
+              if(!(numPieces % 16))
+                pieces = (datapiece*)reallocf(pieces, (numPieces + 16) * sizeof(datapiece));
+
+              pieces[numPieces].offset = offset;
+              pieces[numPieces].cluster = datarun->cluster;
+              pieces[numPieces].length = length;
+              numPieces++;
+
+              present += length;
+            }
+
+            offset += length;
+          }
+          while(ntfsx_datarun_next(datarun));
+        }
+
+        if(datarun)
+          ntfsx_datarun_free(datarun);
+        datarun = NULL;
+      }
+
+      ntfsx_attribute_free(attribdata);
+      attribdata = NULL;
+
+      if(offset >= dataSize)
+        break;
+    }
+
+    if(!haddata)
+      RETWARNX("invalid mft record. no data attribute found");
+
+    if(offset < dataSize)
+      warnx("invalid mft record. couldn't find all data for file");
+
+    /* Anything not on the disk is a hole, pieces next to each other join up */
+    if(!resident && present < entry.size)
+    {
+      map = (uint64*)mallocf(((numPieces + 1) * 2) * sizeof(uint64));
+
+      for(j = 0; j < numPieces; j++)
+      {
+        if(numMap > 0 && 
+           map[((numMap - 1) * 2)] + map[((numMap - 1) * 2) + 1] == pieces[j].offset)
+        {
+          map[((numMap - 1) * 2) + 1] += pieces[j].length;
+        }
+        else
+        {
+          map[numMap * 2] = pieces[j].offset;
+          map[(numMap * 2) + 1] = pieces[j].length;
+          numMap++;
+        }
+      }
+
+      /* A hole at the end is marked by an empty piece */
+      if(numMap == 0 || map[((numMap - 1) * 2)] + map[((numMap - 1) * 2) + 1] < entry.size)
+      {
+        map[numMap * 2] = entry.size;
+        map[(numMap * 2) + 1] = 0;
+        numMap++;
+      }
+
+      entry.map = map;
+      entry.mapCount = numMap;
+    }
+
+    /* Parent directories go in the archive too */
+    dircache_make(pi->dirs, basics->parent);
+    archive_begin(pi->archive, &entry);
+
+    if(resident)
+    {
+      archive_write(pi->archive, resident, (size_t)entry.size);
+    }
+
+    else
+    {
+      perRead = clustersPerRead(pi);
+      buffer = (byte*)device_alloc(perRead * size);
+
+      if(numPieces > 0)
+        adviseClusters(pi, pieces[0].cluster, pieces[0].length, kDevice_WillNeed);
+
+      for(j = 0; j < numPieces; j++)
+      {
+        length = pieces[j].length;
+
+        /* The disk can get on with the next piece while this one is copied */
+        if(j + 1 < numPieces)
+          adviseClusters(pi, pieces[j + 1].cluster, pieces[j + 1].length, kDevice_WillNeed);
+
+        if(pi->locks)
+        {
+          /* Add a location lock so any raw scrounging won't do 
+             this cluster later */
+          addLocationLock(pi->locks, CLUSTER_TO_SECTOR(*pi, pieces[j].cluster), 
+                CLUSTER_TO_SECTOR(*pi, pieces[j].cluster + 
+                    ((length + size - 1) / size)));
+        }
+
+        for(i = 0; length > 0; i += count)
+        {
+          count = (uint32)min((length + size - 1) / size, perRead);
+          got = readClusters(pi, pieces[j].cluster + i, count, buffer);
+
+          num = (uint32)min((uint64)got * size, length);
+          archive_write(pi->archive, buffer, num);
+          length -= num;
+
+          /* The size is in the header already, so fill in what can't be read */
+          if(got < count)
+          {
+            warn("couldn't read sector from disk");
+            num = (uint32)min(size, length);
+            archive_zeros(pi->archive, num);
+            length -= num;
+            count = got + 1;
+          }
+        }
+
+        adviseClusters(pi, pieces[j].cluster, pieces[j].length, kDevice_DontNeed);
+      }
+    }
+
+    archive_end(pi->archive);
+    ret = true;
+  }
+
+cleanup:
+  if(buffer)
+    device_free(buffer);
+
+  if(attribdata)
+    ntfsx_attribute_free(attribdata);
+
+  if(datarun)
+    ntfsx_datarun_free(datarun);
+
+  if(attrenum)
+    ntfsx_attrib_enum_free(attrenum);
+
+  if(pieces)
+    free(pieces);
+
+  if(map)
+    free(map);
+
+  return ret;
+}
+
+/* The other names of a file in the archive refer back to it */
+void archiveLinks(partitioninfo* pi, filebasics* basics, filelink* links, uint32 count)
+{
+  fchar_t target[MAX_PATH + 1];
+  fchar_t path[MAX_PATH + 1];
+  archive_entry entry;
+  uint32 i;
+
+  if(!makeFilePath(pi, basics, '/', target))
+    return;
+
+  memset(&entry, 0, sizeof(entry));
+  entry.path = path;
+  entry.mode = DEF_FILE_MODE;
+  entry.created = basics->created;
+  entry.modified = basics->modified;
+  entry.accessed = basics->accessed;
+
+  for(i = 0; i < count; i++)
+  {
+    if(!dircache_reserve(pi->dirs, links[i].parent, links[i].filename, MAX_PATH) ||
+       !makePath(pi, links[i].parent, links[i].filename, '/', path))
+      continue;
+
+    archive_link(pi->archive, &entry, target);
+  }
+}
+
+/* When a link can't be made, copy the file we've written instead */
+void copyFile(partitioninfo* pi, filebasics* basics, filelink* link)
+{
+  byte buf[0x4000];
+  int ifile;
+  int ofile;
+  int num;
+
+  ifile = dircache_open(pi->dirs, basics->parent, basics->filename, O_BINARY | O_RDONLY, 0);
+  if(ifile == -1)
+  {
+    warn("couldn't open file to copy: " FC_PRINTF, basics->filename);
+    return;
+  }
+
+  ofile = dircache_create(pi->dirs, link->parent, link->filename, MAX_PATH, 
+                          O_BINARY | O_WRONLY, DEF_FILE_MODE);
+  if(ofile == -1)
+  {
+    warn("couldn't open output file: " FC_PRINTF, link->filename);
+    close(ifile);
+    return;
+  }
+
+  while((num = read(ifile, buf, sizeof(buf))) > 0)
+  {
+    if(write(ofile, buf, num) != num)
+      err(1, "couldn't write to output file: " FC_PRINTF, link->filename);
+  }
+
+  if(num == -1)
+    warn("couldn't read file to copy: " FC_PRINTF, basics->filename);
+
+  setFileTime(ofile, link->filename, &(basics->created), 
+              &(basics->accessed), &(basics->modified));
+  setFileAttributes(ofile, link->filename, basics->flags);
+
+  close(ifile);
+  close(ofile);
+}
+
+/* Hard link the other names of a file to the one we've written */
+void linkFiles(partitioninfo* pi, filebasics* basics, filelink* links, uint32 count)
+{
+  uint32 i;
+
+  for(i = 0; i < count; i++)
+  {
+    if(dircache_link(pi->dirs, basics->parent, basics->filename, 
+                     links[i].parent, links[i].filename, MAX_PATH) == -1)
+    {
+      /* A path too long to link to is also too long to copy to */
+      if(errno == ENAMETOOLONG)
+      {
+        warn("couldn't link file: " FC_PRINTF, links[i].filename);
+      }
+      else
+      {
+        /* The copy needs all of the file written */
+        if(pi->writer)
+          writer_flush(pi->writer);
+        copyFile(pi, basics, links + i);
+      }
+    }
+  }
+}
+
+/* Read the data of the files noted, then finish them off */
+void sweepFiles(partitioninfo* pi)
+{
+  sweep_file* file;
+  filebasics basics;
+  uint32 i;
+  int fd;
 
-		while((attr = ntfsx_attrib_enum_all(attrenum, record)) != NULL)
-		{
-			/* TODO ASSUMPTION: File name is always resident */
-			if(!ntfsx_attribute_header(attr)->bNonResident)
-      {
-  			/* Get out all the info we need */
-		  	filename = (ntfs_attribfilename*)ntfsx_attribute_getresidentdata(attr);
-        ASSERT(filename);
-		
-  			/*
-         * There can be multiple filenames with different 
-         * namespaces so choose the best one
-         */
-			  if(ntfs_isbetternamespace(nameSpace, filename->nameSpace))
-			  {
-				  /* Dates */
-          basics->created = filename->timeCreated;
-          basics->modified = filename->timeModified;
-          basics->accessed = filename->timeRead;
+  sweep_run(pi->sweep, pi);
 
-				  /* File Name */
-          name = (ntfs_char*)(((byte*)filename) + sizeof(ntfs_attribfilename));
-          len = filename->cFileName;
-          if(len > MAX_PATH)
-            len = MAX_PATH;
+  /* Everything has to be written before the files are finished off */
+  if(pi->writer)
+    writer_flush(pi->writer);
 
-#ifdef FC_WIDE
-          wcsncpy(basics->filename, name, len);
-#else
-          temp = unicode_transcode16to8(name, len);
+  for(i = 0; i < pi->sweep->numFiles; i++)
+  {
+    file = pi->sweep->files + i;
+    if(!file->meta || file->failed)
+      continue;
 
-          len = strlen(temp);
-          if(len > MAX_PATH)
-            len = MAX_PATH;
-        
-          strncpy(basics->filename, temp, len);
-#endif
+    memset(&basics, 0, sizeof(basics));
+    fcsncpy(basics.filename, file->filename, MAX_PATH);
+    basics.parent = file->parent;
+    basics.created = file->created;
+    basics.modified = file->modified;
+    basics.accessed = file->accessed;
+    basics.flags = file->flags;
 
-          basics->filename[len] = 0;
+    fd = dircache_open(pi->dirs, basics.parent, basics.filename, O_BINARY | O_WRONLY, 0);
+    if(fd == -1)
+    {
+      warn("couldn't open output file: " FC_PRINTF, basics.filename);
+      continue;
+    }
 
+    setFileTime(fd, basics.filename, &(basics.created), 
+                &(basics.accessed), &(basics.modified));
+    setFileAttributes(fd, basics.filename, basics.flags);
+    close(fd);
 
-				  /* Attributes */
-          basics->flags = filename->flags;
+    linkFiles(pi, &basics, file->links, file->numLinks);
+  }
 
+  sweep_clear(pi->sweep);
+}
 
-				  /* Parent Directory */
-          basics->parent = filename->refParent & kNTFS_RefMask;
+void processMFTRecord(partitioninfo* pi, uint64 sector, uint64 index, uint32 level);
 
+void processParentDirectory(partitioninfo* pi, uint64 ref, uint32 level)
+{
+  uint64 sector;
 
-				  /* Namespace */
-				  nameSpace = filename->nameSpace;
-			  }
-      }
+  if(dircache_known(pi->dirs, ref))
+    return;
 
-      ntfsx_attribute_free(attr);
-      attr = NULL;
-		}
+  if(level > MAX_DIR_DEPTH)
+  {
+    warnx("directories nested too deep, probably a loop");
   }
+  else
+  {
+    sector = ntfsx_mftmap_sectorforindex(pi->mftmap, ref);
 
-  if(attr)
-    ntfsx_attribute_free(attr);
+    if(sector == kInvalidSector)
+      warnx("invalid parent directory index in mft: %d", (int)ref);
+    else
+      processMFTRecord(pi, sector, ref, level);
+  }
 
-  if(attrenum)
-    ntfsx_attrib_enum_free(attrenum);
+  /* When the directory couldn't be made, files go in the top directory */
+  if(!dircache_known(pi->dirs, ref))
+    dircache_add(pi->dirs, ref, pi->dirs->rootRef, NULL);
 }
 
-void processMFTRecord(partitioninfo* pi, uint64 sector, uint32 flags)
+void processMFTRecord(partitioninfo* pi, uint64 sector, uint64 index, uint32 level)
 {
   ntfsx_record* record = NULL;
   ntfsx_attribute* attribdata = NULL;
   ntfsx_attrib_enum* attrenum = NULL;
   ntfsx_datarun* datarun = NULL;
+  filelink* links = NULL;
+  byte* buffer = NULL;
   int ofile = -1;
+  bool rescued = false;
+  const char* why = NULL;     /* Why it wasn't rescued */
+  uint32 runs = 0;
+  uint64 bytes = 0;
+  uint64 entered = stats_enter(kStats_Parse);
 
   ntfsx_cluster cluster;
   memset(&cluster, 0, sizeof(cluster));
 
+  if(level == 0)
+    stats_count(kStats_Records, 1);
+
   {
     filebasics basics;
+    uint32 numLinks = 0;
     ntfs_recordheader* header;
-    uint64 parentSector;
-    uint64 dataSector;
-    uint16 rename = 0;
     uint64 dataSize = 0;       /* Length of initialized file data */
     uint64 sparseSize = 0;     /* Length of sparse data following */
+    uint64 initSize = 0;       /* All of the initialized data */
+    uint64 runSize;
+    uint32 sweepFile = 0;
+    uint32 perRead = 0;
+    uint32 count;
+    uint32 got;
     uint32 i;
     bool haddata = false;
     uint32 num;
-    fchar_t filename2[MAX_PATH + 1];
+    fchar_t path[MAX_PATH + 1];
     ntfs_attribheader* attrhead;
     ntfs_attribnonresident* nonres;
 
@@ -165,78 +1082,147 @@ void processMFTRecord(partitioninfo* pi, uint64 sector, uint32 flags)
 
     /* Read the MFT record */
 	  if(!ntfsx_record_read(record, sector, pi->device))
+    {
+      why = "couldn't read record";
       RETURN;
+    }
 
     header = ntfsx_record_header(record);
     ASSERT(header);
 
+    why = "not in use";
     if(!(header->flags & kNTFS_RecFlagUse))
       RETURN;
 
+    /* Parents have to be directories */
+    if(level > 0 && !(header->flags & kNTFS_RecFlagDir))
+      RETURN;
+
     /* Try and get a file name out of the header */
     processRecordFileBasics(pi, record, &basics);
 
     /* Without files we skip */
+    why = "no file name";
     if(basics.filename[0] == 0)
       RETURN;
 
     /* If it's the root folder then return */
+    why = "root directory";
     if(!fcscmp(basics.filename, FC_DOT))
       RETURN;
 
-#if 0
-    printf("SECTOR: %llu", (unsigned long long)sector);
-#endif
-    printf(flags & PROCESS_MFT_FLAG_SUB ?
-            "\\" FC_PRINTF : "\\" FC_PRINTF "\n", basics.filename);
+    why = "system file";
 
     /* System, Hidden files that begin with $ are skipped */
     if(basics.flags & kNTFS_FileSystem && 
        basics.flags & kNTFS_FileHidden &&
        basics.filename[0] == kNTFS_SysPrefix)
+    {
+      if(level == 0 && !pi->filter && printing(pi))
+        printf("\\" FC_PRINTF "\n", basics.filename);
       RETURN;
+    }
+
+    /* 
+     * Process parent folders if available. Only if we have MFT 
+     * map info, otherwise everything goes in the top directory.
+     */
+    if(basics.parent == kInvalidSector || !pi->mftmap)
+      basics.parent = pi->dirs->rootRef;
+    else
+      processParentDirectory(pi, basics.parent, level + 1);
 
-    /* Process parent folders if available */
-    if(basics.parent != kInvalidSector)
+    /* Directory handling: */
+    if(header->flags & kNTFS_RecFlagDir)
     {
-      /* Only if we have MFT map info available */
-      if(pi->mftmap)
+      /* Without the MFT nothing can go in directories */
+      why = "directory without mft";
+      if(index == kInvalidSector)
+        RETURN;
+
+      rescued = true;
+
+      if(level == 0 && !pi->filter && printing(pi) && 
+         makeFilePath(pi, &basics, '\\', path))
+        printf("\\" FC_PRINTF "\n", path);
+
+      if(!dircache_known(pi->dirs, index))
       {
-        parentSector = ntfsx_mftmap_sectorforindex(pi->mftmap, basics.parent);
+        dircache_add(pi->dirs, index, basics.parent, basics.filename);
 
-        if(parentSector == kInvalidSector)
-          warnx("invalid parent directory for file: " FC_PRINTF, basics.filename);
-        else
-          processMFTRecord(pi, parentSector, flags | PROCESS_MFT_FLAG_SUB);
+        /* 
+         * Directory times change as files get created in them, so 
+         * these are applied once everything has been written 
+         */
+        if(pi->deferred && !pi->catalog)
+          deferDirectory(pi->deferred, index, &basics);
       }
-    }
 
-    /* Directory handling: */
-    if(header->flags & kNTFS_RecFlagDir)
-    {
-      /* Try to change to the directory */
-      if(fc_chdir(basics.filename) == -1)
+      /* 
+       * Directories are made when something gets put in them. Unless 
+       * filtering, make them all so empty ones are rescued too.
+       */
+      if(pi->catalog)
       {
+        if(level == 0 && !pi->filter)
+          catalogRecord(pi, record, sector, index, &basics, NULL, 0, true);
+      }
+
 #ifdef _DEBUG
-        if(!g_verifyMode)
-#endif
-        {
-#ifdef _WIN32
-          if(fc_mkdir(basics.filename) == -1)
+      else if(!g_verifyMode)
 #else
-		  if(fc_mkdir(basics.filename, DEF_DIR_MODE) == -1)
+      else
 #endif
-          {
-            warn("couldn't create directory '" FC_PRINTF "' putting files in parent directory", basics.filename);
-          }
-          else
-          {
-            setFileAttributes(basics.filename, basics.flags);
-            fc_chdir(basics.filename);
-          }
-        }
-      }
+        if(level == 0 && !pi->filter)
+          dircache_make(pi->dirs, index);
+
+      RETURN;
+    }
+
+    /* The other names of a hard linked file, with their directories */
+    if(header->cHardlinks > 1)
+    {
+      numLinks = processRecordLinks(pi, record, &basics, &links);
+
+      for(i = 0; pi->mftmap && i < numLinks; i++)
+        processParentDirectory(pi, links[i].parent, level + 1);
+    }
+
+    /* 
+     * Check the filters before any of the file's data is read, 
+     * all this needs is the MFT record.
+     */
+    why = "filtered";
+    if(pi->filter && !filterRecord(pi, record, &basics, links, &numLinks))
+      RETURN;
+
+    /* Only listing what's there, nothing gets read or written */
+    if(pi->catalog)
+    {
+      catalogRecord(pi, record, sector, index, &basics, links, numLinks, false);
+      rescued = true;
+      RETURN;
+    }
+
+    /* Parent directories are made quietly, only print what we're doing */
+    if(level == 0 && printing(pi) && makeFilePath(pi, &basics, '\\', path))
+      printf("\\" FC_PRINTF "\n", path);
 
+    for(i = 0; i < numLinks; i++)
+    {
+      if(printing(pi) && makePath(pi, links[i].parent, links[i].filename, '\\', path))
+        printf("\\" FC_PRINTF "\n", path);
+    }
+
+    /* Everything goes into the one archive */
+    if(pi->archive)
+    {
+      why = "couldn't archive";
+      if(archiveRecord(pi, record, &basics))
+      {
+        archiveLinks(pi, &basics, links, numLinks);
+        rescued = true;
+      }
       RETURN;
     }
 
@@ -244,11 +1230,12 @@ void processMFTRecord(partitioninfo* pi, uint64 sector, uint32 flags)
     /* If in verify mode */
     if(g_verifyMode)
     {
-      ofile = fc_open(basics.filename, O_BINARY | O_RDONLY);
+      ofile = dircache_open(pi->dirs, basics.parent, basics.filename, O_BINARY | O_RDONLY, 0);
 
       if(ofile == -1)
       {
         warn("couldn't open verify file: " FC_PRINTF, basics.filename);
+        why = "couldn't open verify file";
         goto cleanup;
       }
     }
@@ -257,33 +1244,19 @@ void processMFTRecord(partitioninfo* pi, uint64 sector, uint32 flags)
     else
 #endif
     {
-      ofile = fc_open(basics.filename, O_BINARY | O_CREAT | O_EXCL | O_WRONLY, DEF_FILE_MODE);
-  
-      fcsncpy(filename2, basics.filename, MAX_PATH);
-      filename2[MAX_PATH] = 0;
-
-      while(ofile == -1 && errno == EEXIST && rename < 0x1000)
-      {
-        if(fcslen(basics.filename) + 7 >= MAX_PATH)
-        {
-          warnx("file name too long on duplicate file: " FC_PRINTF, basics.filename);
-          goto cleanup;
-        }
-
-        fcscpy(basics.filename, filename2);
-        fcscat(basics.filename, FC_DOT);
-
-        itofc(rename, basics.filename + fcslen(basics.filename), 10);
-        rename++;
-
-        ofile = fc_open(basics.filename, O_BINARY | O_CREAT | O_EXCL | O_WRONLY, DEF_FILE_MODE);
-      }
+      /* Duplicate names get a suffix picked for them */
+      ofile = dircache_create(pi->dirs, basics.parent, basics.filename, MAX_PATH,
+                              O_BINARY | O_WRONLY, DEF_FILE_MODE);
 
       if(ofile == -1)
       {
         warn("couldn't open output file: " FC_PRINTF, basics.filename);
+        why = "couldn't open output file";
         goto cleanup;
       }
+
+      if(pi->sweep)
+        sweepFile = sweep_addfile(pi->sweep, basics.parent, basics.filename);
     }
 
     attrenum = ntfsx_attrib_enum_alloc(kNTFS_DATA, true);
@@ -296,12 +1269,16 @@ void processMFTRecord(partitioninfo* pi, uint64 sector, uint32 flags)
        * We don't do compressed/encrypted files. Eventually
        * we may be able to write in some support :)
        */
+      why = "compressed";
       if(attrhead->flags & kNTFS_AttrCompressed)
         RETWARNX("compressed file. skipping.");
 
+      why = "encrypted";
       if(attrhead->flags & kNTFS_AttrEncrypted)
         RETWARNX("encrypted file. skipping.");
 
+      why = "invalid data";
+
       /* On the first round figure out the file size */
       if(!haddata)
       {
@@ -320,6 +1297,9 @@ void processMFTRecord(partitioninfo* pi, uint64 sector, uint32 flags)
           dataSize = ntfsx_attribute_getresidentsize(attribdata);
           sparseSize = 0;
         }
+
+        initSize = dataSize;
+        bytes = dataSize + sparseSize;
       }
 
       haddata = true;
@@ -341,8 +1321,22 @@ void processMFTRecord(partitioninfo* pi, uint64 sector, uint32 flags)
         }
         else
 #endif
-          if(write(ofile, data, length) != (int32)length)
-            RETWARN("couldn't write data to output file");
+          if(pi->writer)
+          {
+            writer_write(pi->writer, ofile, -1, data, length);
+          }
+          else
+          {
+            uint64 written = stats_enter(kStats_Write);
+            if(write(ofile, data, length) != (int32)length)
+            {
+              stats_leave(kStats_Write, written);
+              why = "couldn't write";
+              RETWARN("couldn't write data to output file");
+            }
+            stats_count(kStats_BytesWritten, length);
+            stats_leave(kStats_Write, written);
+          }
 
         dataSize -= length;
       }
@@ -368,6 +1362,21 @@ void processMFTRecord(partitioninfo* pi, uint64 sector, uint32 flags)
             if(dataSize == 0)
               break;
 
+            runs++;
+
+            /* Noted now, read later along with all the other files */
+            if(pi->sweep)
+            {
+              runSize = min(datarun->length * pi->cluster * kSectorSize, dataSize);
+
+              if(!datarun->sparse)
+                sweep_addextent(pi->sweep, sweepFile, datarun->cluster, 
+                                initSize - dataSize, runSize);
+
+              dataSize -= runSize;
+              continue;
+            }
+
             /* Sparse clusters we just write zeros */
             if(datarun->sparse)
             {
@@ -388,8 +1397,7 @@ void processMFTRecord(partitioninfo* pi, uint64 sector, uint32 flags)
                 }
                 else
 #endif
-                  if(write(ofile, cluster.data, num) != (int32)num)
-                    err(1, "couldn't write to output file: " FC_PRINTF, basics.filename);
+                  writeOutput(pi, ofile, basics.filename, cluster.data, num);
 
                 dataSize -= num;
               }
@@ -406,30 +1414,47 @@ void processMFTRecord(partitioninfo* pi, uint64 sector, uint32 flags)
                       CLUSTER_TO_SECTOR(*pi, datarun->cluster + datarun->length));
               }
 
-              for(i = 0; i < datarun->length && dataSize; i++)
+              /* The disk can read ahead through the run while we copy it */
+              runSize = min(datarun->length * cluster.size, dataSize);
+              adviseClusters(pi, datarun->cluster, runSize, kDevice_WillNeed);
+
+              if(!buffer)
               {
-                num = min(cluster.size, (uint32)dataSize);
-                dataSector = CLUSTER_TO_SECTOR(*pi, (datarun->cluster + i));
+                perRead = clustersPerRead(pi);
+                buffer = (byte*)device_alloc(perRead * cluster.size);
+              }
+
+              for(i = 0; i < datarun->length && dataSize; i += count)
+              {
+                /* No need to read clusters past the end of the data */
+                count = (uint32)min(datarun->length - i, perRead);
+                count = (uint32)min(count, (dataSize + cluster.size - 1) / cluster.size);
+                got = readClusters(pi, datarun->cluster + i, count, buffer);
+                num = (uint32)min((uint64)got * cluster.size, dataSize);
 
-                if(!ntfsx_cluster_read(&cluster, pi, dataSector, pi->device))
+                if(num > 0)
                 {
-                  warn("couldn't read sector from disk");
-                  break;
+#ifdef _DEBUG
+                  if(g_verifyMode)
+                  {
+                    if(compareFileData(ofile, buffer, num) != 0)
+                      RETWARNX("verify failed. read file data wrong.");
+                  }
+                  else
+#endif
+                    writeOutput(pi, ofile, basics.filename, buffer, num);
+
+                  dataSize -= num;
                 }
 
-#ifdef _DEBUG
-                if(g_verifyMode)
+                if(got < count)
                 {
-                  if(compareFileData(ofile, cluster.data, num) != 0)
-                    RETWARNX("verify failed. read file data wrong.");
+                  warn("couldn't read sector from disk");
+                  break;
                 }
-                else
-#endif
-                  if(write(ofile, cluster.data, num) != (int32)num)
-                    err(1, "couldn't write to output file: " FC_PRINTF, basics.filename);
-
-                dataSize -= num;
               }
+
+              adviseClusters(pi, datarun->cluster, runSize, kDevice_DontNeed);
             }
           }
           while(ntfsx_datarun_next(datarun));
@@ -447,6 +1472,7 @@ void processMFTRecord(partitioninfo* pi, uint64 sector, uint32 flags)
         break;
     }
 
+    why = "no data";
     if(!haddata)
       RETWARNX("invalid mft record. no data attribute found");
 
@@ -459,7 +1485,14 @@ void processMFTRecord(partitioninfo* pi, uint64 sector, uint32 flags)
      * size, but let's go the safe way and write out zeros
      */
 
-    if(sparseSize > 0)
+    /* When the data comes later, the file has to be its full size already */
+    if(pi->sweep)
+    {
+      if(ftruncate(ofile, initSize + sparseSize) == -1)
+        err(1, "couldn't write to output file: " FC_PRINTF, basics.filename);
+    }
+
+    else if(sparseSize > 0)
     {
       ntfsx_cluster_reserve(&cluster, pi);
       memset(cluster.data, 0, cluster.size);
@@ -479,33 +1512,68 @@ void processMFTRecord(partitioninfo* pi, uint64 sector, uint32 flags)
         }
         else
 #endif
-          if(write(ofile, cluster.data, num) != (int32)num)
-            err(1, "couldn't write to output file: " FC_PRINTF, basics.filename);
+          writeOutput(pi, ofile, basics.filename, cluster.data, num);
 
         sparseSize -= num;
       }
     }
 
-    close(ofile);
-    ofile = -1;
+    /* Times and attributes have to wait until the data is written */
+    if(pi->sweep)
+    {
+      sweep_file* file = pi->sweep->files + sweepFile;
+      file->meta = true;
+      file->created = basics.created;
+      file->modified = basics.modified;
+      file->accessed = basics.accessed;
+      file->flags = basics.flags;
+      file->links = links;
+      file->numLinks = numLinks;
+      links = NULL;
+      numLinks = 0;
+    }
+
+    /* The writer sets these and closes the file once it's written */
+    else if(pi->writer)
+    {
+      writer_finish(pi->writer, ofile, basics.filename, &(basics.created), 
+                    &(basics.accessed), &(basics.modified), basics.flags);
+      ofile = -1;
+    }
 
 #ifdef _DEBUG
-    if(!g_verifyMode)
+    else if(!g_verifyMode)
+#else
+    else
 #endif
     {
-      setFileTime(basics.filename, &(basics.created), 
+      /* Through the open file so the name isn't looked up again */
+      setFileTime(ofile, basics.filename, &(basics.created), 
                 &(basics.accessed), &(basics.modified));
 
-      setFileAttributes(basics.filename, basics.flags);
+      setFileAttributes(ofile, basics.filename, basics.flags);
     }
+
+    if(ofile != -1)
+      closeOutput(pi, ofile);
+    ofile = -1;
+
+    /* The data is written once, the other names are links to it */
+#ifdef _DEBUG
+    if(!g_verifyMode)
+#endif
+      linkFiles(pi, &basics, links, numLinks);
+
+    rescued = true;
+    stats_count(kStats_Files, 1);
   }
 
 cleanup:
-  if(record)
-    ntfsx_record_free(record);
-
   ntfsx_cluster_release(&cluster);
 
+  if(buffer)
+    device_free(buffer);
+
   if(attribdata)
     ntfsx_attribute_free(attribdata);
 
@@ -516,7 +1584,29 @@ cleanup:
     ntfsx_attrib_enum_free(attrenum);
 
   if(ofile != -1)
-    close(ofile);
+    closeOutput(pi, ofile);
+
+  if(links)
+    free(links);
+
+  /* Nothing to work out when stats aren't being kept */
+  if(level == 0 && entered)
+  {
+    if(rescued)
+    {
+      stats_record(recordKind(record), index, sector, entered, NULL, runs, bytes);
+    }
+    else
+    {
+      stats_count(kStats_Skipped, 1);
+      stats_record(kStats_RecSkipped, index, sector, entered, why, runs, bytes);
+    }
+  }
+
+  stats_leave(kStats_Parse, entered);
+
+  if(record)
+    ntfsx_record_free(record);
 }
 
 
@@ -566,19 +1656,60 @@ void scroungeMFT(partitioninfo* pi, ntfsx_mftmap* map)
 }
 
 
+/* Tell the disk about the MFT records we're going to read */
+void adviseRecords(partitioninfo* pi, ntfsx_mftmap* map, uint64 index, uint64 count)
+{
+  uint64 sectors = RECORD_SIZE(*pi) / kSectorSize;
+  uint64 first = kInvalidSector;
+  uint64 next = kInvalidSector;
+  uint64 end = min(index + count, ntfsx_mftmap_length(map));
+  uint64 sector;
+
+  for(; index < end; index++)
+  {
+    sector = ntfsx_mftmap_sectorforindex(map, index);
+    if(sector == kInvalidSector)
+      continue;
+
+    /* Records that follow on are asked for together */
+    if(sector != next)
+    {
+      if(first != kInvalidSector)
+        device_advise(pi->device, pi->direct, SECTOR_TO_BYTES(first), 
+                      SECTOR_TO_BYTES(next - first), kDevice_WillNeed);
+      first = sector;
+    }
+
+    next = sector + sectors;
+  }
+
+  if(first != kInvalidSector)
+    device_advise(pi->device, pi->direct, SECTOR_TO_BYTES(first), 
+                  SECTOR_TO_BYTES(next - first), kDevice_WillNeed);
+}
+
 void scroungeUsingMFT(partitioninfo* pi)
 {
-	uint64 numRecords = 0;
-	fchar_t dir[MAX_PATH];
   ntfsx_mftmap map;
+  ntfsx_records records;
+  deferredmeta deferred;
+  dircache dirs;
   uint64 length;
   uint64 sector;
+  uint64 batch;
+  uint64 ahead;
   uint64 i;
 
   fprintf(stderr, "[Scrounging via MFT...]\n");
 
-	/* Save current directory away */
-	fc_getcwd(dir, MAX_PATH);
+  /* Output goes relative to the current directory */
+  dircache_init(&dirs, kNTFS_RootIndex, DEF_DIR_MODE);
+  dirs.pretend = (pi->archive || pi->catalog);
+  pi->dirs = &dirs;
+
+  /* Directory metadata gets set at the end */
+  memset(&deferred, 0, sizeof(deferred));
+  pi->deferred = &deferred;
 
   /* Get the MFT map ready */
   memset(&map, 0, sizeof(map));
@@ -586,15 +1717,47 @@ void scroungeUsingMFT(partitioninfo* pi)
   pi->mftmap = &map;
 
 
-  /* 
-   * Make sure the MFT is actually where they say it is.
-   * This also fills in the valid cluster size if needed
-   */
-  scroungeMFT(pi, &map);
+  /* A snapshot from an earlier run saves going to the disk */
+  if(pi->snapshot && snapshot_loaded(pi->snapshot))
+  {
+    fprintf(stderr, "[Reading MFT snapshot...]\n");
+    snapshot_loadmap(pi->snapshot, &map);
+  }
+
+  else
+  {
+    /* 
+     * Make sure the MFT is actually where they say it is.
+     * This also fills in the valid cluster size if needed
+     */
+    scroungeMFT(pi, &map);
+
+    if(pi->snapshot)
+      snapshot_save(pi->snapshot, pi, &map);
+  }
+
   length = ntfsx_mftmap_length(&map);
+
+  /* The records the disk is told about at once, a read's worth */
+  batch = max(pi->io.readSize / RECORD_SIZE(*pi), 1);
+  ahead = batch * pi->io.ahead;
+
+  /* And the records read from the disk at once */
+  ntfsx_records_init(&records, pi, (uint32)batch);
+  if(!pi->snapshot || !snapshot_loaded(pi->snapshot))
+    pi->records = &records;
  
   for(i = 1; i < length; i ++)
   {
+    /* Keep the disk a few batches of records ahead of us */
+    if(ahead > 0 && (!pi->snapshot || !snapshot_loaded(pi->snapshot)))
+    {
+      if(i == 1)
+        adviseRecords(pi, &map, 1, ahead);
+      if(i % batch == 1 % batch)
+        adviseRecords(pi, &map, i + ahead, batch);
+    }
+
     sector = ntfsx_mftmap_sectorforindex(&map, i);
     if(sector == kInvalidSector)
     {
@@ -602,13 +1765,30 @@ void scroungeUsingMFT(partitioninfo* pi)
       continue;
     }
 
+    if(pi->records && !ntfsx_records_has(pi->records, sector))
+      ntfsx_records_load(pi->records, &map, i);
+
     /* Process the record */
-    processMFTRecord(pi, sector, 0);
+    processMFTRecord(pi, sector, i, 0);
 
-  	/* Move to right output directory */
-    fc_chdir(dir);
+    /* Read the data noted so far when it's taking too much memory */
+    if(pi->sweep && sweep_memory(pi->sweep) >= pi->io.memory)
+      sweepFiles(pi);
 	}
 
+  if(pi->sweep)
+    sweepFiles(pi);
+
+  applyDirectories(pi);
+  pi->deferred = NULL;
+
+  dircache_destroy(&dirs);
+  pi->dirs = NULL;
+
+  ntfsx_records_destroy(&records);
+  pi->records = NULL;
+
+  ntfsx_mftmap_destroy(&map);
   pi->mftmap = NULL;
 }
 
@@ -617,31 +1797,40 @@ void scroungeUsingRaw(partitioninfo* pi, uint64 skip)
 	byte *buffer;
 	size_t length;
 	byte *bufsec;
-	fchar_t dir[MAX_PATH + 1];
 	uint64 sec;
 	drivelocks locks;
+	deferredmeta deferred;
+	dircache dirs;
 	int64 pos;
 	uint64 locked;
-	size_t sz;
-	uint32 magic = kNTFS_RecMagic;
+	int sz;
+	static const byte kRecMagic[] = { 'F', 'I', 'L', 'E' };
 
 	fprintf(stderr, "[Scrounging raw records...]\n");
 
-	/* Save current directory away */
-	fc_getcwd(dir, MAX_PATH);
+	/* 
+	 * Output goes relative to the current directory. Without the 
+	 * MFT there's no directory structure, so it all goes there.
+	 */
+	dircache_init(&dirs, kNTFS_RootIndex, DEF_DIR_MODE);
+	dirs.pretend = (pi->archive || pi->catalog);
+	pi->dirs = &dirs;
 
 	/* Get the locks ready */
 	memset(&locks, 0, sizeof(locks));
 	pi->locks = &locks;
 
-	/* The memory buffer */
-	length = kSectorSize * 2048;
-	buffer = malloc(length);
-	if(!buffer)
-		errx(1, "out of memory");
+	/* Directory metadata gets set at the end */
+	memset(&deferred, 0, sizeof(deferred));
+	pi->deferred = &deferred;
+
+	/* The memory buffer, aligned for reading directly */
+	length = pi->io.readSize;
+	buffer = (byte*)device_alloc(length);
 
 	/* Loop through sectors */
 	sec = pi->first + skip;
+	device_advise(pi->device, pi->direct, SECTOR_TO_BYTES(sec), 0, kDevice_Sequential);
 	while(sec < pi->end)
 	{
 #ifdef _WIN32
@@ -660,17 +1849,17 @@ void scroungeUsingRaw(partitioninfo* pi, uint64 skip)
 
 		/* Read a buffer size at this point */
 		pos = SECTOR_TO_BYTES(sec);
-		if(lseek64(pi->device, pos, SEEK_SET) == -1)
-			errx(1, "can't seek device to sector");
-
-		sz = read(pi->device, buffer, length);
-		if(sz == -1 || sz < kSectorSize)
+		sz = device_read(pi->device, pi->direct, pos, buffer, length);
+		if(sz < kSectorSize)
 		{
 			warn("can't read drive sector");
 
 			/* Try again and go much slower */
 			if(length != kSectorSize)
+			{
 				length = kSectorSize;
+				stats_count(kStats_Retries, 1);
+			}
 
 			/* Already going slow, skip sector */
 			else
@@ -684,16 +1873,24 @@ void scroungeUsingRaw(partitioninfo* pi, uint64 skip)
 			bufsec += kSectorSize, ++sec)
 		{
 			/* Check beginning of sector for the magic signature */
-			if(!memcmp(&magic, bufsec, sizeof(magic)))
+			if(!memcmp(kRecMagic, bufsec, sizeof(kRecMagic)))
 			{
 				/* Process the record */
-				processMFTRecord(pi, sec, 0);
+				processMFTRecord(pi, sec, kInvalidSector, 0);
 			}
-
-			/* Move to right output directory */
-			fc_chdir(dir);
 		}
+
+		/* We don't come back here, no need to keep it cached */
+		device_advise(pi->device, pi->direct, pos, sz, kDevice_DontNeed);
 	}
 
+	device_free(buffer);
+
+	applyDirectories(pi);
+	pi->deferred = NULL;
+
+	dircache_destroy(&dirs);
+	pi->dirs = NULL;
+
 	pi->locks = NULL;
 }
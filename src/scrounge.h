@@ -22,17 +22,18 @@
 
 #include "drive.h"
 
+bool scroungeDetect(partitioninfo* pi);
 void scroungeSearch(partitioninfo* pi);
 #ifdef _WIN32
 void scroungeList();
 #endif
-void scroungeListDrive(char* drive);
+void scroungeListDrives(char** drives, int count);
 void scroungeUsingMFT(partitioninfo* pi);
 void scroungeUsingRaw(partitioninfo* pi, uint64 skip);
 
 /* For compatibility */
-void setFileAttributes(fchar_t* filename, uint32 flags);
-void setFileTime(fchar_t* filename, uint64* created, uint64* accessed, uint64* modified);
+void setFileAttributes(int fd, fchar_t* filename, uint32 flags);
+void setFileTime(int fd, fchar_t* filename, uint64* created, uint64* accessed, uint64* modified);
 
 int compareFileData(int f, void* data, size_t length);
 
@@ -20,23 +20,587 @@
 
 #include "usuals.h"
 #include "drive.h"
+#include "ntfs.h"
+#include "ntfsx.h"
+#include "scrounge.h"
+#include "device.h"
 
-void scroungeSearch(partitioninfo* pi)
+static bool readBootSector(partitioninfo* pi, uint64 sector, ntfs_bootsector* boot)
+{
+  int64 pos;
+  int sz;
+
+  pos = SECTOR_TO_BYTES(sector);
+  sz = device_read(pi->device, pi->direct, pos, boot, sizeof(ntfs_bootsector));
+  if(sz != (int)sizeof(ntfs_bootsector))
+    return false;
+
+  return ntfs_isbootsector(boot);
+}
+
+static bool checkMFTRecord(partitioninfo* pi, uint64 offset)
+{
+  ntfsx_record* record;
+  ntfs_recordheader* header;
+  bool ret = false;
+
+  if(pi->first + offset >= pi->end)
+    return false;
+
+  record = ntfsx_record_alloc(pi);
+
+  if(ntfsx_record_read(record, pi->first + offset, pi->device))
+  {
+    header = ntfsx_record_header(record);
+    ret = (header->flags & kNTFS_RecFlagUse) ? true : false;
+  }
+
+  ntfsx_record_free(record);
+  return ret;
+}
+
+bool scroungeDetect(partitioninfo* pi)
 {
-  fprintf(stderr, "[Performing NTFS partition search...]");
-  errx(1, "search functionality not implemented yet.");
-
-  /* 
-   * go through and look for an $MFTMirr file record. First of all
-   * these should be exactly 4096 bytes long. This allows us 
-   * to discover the length of a cluster, using both the data
-   * runs in the $MFTMirr and the cbAllocated.
-   *
-   * Determine if it's the $MFTMirr or $MFT we're looking at
-   * 
-   * Next using this cluster information we can discover the
-   * beginning of the partition, 
+  ntfs_bootsector boot;
+  uint64 mft;
+  uint64 mirr;
+  uint32 cluster;
+
+  ASSERT(sizeof(ntfs_bootsector) == kSectorSize);
+
+  /*
+   * The boot sector is at the start of the partition, and a backup
+   * is kept in the last sector. Depending on where the end came from
+   * it's either the given sector or the one before.
    */
+  if(!readBootSector(pi, pi->first, &boot) &&
+     !readBootSector(pi, pi->end, &boot) &&
+     !readBootSector(pi, pi->end - 1, &boot))
+  {
+    warnx("couldn't find a valid NTFS boot sector");
+    return false;
+  }
+
+  /* Everything here works in kSectorSize sectors */
+  cluster = (boot.secPerClus * boot.bytePerSec) / kSectorSize;
+  if(pi->cluster != 0 && pi->cluster != cluster)
+    warnx("cluster size doesn't match boot sector (%u sectors)", cluster);
+
+  if(pi->cluster == 0)
+    pi->cluster = (byte)cluster;
+
+  if(pi->record == 0)
+    pi->record = ntfs_bootrecordsize(&boot);
+
+  fprintf(stderr, "[Found NTFS boot sector: %u sectors per cluster, %u byte records]\n",
+          (unsigned int)pi->cluster, (unsigned int)pi->record);
+
+  /* Only look for the MFT when it hasn't been specified */
+  if(pi->mft != 0)
+    return true;
+
+  mft = boot.offMFT * cluster;
+  mirr = boot.offMFTMirr * cluster;
+
+  /*
+   * The first records in the mirror are copies of the ones in the
+   * MFT, including the MFT's own record and therefore its data runs.
+   * So when the MFT is damaged we can still load it via the mirror.
+   */
+  if(checkMFTRecord(pi, mft))
+  {
+    pi->mft = mft;
+  }
+  else if(checkMFTRecord(pi, mirr))
+  {
+    warnx("mft record is damaged, using the mft mirror");
+    pi->mft = mirr;
+  }
+  else
+  {
+    warnx("couldn't find a valid mft at the location in boot sector");
+    return false;
+  }
+
+  return true;
+}
+
+/* 
+ * The search reads large chunks of the disk and looks at each sector 
+ * for NTFS boot sectors, and the MFT records of $MFT and $MFTMirr. 
+ * Each of these suggests a partition, and the partitions that are 
+ * suggested by the most pieces of evidence are the likely ones.
+ */
+
+#define SEARCH_BUFFER         (kSectorSize * 0x4000)
+#define SEARCH_MAXRECORD      0x1000
+#define SEARCH_OVERLAP        (SEARCH_MAXRECORD * 2)
+
+/* Kinds of evidence for a candidate partition */
+#define SEARCH_FOUND_BOOT     1 << 0    /* Boot sector at the start */
+#define SEARCH_FOUND_BACKUP   1 << 1    /* Backup boot sector at the end */
+#define SEARCH_FOUND_MFT      1 << 2    /* $MFT record in the MFT */
+#define SEARCH_FOUND_MIRROR   1 << 3    /* $MFT record in the $MFTMirr */
+
+typedef struct _searchcandidate
+{
+  uint64 first;
+  uint64 end;           /* kInvalidSector when unknown */
+  uint64 mft;           /* Offset to MFT (in sectors) */
+  uint32 cluster;       /* In sectors */
+  uint32 found;         /* SEARCH_FOUND_xxx flags */
+}
+searchcandidate;
+
+/* An $MFT record together with the $MFTMirr one following it */
+typedef struct _searchmftrec
+{
+  uint64 sector;
+  uint64 mftLCN;
+  uint64 mirrLCN;
+}
+searchmftrec;
+
+typedef struct _searchstate
+{
+  searchcandidate* cands;
+  uint32 ncands;
+  uint32 acands;
+  searchmftrec* recs;
+  uint32 nrecs;
+  uint32 arecs;
+}
+searchstate;
+
+static void addCandidate(searchstate* st, uint64 first, uint64 end, 
+                         uint64 mft, uint32 cluster, uint32 found)
+{
+  searchcandidate* c;
+  uint32 i;
+
+  /* Merge with anything that describes the same partition */
+  for(i = 0; i < st->ncands; i++)
+  {
+    c = st->cands + i;
+    if(c->first == first && c->mft == mft && c->cluster == cluster)
+    {
+      if(c->end == kInvalidSector)
+        c->end = end;
+      c->found |= found;
+      return;
+    }
+  }
+
+  if(st->ncands >= st->acands)
+  {
+    st->acands += 16;
+    st->cands = (searchcandidate*)reallocf(st->cands, 
+                        st->acands * sizeof(searchcandidate));
+  }
+
+  c = st->cands + st->ncands++;
+  c->first = first;
+  c->end = end;
+  c->mft = mft;
+  c->cluster = cluster;
+  c->found = found;
+}
+
+static void searchBootSector(searchstate* st, uint64 sector, ntfs_bootsector* boot)
+{
+  uint32 cluster;
+  uint64 length;
+  uint64 mft;
+
+  cluster = (boot->secPerClus * boot->bytePerSec) / kSectorSize;
+  length = (boot->cSectors * boot->bytePerSec) / kSectorSize;
+  mft = boot->offMFT * cluster;
+
+  /* This is either the boot sector at the start, or the backup */
+  addCandidate(st, sector, sector + length, mft, cluster, SEARCH_FOUND_BOOT);
+  if(sector >= length)
+    addCandidate(st, sector - length, sector, mft, cluster, SEARCH_FOUND_BACKUP);
+}
+
+static uint64 firstRunLCN(ntfs_attribnonresident* nonres, byte* end)
+{
+  byte* run = ((byte*)nonres) + nonres->offDataRuns;
+  byte length;
+  byte roffset;
+  uint64 lcn = 0;
+
+  if(run >= end)
+    return 0;
+
+  length = *run & 0x0F;
+  roffset = *run >> 4;
+
+  if(length == 0 || length > 8 || roffset == 0 || roffset > 8 ||
+     run + 1 + length + roffset > end)
+    return 0;
+
+  memcpy(&lcn, run + 1 + length, roffset);
+  return lcn;
+}
+
+/* 
+ * Check if a record is the $MFT or $MFTMirr. Returns 0 for $MFT, 
+ * 1 for $MFTMirr and -1 otherwise, along with the LCN its data 
+ * starts at.
+ */
+static int searchSystemRecord(byte* data, size_t length, uint64* lcn)
+{
+  static const ntfs_char kMFTName[] = { '$', 'M', 'F', 'T', 'M', 'i', 'r', 'r' };
+  byte rec[SEARCH_MAXRECORD];
+  ntfs_recordheader* header = (ntfs_recordheader*)rec;
+  ntfs_attribheader* attr;
+  ntfs_attribresident* res;
+  ntfs_attribfilename* filename;
+  ntfs_char* name;
+  byte* end;
+  uint32 size;
+  int which;
+
+  if(length < sizeof(ntfs_recordheader))
+    return -1;
+
+  size = ((ntfs_recordheader*)data)->cbAllocated;
+  if(size != kNTFS_RecordLen && size != SEARCH_MAXRECORD)
+    return -1;
+  if(size > length)
+    return -1;
+
+  memcpy(rec, data, size);
+  end = rec + size;
+
+  /* Newer records contain their own number, a quick check */
+  if(header->offUpdSeq >= kNTFS_RecHeaderLen && header->recordNum > 1)
+    return -1;
+
+  if(header->offUpdSeq + (header->cwUpdSeq * sizeof(uint16)) > size ||
+     header->cwUpdSeq == 0 || header->offAttrs == 0 || header->offAttrs >= 0x100 ||
+     !(header->flags & kNTFS_RecFlagUse) || header->refBaseRecord != 0)
+    return -1;
+
+  if(!ntfs_dofixups(rec, size))
+    return -1;
+
+  attr = ntfs_findattribute(header, kNTFS_FILENAME, end);
+  if(!attr || attr->bNonResident)
+    return -1;
+
+  res = (ntfs_attribresident*)attr;
+  filename = (ntfs_attribfilename*)ntfs_getattributedata(res, end);
+  if(!filename || (byte*)(filename + 1) + (8 * sizeof(ntfs_char)) > end)
+    return -1;
+
+  /* Both are in the root directory */
+  if((filename->refParent & kNTFS_RefMask) != kNTFS_RootIndex)
+    return -1;
+
+  name = (ntfs_char*)(filename + 1);
+  if(filename->cFileName == 4 && !memcmp(name, kMFTName, 4 * sizeof(ntfs_char)))
+    which = 0;
+  else if(filename->cFileName == 8 && !memcmp(name, kMFTName, 8 * sizeof(ntfs_char)))
+    which = 1;
+  else
+    return -1;
+
+  attr = ntfs_findattribute(header, kNTFS_DATA, end);
+  if(!attr || !attr->bNonResident || ((byte*)attr) + sizeof(ntfs_attribnonresident) > end)
+    return -1;
+
+  *lcn = firstRunLCN((ntfs_attribnonresident*)attr, end);
+  if(*lcn == 0)
+    return -1;
+
+  return which;
+}
+
+static void searchMFTRecord(searchstate* st, uint64 sector, byte* data, size_t length)
+{
+  searchmftrec* r;
+  uint64 mftLCN;
+  uint64 mirrLCN;
+  uint32 size;
+
+  if(searchSystemRecord(data, length, &mftLCN) != 0)
+    return;
+
+  /* The $MFTMirr record follows directly */
+  size = ((ntfs_recordheader*)data)->cbAllocated;
+  if(searchSystemRecord(data + size, length - size, &mirrLCN) != 1)
+    mirrLCN = 0;
+
+  if(st->nrecs >= st->arecs)
+  {
+    st->arecs += 16;
+    st->recs = (searchmftrec*)reallocf(st->recs, st->arecs * sizeof(searchmftrec));
+  }
+
+  r = st->recs + st->nrecs++;
+  r->sector = sector;
+  r->mftLCN = mftLCN;
+  r->mirrLCN = mirrLCN;
+}
+
+/* 
+ * When an $MFT record is found in both the MFT and the mirror, the 
+ * distance between them tells us the cluster size, and from that 
+ * the start of the partition.
+ */
+static void searchPairRecords(searchstate* st)
+{
+  searchmftrec* r1;
+  searchmftrec* r2;
+  searchcandidate* c;
+  uint64 dist;
+  uint64 clus;
+  uint64 cluster;
+  uint32 i, j;
+
+  for(i = 0; i < st->nrecs; i++)
+  {
+    r1 = st->recs + i;
+    if(r1->mirrLCN == 0 || r1->mirrLCN == r1->mftLCN)
+      continue;
+
+    for(j = i + 1; j < st->nrecs; j++)
+    {
+      r2 = st->recs + j;
+      if(r2->mftLCN != r1->mftLCN || r2->mirrLCN != r1->mirrLCN)
+        continue;
+
+      /* Whichever comes first on the disk is in the lower LCN */
+      dist = r2->sector - r1->sector;
+      clus = r1->mirrLCN > r1->mftLCN ? r1->mirrLCN - r1->mftLCN :
+                                        r1->mftLCN - r1->mirrLCN;
+
+      if(dist % clus != 0)
+        continue;
+
+      cluster = dist / clus;
+      if(cluster == 0 || cluster > 128 || (cluster & (cluster - 1)))
+        continue;
+
+      clus = min(r1->mftLCN, r1->mirrLCN) * cluster;
+      if(r1->sector < clus)
+        continue;
+
+      addCandidate(st, r1->sector - clus, kInvalidSector, r1->mftLCN * cluster,
+                   (uint32)cluster, SEARCH_FOUND_MFT | SEARCH_FOUND_MIRROR);
+    }
+  }
+
+  /* Lone records still back up partitions found otherwise */
+  for(i = 0; i < st->nrecs; i++)
+  {
+    r1 = st->recs + i;
+
+    for(j = 0; j < st->ncands; j++)
+    {
+      c = st->cands + j;
+      if(c->mft != r1->mftLCN * c->cluster)
+        continue;
+
+      if(r1->sector == c->first + c->mft)
+        c->found |= SEARCH_FOUND_MFT;
+      else if(r1->mirrLCN && r1->sector == c->first + (r1->mirrLCN * c->cluster))
+        c->found |= SEARCH_FOUND_MIRROR;
+    }
+  }
+}
+
+/* 
+ * Every boot sector is taken as both a start and a backup, so one of 
+ * those is always wrong. Once a partition is backed up by its MFT, a 
+ * boot sector it explains isn't evidence of another. Nor can a 
+ * partition end past the end of the disk, unless its MFT says so.
+ */
+static void searchPrune(searchstate* st, uint64 last)
+{
+  searchcandidate* c;
+  searchcandidate* d;
+  uint32 i, j, n;
+  bool drop;
+
+  for(i = 0, n = 0; i < st->ncands; i++)
+  {
+    c = st->cands + i;
+    drop = false;
+
+    if(!(c->found & (SEARCH_FOUND_MFT | SEARCH_FOUND_MIRROR)))
+    {
+      if(last != kInvalidSector && c->end != kInvalidSector && c->end >= last)
+        drop = true;
+
+      for(j = 0; j < st->ncands && !drop; j++)
+      {
+        d = st->cands + j;
+        if(!(d->found & (SEARCH_FOUND_MFT | SEARCH_FOUND_MIRROR)))
+          continue;
+
+        if(c->found == SEARCH_FOUND_BOOT && 
+           (d->found & SEARCH_FOUND_BACKUP) && d->end == c->first)
+          drop = true;
+
+        else if(c->found == SEARCH_FOUND_BACKUP && 
+                (d->found & SEARCH_FOUND_BOOT) && d->first == c->end)
+          drop = true;
+      }
+    }
+
+    if(!drop)
+      st->cands[n++] = *c;
+  }
+
+  st->ncands = n;
+}
+
+static uint32 searchScore(searchcandidate* c)
+{
+  uint32 score = 0;
+  uint32 found;
+
+  for(found = c->found; found; found >>= 1)
+    score += found & 1;
+
+  return score;
+}
+
+static int compareCandidates(const void* a, const void* b)
+{
+  searchcandidate* c1 = (searchcandidate*)a;
+  searchcandidate* c2 = (searchcandidate*)b;
+  uint32 s1 = searchScore(c1);
+  uint32 s2 = searchScore(c2);
+
+  if(s1 != s2)
+    return s1 > s2 ? -1 : 1;
+  if(c1->first != c2->first)
+    return c1->first < c2->first ? -1 : 1;
+  return 0;
+}
+
+const char kPrintSearch[]		= "\
+    Start Sector    End Sector      Cluster Size    MFT Offset     Evidence\n\
+===================================================================================\n\
+";
+
+void scroungeSearch(partitioninfo* pi)
+{
+  searchstate st;
+  searchcandidate* c;
+  ntfs_bootsector* boot;
+  byte* buffer;
+  byte* bufsec;
+  static const byte kRecMagic[] = { 'F', 'I', 'L', 'E' };
+  uint64 sec;
+  uint64 next;
+  uint64 last = kInvalidSector;   /* End of the disk, when we get there */
+  int64 pos;
+  int sz;
+  uint32 i;
+
+  fprintf(stderr, "[Performing NTFS partition search...]\n");
+
+  memset(&st, 0, sizeof(st));
+
+  buffer = (byte*)device_alloc(SEARCH_BUFFER);
+
+  sec = pi->first;
+  while(sec < pi->end)
+  {
+#ifdef _WIN32
+    fprintf(stderr, "sector: %I64u\r", sec);
+#else
+    fprintf(stderr, "sector: %llu\r", (unsigned long long)sec);
+#endif
+
+    pos = SECTOR_TO_BYTES(sec);
+    sz = device_read(pi->device, pi->direct, pos, buffer, SEARCH_BUFFER);
+    if(sz < kSectorSize)
+    {
+      if(sz == 0)
+      {
+        last = sec;
+        break;
+      }
+
+      /* Skip over the bad area, one buffer at a time */
+      warn("couldn't read drive at sector: %u", (uint32)sec);
+      sec += SEARCH_BUFFER / kSectorSize;
+      continue;
+    }
+
+    /* 
+     * Records that cross the end of the buffer are looked at again
+     * at the start of the next one, unless we're at the end.
+     */
+    next = sec + (sz / kSectorSize);
+    if(sz > SEARCH_OVERLAP && sz == SEARCH_BUFFER)
+      next -= SEARCH_OVERLAP / kSectorSize;
+    else if(sz < SEARCH_BUFFER)
+      last = next;
+
+    for(bufsec = buffer; sec < next && sec < pi->end; 
+        bufsec += kSectorSize, ++sec)
+    {
+      boot = (ntfs_bootsector*)bufsec;
+      if(!memcmp(boot->sysId, kNTFS_SysId, sizeof(boot->sysId)))
+      {
+        if(ntfs_isbootsector(boot))
+          searchBootSector(&st, sec, boot);
+      }
+
+      else if(!memcmp(kRecMagic, bufsec, sizeof(kRecMagic)))
+      {
+        searchMFTRecord(&st, sec, bufsec, sz - (bufsec - buffer));
+      }
+    }
+  }
+
+  device_free(buffer);
+
+  searchPairRecords(&st);
+  searchPrune(&st, last);
+
+  qsort(st.cands, st.ncands, sizeof(searchcandidate), compareCandidates);
+
+  printf(kPrintSearch);
+
+  for(i = 0; i < st.ncands; i++)
+  {
+    c = st.cands + i;
+
+#ifdef _WIN32
+    printf("    %-15I64u ", c->first);
+    if(c->end == kInvalidSector)
+      printf("%-15s ", "?");
+    else
+      printf("%-15I64u ", c->end);
+    printf("%-15u %-15I64u", c->cluster, c->mft);
+#else
+    printf("    %-15llu ", (unsigned long long)c->first);
+    if(c->end == kInvalidSector)
+      printf("%-15s ", "?");
+    else
+      printf("%-15llu ", (unsigned long long)c->end);
+    printf("%-15u %-15llu", c->cluster, (unsigned long long)c->mft);
+#endif
+
+    printf("%s%s%s%s\n",
+           c->found & SEARCH_FOUND_BOOT ? "boot " : "",
+           c->found & SEARCH_FOUND_BACKUP ? "backup " : "",
+           c->found & SEARCH_FOUND_MFT ? "mft " : "",
+           c->found & SEARCH_FOUND_MIRROR ? "mirror " : "");
+  }
 
+  if(st.ncands == 0)
+    warnx("no NTFS partitions found");
 
+  if(st.cands)
+    free(st.cands);
+  if(st.recs)
+    free(st.recs);
 }
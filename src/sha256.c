@@ -0,0 +1,149 @@
+/* 
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ * 
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+
+#include "usuals.h"
+#include "sha256.h"
+
+/* As described in FIPS 180-2 */
+
+static const uint32 kRounds[64] = 
+{
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n)    (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void transform(sha256* ctx, const byte* block)
+{
+  uint32 w[64];
+  uint32 a, b, c, d, e, f, g, h;
+  uint32 t1, t2;
+  int i;
+
+  for(i = 0; i < 16; i++)
+  {
+    w[i] = ((uint32)block[i * 4] << 24) | ((uint32)block[(i * 4) + 1] << 16) |
+           ((uint32)block[(i * 4) + 2] << 8) | (uint32)block[(i * 4) + 3];
+  }
+
+  for(i = 16; i < 64; i++)
+  {
+    t1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    t2 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    w[i] = t1 + w[i - 7] + t2 + w[i - 16];
+  }
+
+  a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+  e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+
+  for(i = 0; i < 64; i++)
+  {
+    t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + kRounds[i] + w[i];
+    t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+
+  ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+  ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void sha256_init(sha256* ctx)
+{
+  ctx->state[0] = 0x6a09e667;
+  ctx->state[1] = 0xbb67ae85;
+  ctx->state[2] = 0x3c6ef372;
+  ctx->state[3] = 0xa54ff53a;
+  ctx->state[4] = 0x510e527f;
+  ctx->state[5] = 0x9b05688c;
+  ctx->state[6] = 0x1f83d9ab;
+  ctx->state[7] = 0x5be0cd19;
+  ctx->length = 0;
+  ctx->used = 0;
+}
+
+void sha256_update(sha256* ctx, const byte* data, size_t len)
+{
+  size_t num;
+
+  ctx->length += len;
+
+  /* Top up a partial block first */
+  if(ctx->used)
+  {
+    num = 64 - ctx->used;
+    if(num > len)
+      num = len;
+
+    memcpy(ctx->buf + ctx->used, data, num);
+    ctx->used += (uint32)num;
+    data += num;
+    len -= num;
+
+    if(ctx->used < 64)
+      return;
+
+    transform(ctx, ctx->buf);
+    ctx->used = 0;
+  }
+
+  for(; len >= 64; data += 64, len -= 64)
+    transform(ctx, data);
+
+  memcpy(ctx->buf, data, len);
+  ctx->used = (uint32)len;
+}
+
+void sha256_final(sha256* ctx, byte* digest)
+{
+  uint64 bits = ctx->length * 8;
+  int i;
+
+  ctx->buf[ctx->used++] = 0x80;
+
+  if(ctx->used > 56)
+  {
+    memset(ctx->buf + ctx->used, 0, 64 - ctx->used);
+    transform(ctx, ctx->buf);
+    ctx->used = 0;
+  }
+
+  memset(ctx->buf + ctx->used, 0, 56 - ctx->used);
+
+  for(i = 0; i < 8; i++)
+    ctx->buf[56 + i] = (byte)(bits >> (56 - (i * 8)));
+
+  transform(ctx, ctx->buf);
+
+  for(i = 0; i < 8; i++)
+  {
+    digest[i * 4] = (byte)(ctx->state[i] >> 24);
+    digest[(i * 4) + 1] = (byte)(ctx->state[i] >> 16);
+    digest[(i * 4) + 2] = (byte)(ctx->state[i] >> 8);
+    digest[(i * 4) + 3] = (byte)(ctx->state[i]);
+  }
+}
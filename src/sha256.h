@@ -0,0 +1,41 @@
+/* 
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ * 
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+#include "usuals.h"
+
+#define kSHA256_Length    32
+
+typedef struct _sha256
+{
+  uint32 state[8];
+  uint64 length;            /* In bytes */
+  byte buf[64];
+  uint32 used;
+}
+sha256;
+
+void sha256_init(sha256* ctx);
+void sha256_update(sha256* ctx, const byte* data, size_t len);
+void sha256_final(sha256* ctx, byte* digest);
+
+#endif /* __SHA256_H__ */
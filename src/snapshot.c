@@ -0,0 +1,265 @@
+/* 
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ * 
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+
+#define _LARGEFILE_SOURCE
+#define _LARGEFILE64_SOURCE   /* For lseek64 */
+#define _FILE_OFFSET_BITS 64
+
+#include "usuals.h"
+#include "ntfs.h"
+#include "ntfsx.h"
+#include "snapshot.h"
+#include "device.h"
+
+#define kSnapshot_Magic     "SCRGMFT"
+#define kSnapshot_Version   1
+
+#pragma pack(1)
+
+typedef struct _snapshot_header
+{
+  char magic[8];            /* Only written once the snapshot is complete */
+  uint32 version;
+  uint32 record;            /* MFT record size (in bytes) */
+  uint64 first;             /* The partition (in sectors) */
+  uint64 end;
+  uint64 mft;               /* Offset to the MFT (in sectors) */
+  uint32 cluster;           /* Cluster size (in sectors) */
+  uint32 blocks;            /* Number of MFT map blocks that follow */
+  uint64 count;             /* Number of records after the blocks */
+}
+snapshot_header;
+
+typedef struct _snapshot_block
+{
+  uint64 firstSector;
+  uint64 length;
+}
+snapshot_block;
+
+#pragma pack()
+
+static bool readAt(int fd, uint64 pos, void* data, size_t len)
+{
+  if(lseek64(fd, pos, SEEK_SET) == -1)
+    return false;
+
+  return read(fd, data, len) == (int)len;
+}
+
+static void writeAll(mftsnapshot* snap, const void* data, size_t len)
+{
+  if(write(snap->fd, data, len) != (int)len)
+    err(1, "couldn't write mft snapshot: %s", snap->filename);
+}
+
+void snapshot_init(mftsnapshot* snap, const char* filename)
+{
+  memset(snap, 0, sizeof(mftsnapshot));
+  snap->filename = filename;
+  snap->fd = -1;
+}
+
+void snapshot_close(mftsnapshot* snap)
+{
+  if(snap->fd != -1)
+    close(snap->fd);
+
+  snap->fd = -1;
+}
+
+bool snapshot_loaded(mftsnapshot* snap)
+{
+  return snap->fd != -1;
+}
+
+bool snapshot_open(mftsnapshot* snap, partitioninfo* pi)
+{
+  snapshot_header header;
+
+  ASSERT(snap->fd == -1);
+
+  snap->fd = open(snap->filename, O_BINARY | O_RDONLY | OPEN_LARGE_OPTS);
+  if(snap->fd == -1)
+  {
+    if(errno == ENOENT)
+      return false;
+
+    err(1, "couldn't open mft snapshot: %s", snap->filename);
+  }
+
+  if(!readAt(snap->fd, 0, &header, sizeof(header)) ||
+     memcmp(header.magic, kSnapshot_Magic, sizeof(header.magic)) ||
+     header.version != kSnapshot_Version)
+    errx(2, "invalid or incomplete mft snapshot: %s", snap->filename);
+
+  if(header.first != pi->first || header.end != pi->end)
+    errx(2, "mft snapshot is for a different partition: %s", snap->filename);
+
+  if(header.record < kSectorSize || header.cluster == 0 || header.cluster > 128)
+    errx(2, "invalid mft snapshot: %s", snap->filename);
+
+  /* The snapshot knows better than the (possibly broken) disk */
+  pi->record = header.record;
+  pi->cluster = (byte)header.cluster;
+  pi->mft = header.mft;
+
+  snap->record = header.record;
+  snap->count = header.count;
+  snap->offRecords = sizeof(header) + (header.blocks * sizeof(snapshot_block));
+
+  return true;
+}
+
+void snapshot_loadmap(mftsnapshot* snap, ntfsx_mftmap* map)
+{
+  snapshot_header header;
+  snapshot_block block;
+  uint32 i;
+
+  ASSERT(snap->fd != -1);
+
+  if(!readAt(snap->fd, 0, &header, sizeof(header)))
+    err(1, "couldn't read mft snapshot: %s", snap->filename);
+
+  for(i = 0; i < header.blocks; i++)
+  {
+    if(read(snap->fd, &block, sizeof(block)) != sizeof(block))
+      err(1, "couldn't read mft snapshot: %s", snap->filename);
+
+    ntfsx_mftmap_addblock(map, block.firstSector, block.length);
+  }
+}
+
+/* Read records from the disk, one at a time when a chunk can't be read */
+static void copyRecords(mftsnapshot* snap, partitioninfo* pi, byte* buf, 
+                        uint64 sector, uint32 num)
+{
+  uint32 size = RECORD_SIZE(*pi);
+  uint32 i;
+
+  if(device_read(pi->device, pi->direct, SECTOR_TO_BYTES(sector), 
+                 buf, num * size) == (int)(num * size))
+  {
+    writeAll(snap, buf, num * size);
+    return;
+  }
+
+  for(i = 0; i < num; i++)
+  {
+    /* Records we can't read are left blank, same as invalid ones */
+    if(device_read(pi->device, pi->direct, SECTOR_TO_BYTES(sector), 
+                   buf, size) != (int)size)
+    {
+      warn("couldn't read mft record from drive");
+      memset(buf, 0, size);
+    }
+
+    writeAll(snap, buf, size);
+    sector += size / kSectorSize;
+  }
+}
+
+void snapshot_save(mftsnapshot* snap, partitioninfo* pi, ntfsx_mftmap* map)
+{
+  snapshot_header header;
+  snapshot_block block;
+  uint64 firstSector;
+  uint64 length;
+  uint32 size = RECORD_SIZE(*pi);
+  uint32 perChunk;
+  uint32 num;
+  byte* buf;
+  uint32 i;
+
+  ASSERT(snap->fd == -1);
+
+  snap->fd = open(snap->filename, O_BINARY | O_RDWR | O_CREAT | O_TRUNC | OPEN_LARGE_OPTS, 0644);
+  if(snap->fd == -1)
+    err(1, "couldn't create mft snapshot: %s", snap->filename);
+
+  fprintf(stderr, "[Saving MFT snapshot...]\n");
+
+  memset(&header, 0, sizeof(header));
+  header.version = kSnapshot_Version;
+  header.record = size;
+  header.first = pi->first;
+  header.end = pi->end;
+  header.mft = pi->mft;
+  header.cluster = pi->cluster;
+
+  while(ntfsx_mftmap_block(map, header.blocks, &firstSector, &length))
+    header.blocks++;
+
+  header.count = ntfsx_mftmap_length(map);
+
+  /* Without the magic this isn't used until it's complete */
+  writeAll(snap, &header, sizeof(header));
+
+  for(i = 0; ntfsx_mftmap_block(map, i, &firstSector, &length); i++)
+  {
+    block.firstSector = firstSector;
+    block.length = length;
+    writeAll(snap, &block, sizeof(block));
+  }
+
+  /* Copied a read's worth of records at a time */
+  perChunk = max(pi->io.readSize / size, 1);
+  buf = (byte*)device_alloc(perChunk * size);
+
+  for(i = 0; ntfsx_mftmap_block(map, i, &firstSector, &length); i++)
+  {
+    while(length > 0)
+    {
+      num = length < perChunk ? (uint32)length : perChunk;
+      copyRecords(snap, pi, buf, firstSector, num);
+
+      firstSector += ((uint64)num * size) / kSectorSize;
+      length -= num;
+    }
+  }
+
+  device_free(buf);
+
+  memcpy(header.magic, kSnapshot_Magic, sizeof(header.magic));
+
+  if(lseek64(snap->fd, 0, SEEK_SET) == -1)
+    err(1, "couldn't write mft snapshot: %s", snap->filename);
+  writeAll(snap, &header, sizeof(header));
+
+  snap->record = size;
+  snap->count = header.count;
+  snap->offRecords = sizeof(header) + (header.blocks * sizeof(snapshot_block));
+}
+
+bool snapshot_read(mftsnapshot* snap, ntfsx_mftmap* map, uint64 sector, 
+                   byte* data, uint32 size)
+{
+  uint64 index;
+
+  if(snap->fd == -1 || size != snap->record)
+    return false;
+
+  index = ntfsx_mftmap_indexforsector(map, sector);
+  if(index == kInvalidSector || index >= snap->count)
+    return false;
+
+  return readAt(snap->fd, snap->offRecords + (index * size), data, size);
+}
@@ -0,0 +1,62 @@
+/* 
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ * 
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include "drive.h"
+#include "ntfsx.h"
+
+/*
+ * A copy of the MFT kept in a local file, so that later runs don't
+ * have to read it from the disk again. The records are stored as they
+ * were read, along with where they came from.
+ */
+typedef struct _mftsnapshot
+{
+  const char* filename;
+  int fd;                   /* Open once loaded or saved */
+  uint64 offRecords;        /* Where the records start in the file */
+  uint64 count;             /* Number of records in the file */
+  uint32 record;            /* Size of each record */
+}
+mftsnapshot;
+
+void snapshot_init(mftsnapshot* snap, const char* filename);
+void snapshot_close(mftsnapshot* snap);
+
+/* 
+ * Open an existing snapshot, filling in the partition info from it.
+ * Returns false when there's no snapshot yet.
+ */
+bool snapshot_open(mftsnapshot* snap, partitioninfo* pi);
+bool snapshot_loaded(mftsnapshot* snap);
+
+/* Load the MFT map from an opened snapshot */
+void snapshot_loadmap(mftsnapshot* snap, ntfsx_mftmap* map);
+
+/* Copy all the records in the map from the disk into a new snapshot */
+void snapshot_save(mftsnapshot* snap, partitioninfo* pi, ntfsx_mftmap* map);
+
+/* Read a record. Returns false when it's not in the snapshot */
+bool snapshot_read(mftsnapshot* snap, ntfsx_mftmap* map, uint64 sector, 
+                   byte* data, uint32 size);
+
+#endif /* __SNAPSHOT_H__ */
@@ -0,0 +1,644 @@
+/*
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ *
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+#include "usuals.h"
+#include "stats.h"
+#include "memref.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <sys/time.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/* Phases can't nest deeper than parent directories do */
+#define kStats_MaxDepth     0x400
+
+/*
+ * Record times go in buckets 1/16th of a power of two wide, so any
+ * time is within about 6% of its bucket. 61 powers cover all of them.
+ */
+#define kStats_SubBits      4
+#define kStats_SubBuckets   (1 << kStats_SubBits)
+#define kStats_Buckets      (61 * kStats_SubBuckets)
+
+/* How many of the slowest records to keep for each kind */
+#define kStats_Slowest      10
+
+/* Reads are kept by which GiB of the disk they were in */
+#define kStats_RegionShift  30
+
+static const char* kPhaseNames[kStats_MaxPhase] =
+  { "other", "read", "parse", "names", "write", "meta", "dirs" };
+
+static const char* kCountNames[kStats_MaxCount] =
+  { "bytes_read", "bytes_written", "reads", "read_errors", "retries",
+    "records", "skipped", "files", "directories" };
+
+static const char* kRecordNames[kStats_MaxRecord] =
+  { "resident", "nonresident", "attrlist", "directory", "skipped" };
+
+static const char* kMemoryNames[kMemRef_MaxType + 1] =
+  { "blocks", "records", "attributes", "enums", "dataruns", "total" };
+
+typedef struct _stats_slow
+{
+  uint64 index;
+  uint64 sector;
+  uint64 time;
+  const char* reason;
+  uint32 runs;
+  uint64 bytes;
+}
+stats_slow;
+
+typedef struct _stats_region
+{
+  uint64 reads;
+  uint64 errors;
+  uint64 bytes;
+  uint64 time;
+  uint64 slowest;
+}
+stats_region;
+
+typedef struct _stats_histogram
+{
+  uint64 count;
+  uint64 total;
+  uint64 max;
+  uint64 buckets[kStats_Buckets];
+  stats_slow slowest[kStats_Slowest];   /* Fastest first */
+  uint32 numSlowest;
+}
+stats_histogram;
+
+typedef struct _stats_state
+{
+  FILE* f;
+  uint64 started;
+  uint64 interval;          /* Between reports, zero for only at the end */
+  uint64 nextReport;
+
+  /* The main thread, which keeps track of nesting */
+  uint64 time[kStats_MaxPhase];
+  uint64 calls[kStats_MaxPhase];
+  uint64 counts[kStats_MaxCount];
+  int stack[kStats_MaxDepth];
+  uint32 depth;
+  uint64 mark;              /* When the current phase was last entered */
+
+  /* Records are only gone through on the main thread */
+  stats_histogram records[kStats_MaxRecord];
+
+  /* Reads by where they were, grown as further regions are read */
+  const char* heatmap;
+  stats_region* regions;
+  uint32 numRegions;
+
+  /* Any other threads add their time here */
+  uint64 threadTime[kStats_MaxPhase];
+  uint64 threadCalls[kStats_MaxPhase];
+  uint64 threadCounts[kStats_MaxCount];
+#ifdef HAVE_PTHREAD_H
+  pthread_t main;
+  pthread_mutex_t lock;
+#endif
+}
+stats_state;
+
+static stats_state* g_stats = NULL;
+
+/* Monotonic time in nanoseconds */
+static uint64 now()
+{
+#ifdef _WIN32
+  LARGE_INTEGER count, freq;
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&freq);
+  return (uint64)((count.QuadPart * 1000000000.0) / freq.QuadPart);
+#elif defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64)ts.tv_sec * 1000000000) + ts.tv_nsec;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return ((uint64)tv.tv_sec * 1000000000) + ((uint64)tv.tv_usec * 1000);
+#endif
+}
+
+static bool mainThread(stats_state* st)
+{
+#ifdef HAVE_PTHREAD_H
+  return pthread_equal(pthread_self(), st->main) != 0;
+#else
+  return true;
+#endif
+}
+
+static void lock(stats_state* st)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&(st->lock));
+#endif
+}
+
+static void unlock(stats_state* st)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&(st->lock));
+#endif
+}
+
+static void printNumber(FILE* f, uint64 num)
+{
+#ifdef _WIN32
+  fprintf(f, "%I64u", num);
+#else
+  fprintf(f, "%llu", (unsigned long long)num);
+#endif
+}
+
+static uint32 bucketFor(uint64 time)
+{
+  uint32 bits = kStats_SubBits;
+
+  if(time < kStats_SubBuckets)
+    return (uint32)time;
+
+  while(time >> (bits + 1))
+    bits++;
+
+  return ((bits - kStats_SubBits + 1) << kStats_SubBits) +
+         (uint32)((time >> (bits - kStats_SubBits)) & (kStats_SubBuckets - 1));
+}
+
+/* The middle of the range of times in a bucket */
+static uint64 bucketTime(uint32 bucket)
+{
+  uint32 bits;
+  uint64 sub;
+
+  if(bucket < kStats_SubBuckets)
+    return bucket;
+
+  bits = (bucket >> kStats_SubBits) + kStats_SubBits - 1;
+  sub = kStats_SubBuckets + (bucket & (kStats_SubBuckets - 1));
+
+  return (sub << (bits - kStats_SubBits)) + 
+         (((uint64)1 << (bits - kStats_SubBits)) >> 1);
+}
+
+/* The time that the given fraction of records took no longer than */
+static uint64 percentile(stats_histogram* hist, double fraction)
+{
+  uint64 want = (uint64)(hist->count * fraction + 0.5);
+  uint64 seen = 0;
+  uint32 i;
+
+  if(want == 0)
+    want = 1;
+
+  for(i = 0; i < kStats_Buckets; i++)
+  {
+    seen += hist->buckets[i];
+    if(seen >= want)
+      return min(bucketTime(i), hist->max);
+  }
+
+  return hist->max;
+}
+
+static void printMicros(FILE* f, const char* name, uint64 time)
+{
+  fprintf(f, ",\"%s\":%.1f", name, time / 1000.0);
+}
+
+static void reportRecords(stats_state* st)
+{
+  stats_histogram* hist;
+  stats_slow* slow;
+  int i, j;
+
+  for(i = 0; i < kStats_MaxRecord; i++)
+  {
+    hist = st->records + i;
+
+    fprintf(st->f, "%s\"%s\":{\"count\":", i ? "," : "", kRecordNames[i]);
+    printNumber(st->f, hist->count);
+
+    if(hist->count)
+    {
+      printMicros(st->f, "mean_us", hist->total / hist->count);
+      printMicros(st->f, "p50_us", percentile(hist, 0.5));
+      printMicros(st->f, "p90_us", percentile(hist, 0.9));
+      printMicros(st->f, "p99_us", percentile(hist, 0.99));
+      printMicros(st->f, "p999_us", percentile(hist, 0.999));
+      printMicros(st->f, "max_us", hist->max);
+    }
+
+    fprintf(st->f, ",\"slowest\":[");
+
+    /* Slowest first */
+    for(j = hist->numSlowest - 1; j >= 0; j--)
+    {
+      slow = hist->slowest + j;
+
+      fprintf(st->f, "{\"index\":");
+      if(slow->index == (uint64)-1)
+        fprintf(st->f, "null");
+      else
+        printNumber(st->f, slow->index);
+
+      fprintf(st->f, ",\"sector\":");
+      printNumber(st->f, slow->sector);
+      printMicros(st->f, "us", slow->time);
+      fprintf(st->f, ",\"runs\":%u,\"bytes\":", slow->runs);
+      printNumber(st->f, slow->bytes);
+
+      if(slow->reason)
+        fprintf(st->f, ",\"reason\":\"%s\"", slow->reason);
+
+      fprintf(st->f, "}%s", j ? "," : "");
+    }
+
+    fprintf(st->f, "]}");
+  }
+}
+
+/* Only counted on the main thread, so no need to lock */
+static void reportMemory(stats_state* st)
+{
+  const memref_count* count;
+  int i;
+
+  for(i = 0; i <= kMemRef_Total; i++)
+  {
+    count = memref_counts(i);
+
+    fprintf(st->f, "%s\"%s\":{\"allocs\":", i ? "," : "", kMemoryNames[i]);
+    printNumber(st->f, count->allocs);
+    fprintf(st->f, ",\"live\":");
+    printNumber(st->f, count->live);
+    fprintf(st->f, ",\"bytes\":");
+    printNumber(st->f, count->bytes);
+    fprintf(st->f, ",\"peak\":");
+    printNumber(st->f, count->peak);
+    fprintf(st->f, "}");
+  }
+}
+
+/* Written over each time, with only the regions that were read */
+static void reportHeatmap(stats_state* st)
+{
+  stats_region* region;
+  FILE* f;
+  uint32 i;
+
+  if(!strcmp(st->heatmap, "-"))
+    f = stderr;
+  else if(!(f = fopen(st->heatmap, "w")))
+    err(1, "couldn't open heatmap file: %s", st->heatmap);
+
+  fprintf(f, "gib,reads,errors,bytes,seconds,mb_per_sec,error_rate,slowest_ms\n");
+
+  lock(st);
+
+  for(i = 0; i < st->numRegions; i++)
+  {
+    region = st->regions + i;
+    if(!region->reads)
+      continue;
+
+    fprintf(f, "%u,", i);
+    printNumber(f, region->reads);
+    fprintf(f, ",");
+    printNumber(f, region->errors);
+    fprintf(f, ",");
+    printNumber(f, region->bytes);
+    fprintf(f, ",%.6f,%.2f,%.4f,%.3f\n", region->time / 1000000000.0,
+            region->time ? (region->bytes / 1048576.0) / (region->time / 1000000000.0) : 0.0,
+            (double)region->errors / region->reads, region->slowest / 1000000.0);
+  }
+
+  unlock(st);
+
+  if(f == stderr)
+    fflush(f);
+  else
+    fclose(f);
+}
+
+/* One line of JSON, so that periodic reports can be read as they come */
+static void report(stats_state* st, uint64 when, bool final)
+{
+  uint64 time[kStats_MaxPhase];
+  uint64 calls[kStats_MaxPhase];
+  uint64 counts[kStats_MaxCount];
+  int i;
+
+  lock(st);
+  for(i = 0; i < kStats_MaxPhase; i++)
+  {
+    time[i] = st->time[i] + st->threadTime[i];
+    calls[i] = st->calls[i] + st->threadCalls[i];
+  }
+  for(i = 0; i < kStats_MaxCount; i++)
+    counts[i] = st->counts[i] + st->threadCounts[i];
+  unlock(st);
+
+  if(st->heatmap)
+    reportHeatmap(st);
+
+  if(!st->f)
+    return;
+
+  /* The phase we're in has time that's not been added yet */
+  time[st->stack[st->depth]] += when - st->mark;
+
+  fprintf(st->f, "{\"version\":\"%s\",\"final\":%s,\"elapsed\":%.6f,\"phases\":{",
+          VERSION, final ? "true" : "false", (when - st->started) / 1000000000.0);
+
+  for(i = 0; i < kStats_MaxPhase; i++)
+  {
+    fprintf(st->f, "%s\"%s\":{\"seconds\":%.6f,\"calls\":", i ? "," : "",
+            kPhaseNames[i], time[i] / 1000000000.0);
+    printNumber(st->f, calls[i]);
+    fprintf(st->f, "}");
+  }
+
+  fprintf(st->f, "},\"counts\":{");
+
+  for(i = 0; i < kStats_MaxCount; i++)
+  {
+    fprintf(st->f, "%s\"%s\":", i ? "," : "", kCountNames[i]);
+    printNumber(st->f, counts[i]);
+  }
+
+  fprintf(st->f, "},\"records\":{");
+  reportRecords(st);
+
+  fprintf(st->f, "},\"memory\":{");
+  reportMemory(st);
+
+  fprintf(st->f, "}}\n");
+  fflush(st->f);
+}
+
+void stats_init(const char* filename, const char* heatmap, uint32 interval)
+{
+  stats_state* st;
+  FILE* f;
+
+  ASSERT(!g_stats);
+
+  st = (stats_state*)mallocf(sizeof(stats_state));
+  memset(st, 0, sizeof(*st));
+
+  if(!filename)
+    st->f = NULL;
+  else if(!strcmp(filename, "-"))
+    st->f = stderr;
+  else if(!(st->f = fopen(filename, "w")))
+    err(1, "couldn't open stats file: %s", filename);
+
+  /* The heatmap is written over each time, but find problems now */
+  if(heatmap && strcmp(heatmap, "-"))
+  {
+    if(!(f = fopen(heatmap, "w")))
+      err(1, "couldn't open heatmap file: %s", heatmap);
+    fclose(f);
+  }
+
+  st->heatmap = heatmap;
+
+#ifdef HAVE_PTHREAD_H
+  st->main = pthread_self();
+  pthread_mutex_init(&(st->lock), NULL);
+#endif
+
+  st->started = st->mark = now();
+  st->interval = (uint64)interval * 1000000000;
+  st->nextReport = interval ? st->started + st->interval : (uint64)-1;
+  st->stack[0] = kStats_Other;
+
+  g_stats = st;
+}
+
+void stats_finish()
+{
+  stats_state* st = g_stats;
+
+  if(!st)
+    return;
+
+  report(st, now(), true);
+
+  if(st->f && st->f != stderr)
+    fclose(st->f);
+
+  if(st->regions)
+    free(st->regions);
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_destroy(&(st->lock));
+#endif
+
+  g_stats = NULL;
+  free(st);
+}
+
+uint64 stats_enter(int phase)
+{
+  stats_state* st = g_stats;
+  uint64 when;
+
+  if(!st)
+    return 0;
+
+  ASSERT(phase >= 0 && phase < kStats_MaxPhase);
+  when = now();
+
+  /* Other threads only need to know when they started */
+  if(!mainThread(st))
+    return when;
+
+  st->time[st->stack[st->depth]] += when - st->mark;
+  st->mark = when;
+
+  if(st->depth + 1 < kStats_MaxDepth)
+    st->depth++;
+  st->stack[st->depth] = phase;
+  st->calls[phase]++;
+
+  return when;
+}
+
+void stats_leave(int phase, uint64 entered)
+{
+  stats_state* st = g_stats;
+  uint64 when;
+
+  if(!st)
+    return;
+
+  when = now();
+
+  if(!mainThread(st))
+  {
+    lock(st);
+    st->threadTime[phase] += when - entered;
+    st->threadCalls[phase]++;
+    unlock(st);
+    return;
+  }
+
+  ASSERT(st->stack[st->depth] == phase);
+  st->time[phase] += when - st->mark;
+  st->mark = when;
+
+  if(st->depth > 0)
+    st->depth--;
+
+  if(when >= st->nextReport)
+  {
+    report(st, when, false);
+    st->nextReport = when + st->interval;
+  }
+}
+
+void stats_count(int counter, uint64 num)
+{
+  stats_state* st = g_stats;
+
+  if(!st)
+    return;
+
+  ASSERT(counter >= 0 && counter < kStats_MaxCount);
+
+  if(mainThread(st))
+  {
+    st->counts[counter] += num;
+  }
+  else
+  {
+    lock(st);
+    st->threadCounts[counter] += num;
+    unlock(st);
+  }
+}
+
+void stats_record(int kind, uint64 index, uint64 sector, uint64 entered,
+                  const char* reason, uint32 runs, uint64 bytes)
+{
+  stats_state* st = g_stats;
+  stats_histogram* hist;
+  stats_slow slow;
+  uint64 time;
+  uint32 i;
+
+  if(!st)
+    return;
+
+  ASSERT(kind >= 0 && kind < kStats_MaxRecord);
+  ASSERT(mainThread(st));
+
+  time = now() - entered;
+  hist = st->records + kind;
+
+  hist->count++;
+  hist->total += time;
+  hist->buckets[bucketFor(time)]++;
+  if(time > hist->max)
+    hist->max = time;
+
+  /* Only worth keeping when slower than the fastest kept */
+  if(hist->numSlowest == kStats_Slowest && time <= hist->slowest[0].time)
+    return;
+
+  slow.index = index;
+  slow.sector = sector;
+  slow.time = time;
+  slow.reason = reason;
+  slow.runs = runs;
+  slow.bytes = bytes;
+
+  /* Kept fastest first, so make room for it in order */
+  if(hist->numSlowest < kStats_Slowest)
+  {
+    for(i = hist->numSlowest++; i > 0 && hist->slowest[i - 1].time > time; i--)
+      hist->slowest[i] = hist->slowest[i - 1];
+  }
+
+  /* When full the fastest is dropped */
+  else
+  {
+    for(i = 0; i + 1 < kStats_Slowest && hist->slowest[i + 1].time < time; i++)
+      hist->slowest[i] = hist->slowest[i + 1];
+  }
+
+  hist->slowest[i] = slow;
+}
+
+void stats_read(uint64 pos, uint64 entered, int num)
+{
+  stats_state* st = g_stats;
+  stats_region* region;
+  uint64 time;
+  uint32 index;
+  uint32 count;
+
+  if(!st)
+    return;
+
+  time = now() - entered;
+  index = (uint32)(pos >> kStats_RegionShift);
+
+  lock(st);
+
+  if(index >= st->numRegions)
+  {
+    /* Room for a few more, as reads tend to go on across the disk */
+    count = index + 16;
+    st->regions = (stats_region*)reallocf(st->regions, count * sizeof(stats_region));
+    memset(st->regions + st->numRegions, 0, 
+           (count - st->numRegions) * sizeof(stats_region));
+    st->numRegions = count;
+  }
+
+  region = st->regions + index;
+  region->reads++;
+  region->time += time;
+
+  if(num == -1)
+    region->errors++;
+  else
+    region->bytes += num;
+
+  if(time > region->slowest)
+    region->slowest = time;
+
+  unlock(st);
+}
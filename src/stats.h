@@ -0,0 +1,95 @@
+/*
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ *
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "usuals.h"
+
+/*
+ * Where the time goes and how much got done, written out as JSON so
+ * that runs can be compared. Nothing is kept until stats_init is
+ * called, and until then all of these return straight away.
+ *
+ * Phases nest, and the time in an inner phase isn't counted in the
+ * outer one. So time spent reading a parent record while working out
+ * a name counts as reading. Other threads (the writers) have their
+ * time counted on top.
+ */
+
+#define kStats_Other        0     /* Anything not below */
+#define kStats_Read         1     /* Reading the disk */
+#define kStats_Parse        2     /* Fixups and going through MFT records */
+#define kStats_Names        3     /* Working out file names and paths */
+#define kStats_Write        4     /* Writing output */
+#define kStats_Meta         5     /* Setting times and attributes */
+#define kStats_Dirs         6     /* Making directories */
+#define kStats_MaxPhase     7
+
+#define kStats_BytesRead    0
+#define kStats_BytesWritten 1
+#define kStats_Reads        2     /* Calls to read the disk */
+#define kStats_ReadErrors   3
+#define kStats_Retries      4     /* Reads tried again in smaller pieces */
+#define kStats_Records      5     /* MFT records (or raw finds) looked at */
+#define kStats_Skipped      6     /* Records that weren't rescued */
+#define kStats_Files        7
+#define kStats_Directories  8     /* Directories made */
+#define kStats_MaxCount     9
+
+/* The ways an MFT record can go, for how long each one takes */
+#define kStats_RecResident     0     /* File with data in the record */
+#define kStats_RecNonResident  1     /* File with data runs on disk */
+#define kStats_RecAttrList     2     /* File spread over more records */
+#define kStats_RecDirectory    3
+#define kStats_RecSkipped      4     /* Not rescued, for the reason given */
+#define kStats_MaxRecord       5
+
+/*
+ * Start keeping stats, written to the file (or stderr when '-') at
+ * the end, and every interval seconds when not zero. The heatmap is
+ * a CSV of how the reads went in each GiB of the disk, written at
+ * the same times. Either file can be NULL.
+ */
+void stats_init(const char* filename, const char* heatmap, uint32 interval);
+
+/* Write the final report and stop */
+void stats_finish();
+
+/* 
+ * Returns the time entered, to pass on to stats_leave. This is zero
+ * when stats aren't being kept.
+ */
+uint64 stats_enter(int phase);
+void stats_leave(int phase, uint64 entered);
+
+void stats_count(int counter, uint64 num);
+
+/* A read of the disk at pos, with the number read or -1 on error */
+void stats_read(uint64 pos, uint64 entered, int num);
+
+/*
+ * How long a record took since entered, into a histogram for its kind.
+ * The slowest few are kept with their index (or sector when found by
+ * the raw scan), data runs, bytes and the reason they were skipped.
+ */
+void stats_record(int kind, uint64 index, uint64 sector, uint64 entered,
+                  const char* reason, uint32 runs, uint64 bytes);
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,297 @@
+/* 
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ * 
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+#define _LARGEFILE_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include "usuals.h"
+#include "dircache.h"
+#include "sweep.h"
+#include "writer.h"
+#include "device.h"
+#include "stats.h"
+
+typedef struct _sweep_open
+{
+  uint32 file;
+  int fd;
+}
+sweep_open;
+
+void sweep_init(sweep* sw)
+{
+  memset(sw, 0, sizeof(*sw));
+}
+
+void sweep_clear(sweep* sw)
+{
+  uint32 i;
+
+  for(i = 0; i < sw->numFiles; i++)
+  {
+    free(sw->files[i].filename);
+    if(sw->files[i].links)
+      free(sw->files[i].links);
+  }
+
+  sw->numFiles = 0;
+  sw->_numExtents = 0;
+  sw->_memory = 0;
+}
+
+void sweep_destroy(sweep* sw)
+{
+  sweep_clear(sw);
+
+  if(sw->files)
+    free(sw->files);
+  if(sw->_extents)
+    free(sw->_extents);
+
+  memset(sw, 0, sizeof(*sw));
+}
+
+uint32 sweep_addfile(sweep* sw, uint64 parent, const fchar_t* filename)
+{
+  sweep_file* file;
+
+  if(sw->numFiles >= sw->_allocFiles)
+  {
+    sw->_allocFiles = sw->_allocFiles ? sw->_allocFiles * 2 : 0x400;
+    sw->files = (sweep_file*)reallocf(sw->files, sw->_allocFiles * sizeof(sweep_file));
+  }
+
+  file = sw->files + sw->numFiles;
+  memset(file, 0, sizeof(*file));
+  file->parent = parent;
+  file->filename = (fchar_t*)mallocf((fcslen(filename) + 1) * sizeof(fchar_t));
+  fcscpy(file->filename, filename);
+  sw->_memory += sizeof(sweep_file) + (fcslen(filename) + 1) * sizeof(fchar_t);
+
+  return sw->numFiles++;
+}
+
+void sweep_addextent(sweep* sw, uint32 file, uint64 cluster, 
+                     uint64 offset, uint64 length)
+{
+  sweep_extent* extent;
+
+  ASSERT(file < sw->numFiles);
+
+  if(length == 0)
+    return;
+
+  if(sw->_numExtents >= sw->_allocExtents)
+  {
+    sw->_allocExtents = sw->_allocExtents ? sw->_allocExtents * 2 : 0x1000;
+    sw->_extents = (sweep_extent*)reallocf(sw->_extents, 
+                                   sw->_allocExtents * sizeof(sweep_extent));
+  }
+
+  extent = sw->_extents + sw->_numExtents;
+  extent->cluster = cluster;
+  extent->offset = offset;
+  extent->length = length;
+  extent->file = file;
+  sw->_numExtents++;
+  sw->_memory += sizeof(sweep_extent);
+}
+
+size_t sweep_memory(sweep* sw)
+{
+  return sw->_memory;
+}
+
+static int compareExtents(const void* a, const void* b)
+{
+  const sweep_extent* e1 = (const sweep_extent*)a;
+  const sweep_extent* e2 = (const sweep_extent*)b;
+
+  if(e1->cluster != e2->cluster)
+    return e1->cluster < e2->cluster ? -1 : 1;
+
+  return 0;
+}
+
+static void closeFile(partitioninfo* pi, int fd)
+{
+  if(pi->writer)
+    writer_close(pi->writer, fd);
+  else
+    close(fd);
+}
+
+/* 
+ * Extents of a file are mostly near each other on the disk, so a
+ * few open files go a long way. Returns -1 when it can't be opened.
+ */
+static int openFile(sweep* sw, partitioninfo* pi, sweep_open* handles, uint32 index)
+{
+  sweep_open* slot = handles + (index % kSweep_MaxOpen);
+  sweep_file* file = sw->files + index;
+
+  if(slot->fd != -1 && slot->file == index)
+    return slot->fd;
+
+  if(file->failed)
+    return -1;
+
+  if(slot->fd != -1)
+    closeFile(pi, slot->fd);
+
+  slot->file = index;
+  slot->fd = dircache_open(pi->dirs, file->parent, file->filename, 
+                           O_BINARY | O_WRONLY, 0);
+
+  if(slot->fd == -1)
+  {
+    warn("couldn't open output file: " FC_PRINTF, file->filename);
+    file->failed = true;
+  }
+
+  return slot->fd;
+}
+
+static void writeFile(sweep* sw, partitioninfo* pi, uint32 index, int fd, 
+                      uint64 offset, byte* data, size_t len)
+{
+  uint64 entered;
+
+  if(pi->writer)
+  {
+    writer_write(pi->writer, fd, (int64)offset, data, len);
+    return;
+  }
+
+  entered = stats_enter(kStats_Write);
+  if(pwrite(fd, data, len, offset) != (int)len)
+    err(1, "couldn't write to output file: " FC_PRINTF, sw->files[index].filename);
+  stats_count(kStats_BytesWritten, len);
+  stats_leave(kStats_Write, entered);
+}
+
+/* 
+ * Read part of an extent. When the disk won't give us all of it, go 
+ * through it a cluster at a time and leave out the bad ones. The file 
+ * is already its full size, so they end up as zeros.
+ */
+static void readExtent(sweep* sw, partitioninfo* pi, uint32 index, int fd,
+                       uint64 cluster, uint64 offset, byte* buf, size_t len)
+{
+  size_t clusterSize = pi->cluster * kSectorSize;
+  size_t whole = ((len + clusterSize - 1) / clusterSize) * clusterSize;
+  size_t pos, num;
+
+  /* The disk is read in whole clusters, even for the end of a file */
+  if(device_read(pi->device, pi->direct, SECTOR_TO_BYTES(CLUSTER_TO_SECTOR(*pi, cluster)), 
+                 buf, whole) == (int)whole)
+  {
+    writeFile(sw, pi, index, fd, offset, buf, len);
+    return;
+  }
+
+  stats_count(kStats_Retries, 1);
+
+  for(pos = 0; pos < len; pos += clusterSize, cluster++)
+  {
+    num = min(clusterSize, len - pos);
+
+    if(device_read(pi->device, pi->direct, SECTOR_TO_BYTES(CLUSTER_TO_SECTOR(*pi, cluster)), 
+                   buf, clusterSize) != (int)clusterSize)
+    {
+      warn("couldn't read sector from disk");
+      continue;
+    }
+
+    writeFile(sw, pi, index, fd, offset + pos, buf, num);
+  }
+}
+
+void sweep_run(sweep* sw, partitioninfo* pi)
+{
+  sweep_open handles[kSweep_MaxOpen];
+  sweep_extent* extent;
+  uint64 done;
+  uint64 pos;
+  size_t clusterSize = pi->cluster * kSectorSize;
+  size_t readSize;
+  size_t len;
+  byte* buf;
+  uint32 ahead;
+  uint32 i;
+  int fd;
+
+  if(sw->_numExtents == 0)
+    return;
+
+  fprintf(stderr, "[Reading file data in disk order...]\n");
+
+  qsort(sw->_extents, sw->_numExtents, sizeof(sweep_extent), compareExtents);
+
+  for(i = 0; i < kSweep_MaxOpen; i++)
+    handles[i].fd = -1;
+
+  /* Extents are read in whole clusters */
+  readSize = max(pi->io.readSize / clusterSize, 1) * clusterSize;
+  buf = (byte*)device_alloc(readSize);
+
+  for(i = 0, ahead = 0; i < sw->_numExtents; i++)
+  {
+    /* The disk can get on with the next few while this one is copied */
+    for(; ahead < sw->_numExtents && ahead <= i + pi->io.ahead; ahead++)
+    {
+      extent = sw->_extents + ahead;
+      if(pi->io.ahead == 0)
+        continue;
+
+      /* Asking for too much just pushes out what we asked for earlier */
+      pos = SECTOR_TO_BYTES(CLUSTER_TO_SECTOR(*pi, extent->cluster));
+      device_advise(pi->device, pi->direct, pos, 
+                    min(extent->length, (uint64)readSize * pi->io.ahead), kDevice_WillNeed);
+    }
+
+    extent = sw->_extents + i;
+    pos = SECTOR_TO_BYTES(CLUSTER_TO_SECTOR(*pi, extent->cluster));
+
+    fd = openFile(sw, pi, handles, extent->file);
+    if(fd == -1)
+      continue;
+
+    for(done = 0; done < extent->length; done += len)
+    {
+      len = readSize;
+      if(extent->length - done < len)
+        len = (size_t)(extent->length - done);
+
+      readExtent(sw, pi, extent->file, fd, 
+                 extent->cluster + done / (pi->cluster * kSectorSize), 
+                 extent->offset + done, buf, len);
+    }
+
+    device_advise(pi->device, pi->direct, pos, extent->length, kDevice_DontNeed);
+  }
+
+  for(i = 0; i < kSweep_MaxOpen; i++)
+  {
+    if(handles[i].fd != -1)
+      closeFile(pi, handles[i].fd);
+  }
+
+  device_free(buf);
+}
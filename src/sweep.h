@@ -0,0 +1,97 @@
+/* 
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ * 
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+#ifndef __SWEEP_H__
+#define __SWEEP_H__
+
+#include "drive.h"
+
+/*
+ * With the MFT we can read file data in the order it's on the disk
+ * rather than a file at a time. Files get created and their extents
+ * noted as records are processed, then the extents are sorted and
+ * read in one pass over the disk.
+ */
+
+/* How many output files are kept open at once */
+#define kSweep_MaxOpen      0x40
+
+struct _filelink;
+
+typedef struct _sweep_file
+{
+  uint64 parent;              /* Directory the file was created in */
+  fchar_t* filename;          /* Name it was created with */
+  bool failed;                /* Couldn't be opened to write to */
+
+  /* Set once the file is complete, until then just the data is written */
+  bool meta;
+  uint64 created;
+  uint64 modified;
+  uint64 accessed;
+  uint32 flags;
+  struct _filelink* links;    /* Other names to link once written */
+  uint32 numLinks;
+}
+sweep_file;
+
+typedef struct _sweep_extent
+{
+  uint64 cluster;             /* Where the data is on the disk */
+  uint64 offset;              /* Where it goes in the file */
+  uint64 length;              /* Length in bytes */
+  uint32 file;
+}
+sweep_extent;
+
+typedef struct _sweep
+{
+  sweep_file* files;
+  uint32 numFiles;
+  uint32 _allocFiles;
+
+  sweep_extent* _extents;
+  uint32 _numExtents;
+  uint32 _allocExtents;
+
+  size_t _memory;             /* Taken by the files and extents noted */
+}
+sweep;
+
+void sweep_init(sweep* sw);
+void sweep_destroy(sweep* sw);
+
+/* Add a file that's been created. Returns its index */
+uint32 sweep_addfile(sweep* sw, uint64 parent, const fchar_t* filename);
+
+/* Note some data for a file, to be read later */
+void sweep_addextent(sweep* sw, uint32 file, uint64 cluster, 
+                     uint64 offset, uint64 length);
+
+/* Read all the extents in disk order, writing them into their files */
+void sweep_run(sweep* sw, partitioninfo* pi);
+
+/* 
+ * How much memory the files and extents noted take. When that gets 
+ * too much they're read and cleared, and the next lot noted.
+ */
+size_t sweep_memory(sweep* sw);
+void sweep_clear(sweep* sw);
+
+#endif /* __SWEEP_H__ */
@@ -2,61 +2,128 @@
 #include "usuals.h"
 #include "ntfs.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define UNICODE_REPLACEMENT   0xFFFD
+
+#define IS_HIGH_SURROGATE(c)  ((c) >= 0xD800 && (c) <= 0xDBFF)
+#define IS_LOW_SURROGATE(c)   ((c) >= 0xDC00 && (c) <= 0xDFFF)
+
 /*
- * Transcode UCS2 to UTF8. 
+ * Transcode UTF-16 to UTF-8 into the caller's buffer.
  *
- * Since the nature of the transformation is that the 
- * resulting length is unpredictable, this function
- * allocates it's own memory.
+ * Output stops before a character that won't fit, so the result
+ * is always valid UTF-8 and null terminated. Returns the length
+ * written, not including the null.
  */
-char* unicode_transcode16to8(const ntfs_char* src, size_t len)
+size_t unicode_transcode16to8(const ntfs_char* src, size_t len, char* out, size_t outlen)
 {
-  char* ret = NULL;
-  size_t alloc = 0;
+  const uint16* c = (const uint16*)src;
+  const uint16* e = c + len;
   size_t pos = 0;
-  const ntfs_char* c;
-  const ntfs_char* e;
+  uint32 cp;
+  uint64 w;
 
-  /* Allocate 1.25 times the length initially */
-  alloc = len + (len / 4) + 1;
-  ret = (char*)mallocf(alloc * sizeof(char));
+  ASSERT(outlen > 0);
 
-  c = src;
-  e = c + len;
+  /* Leave room for the null */
+  outlen--;
 
-  for( ; c < e; c++)
+  while(c < e)
   {
-    /* Make sure we have enough memory */
-    if(pos + 4 >= alloc)
+    /* 
+     * Most names are all ASCII, so blocks of those are just
+     * narrowed without looking at each character.
+     */
+#ifdef __SSE2__
+    while(e - c >= 8 && outlen - pos >= 8)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i*)c);
+      if(_mm_movemask_epi8(_mm_cmpeq_epi16(
+              _mm_and_si128(v, _mm_set1_epi16((short)0xFF80)), 
+              _mm_setzero_si128())) != 0xFFFF)
+        break;
+
+      _mm_storel_epi64((__m128i*)(out + pos), _mm_packus_epi16(v, v));
+      c += 8;
+      pos += 8;
+    }
+#endif
+
+    while(e - c >= 4 && outlen - pos >= 4)
+    {
+      memcpy(&w, c, sizeof(w));
+      if(w & 0xFF80FF80FF80FF80ULL)
+        break;
+
+      out[pos++] = (char)c[0];
+      out[pos++] = (char)c[1];
+      out[pos++] = (char)c[2];
+      out[pos++] = (char)c[3];
+      c += 4;
+    }
+
+    if(c >= e)
+      break;
+
+    cp = *c++;
+
+    /* Surrogate pairs make up one character */
+    if(IS_HIGH_SURROGATE(cp))
     {
-      alloc += (len / 2) + 1;
-      ret = (char*)reallocf(ret, alloc * sizeof(char));
+      if(c < e && IS_LOW_SURROGATE(*c))
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (*c++ - 0xDC00);
+      else
+        cp = UNICODE_REPLACEMENT;
+    }
+    else if(IS_LOW_SURROGATE(cp))
+    {
+      cp = UNICODE_REPLACEMENT;
     }
 
     /* Encode as one character */
-    if(*c <= 0x007F)
+    if(cp <= 0x007F)
     {
-      ret[pos++] = (char)*c;
+      if(pos + 1 > outlen)
+        break;
+      out[pos++] = (char)cp;
     }
 
     /* Encode as two characters */
-    else if(*c <= 0x07FF)
+    else if(cp <= 0x07FF)
     {
-      ret[pos++] = (char)(192 | (*c >> 6));
-      ret[pos++] = (char)(128 | (*c & 63));
+      if(pos + 2 > outlen)
+        break;
+      out[pos++] = (char)(0xC0 | (cp >> 6));
+      out[pos++] = (char)(0x80 | (cp & 0x3F));
     }
 
     /* Encode as three characters */
-    else 
+    else if(cp <= 0xFFFF)
     {
-      ret[pos++] = (char)(224 | (*c >> 12));
-      ret[pos++] = (char)(128 | ((*c >> 6) & 63));
-      ret[pos++] = (char)(128 | (*c & 63));
+      if(pos + 3 > outlen)
+        break;
+      out[pos++] = (char)(0xE0 | (cp >> 12));
+      out[pos++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+      out[pos++] = (char)(0x80 | (cp & 0x3F));
+    }
+
+    /* Encode as four characters */
+    else
+    {
+      if(pos + 4 > outlen)
+        break;
+      out[pos++] = (char)(0xF0 | (cp >> 18));
+      out[pos++] = (char)(0x80 | ((cp >> 12) & 0x3F));
+      out[pos++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+      out[pos++] = (char)(0x80 | (cp & 0x3F));
     }
   }
 
-  ret[pos] = 0;
-  return ret;
+  out[pos] = 0;
+  return pos;
 }
 
 /*
@@ -82,17 +149,29 @@ ntfs_char* unicode_transcode8to16(const char* src, ntfs_char* out, size_t len)
        be using the same or less number of output characters 
        than input chars. That's just the nature of the encoding. */
     
-    /* First 4 bits set */
+    /* First 4 bits set, becomes a surrogate pair */
     if((c + 3) < e && 
        (c[0] & 0xF8) == 0xF0 && 
        (c[1] & 0xC0) == 0x80 &&
        (c[2] & 0xC0) == 0x80 &&
        (c[3] & 0xC0) == 0x80)
     {
-      out[pos++] = (ntfs_char)(((ntfs_char)c[0] & 7) << 18 |
-                             ((ntfs_char)c[1] & 63) << 12 |
-                             ((ntfs_char)c[2] & 63) << 6 |
-                             ((ntfs_char)c[3] & 63));
+      uint32 cp = ((uint32)c[0] & 7) << 18 |
+                  ((uint32)c[1] & 63) << 12 |
+                  ((uint32)c[2] & 63) << 6 |
+                  ((uint32)c[3] & 63);
+
+      if(cp < 0x10000 || cp > 0x10FFFF)
+      {
+        out[pos++] = L'?';
+      }
+      else
+      {
+        cp -= 0x10000;
+        out[pos++] = (ntfs_char)(0xD800 | (cp >> 10));
+        out[pos++] = (ntfs_char)(0xDC00 | (cp & 0x3FF));
+      }
+
       c += 3;
     }
 
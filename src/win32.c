@@ -18,10 +18,14 @@
  */
 
 #define WIN32_LEAN_AND_MEAN 1
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600   /* For SetFileInformationByHandle */
+#endif
 #include <windows.h>
 
 #include "usuals.h"
 #include "ntfs.h"
+#include "stats.h"
 
 const char kDriveName[] = "\\\\.\\PhysicalDrive%d";
 
@@ -33,20 +37,34 @@ void makeDriveName(char* driveName, int i)
   wsprintf(driveName, kDriveName, i);
 }
 
-void setFileTime(fchar_t* filename, uint64* created, 
-                  uint64* accessed, uint64* modified)
+static void applyFileTime(int fd, fchar_t* filename, uint64* created, 
+                          uint64* accessed, uint64* modified)
 {
   FILETIME ftcr;
   FILETIME ftac;
   FILETIME ftmd;
   HANDLE file;
 
+  /* Use the open file when we have one */
+  if(fd != -1)
+    file = (HANDLE)_get_osfhandle(fd);
+  else
+    file = INVALID_HANDLE_VALUE;
+
   ntfs_makefiletime(*created, ftcr);
 	ntfs_makefiletime(*accessed, ftac);
 	ntfs_makefiletime(*modified, ftmd);
 
-	/* Write to the File */
-	file = CreateFileW(filename, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+  if(file != INVALID_HANDLE_VALUE)
+  {
+    if(!SetFileTime(file, &ftcr, &ftac, &ftmd))
+      warnx("couldn't set file time: " FC_PRINTF, filename);
+    return;
+  }
+
+	/* Write to the File. Backup semantics lets us open directories */
+	file = CreateFileW(filename, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 
+                     FILE_FLAG_BACKUP_SEMANTICS, NULL);
   if(file == INVALID_HANDLE_VALUE)
   {
     warnx("couldn't set file time: " FC_PRINTF, filename);
@@ -59,9 +77,11 @@ void setFileTime(fchar_t* filename, uint64* created,
   CloseHandle(file);
 }
 
-void setFileAttributes(fchar_t* filename, uint32 flags)
+static void applyFileAttributes(int fd, fchar_t* filename, uint32 flags)
 {
-  DWORD attributes;
+  DWORD attributes = 0;
+  FILE_BASIC_INFO info;
+  HANDLE file;
 
   /* Attributes */
 	if(flags & kNTFS_FileReadOnly)
@@ -73,6 +93,64 @@ void setFileAttributes(fchar_t* filename, uint32 flags)
   if(flags & kNTFS_FileSystem)
 		attributes |= FILE_ATTRIBUTE_SYSTEM;
 
+  if(attributes == 0)
+    attributes = FILE_ATTRIBUTE_NORMAL;
+
+  /* 
+   * Files are named relative to their directory, so go through the 
+   * open file. Zero times in the info are left as they are.
+   */
+  if(fd != -1)
+  {
+    memset(&info, 0, sizeof(info));
+    info.FileAttributes = attributes;
+
+    file = (HANDLE)_get_osfhandle(fd);
+    if(file == INVALID_HANDLE_VALUE ||
+       !SetFileInformationByHandle(file, FileBasicInfo, &info, sizeof(info)))
+      warnx("couldn't set file attributes: " FC_PRINTF, filename);
+    return;
+  }
+
+  /* Without a handle, the name is a full path (ie: for directories) */
   if(!SetFileAttributesW(filename, attributes))
     warnx("couldn't set file attributes: " FC_PRINTF, filename);
 }
+
+void setFileTime(int fd, fchar_t* filename, uint64* created, 
+                  uint64* accessed, uint64* modified)
+{
+  uint64 entered = stats_enter(kStats_Meta);
+  applyFileTime(fd, filename, created, accessed, modified);
+  stats_leave(kStats_Meta, entered);
+}
+
+void setFileAttributes(int fd, fchar_t* filename, uint32 flags)
+{
+  uint64 entered = stats_enter(kStats_Meta);
+  applyFileAttributes(fd, filename, flags);
+  stats_leave(kStats_Meta, entered);
+}
+
+int fc_link(const fchar_t* from, const fchar_t* to)
+{
+  if(CreateHardLinkW(to, from, NULL))
+    return 0;
+
+  switch(GetLastError())
+  {
+  case ERROR_ALREADY_EXISTS:
+  case ERROR_FILE_EXISTS:
+    errno = EEXIST;
+    break;
+  case ERROR_PATH_NOT_FOUND:
+  case ERROR_FILE_NOT_FOUND:
+    errno = ENOENT;
+    break;
+  default:
+    errno = EPERM;
+    break;
+  }
+
+  return -1;
+}
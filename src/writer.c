@@ -0,0 +1,481 @@
+/* 
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ * 
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+#define _LARGEFILE_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include "usuals.h"
+#include "scrounge.h"
+#include "writer.h"
+#include "stats.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+typedef struct _writer_meta
+{
+  fchar_t filename[MAX_PATH + 1];
+  uint64 created;
+  uint64 accessed;
+  uint64 modified;
+  uint32 flags;
+}
+writer_meta;
+
+typedef struct _writer_item
+{
+  struct _writer_item* next;
+  int fd;
+  int64 offset;             /* -1 to write after the last write */
+  byte* data;
+  size_t len;
+  size_t alloc;
+  writer_meta* meta;        /* Times and attributes to set */
+  bool close;               /* Close the file when done */
+  bool busy;                /* Being written, nothing more goes on it */
+}
+writer_item;
+
+typedef struct _writer_queue
+{
+  writer_item* first;
+  writer_item* last;
+  struct _writer_state* state;
+  bool idle;                /* The thread is waiting to be woken */
+  uint32 held;              /* Items queued since, not yet woken for */
+  size_t heldSize;
+#ifdef HAVE_PTHREAD_H
+  pthread_t thread;
+  pthread_cond_t ready;     /* Signalled when there's something to do */
+#endif
+}
+writer_queue;
+
+typedef struct _writer_state
+{
+  writer_queue queues[kWriter_MaxThreads];
+  size_t queued;            /* Memory held by the queues */
+  uint32 pending;           /* Items not yet done */
+  bool quit;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t lock;
+  pthread_cond_t done;      /* Signalled as items are done */
+#endif
+}
+writer_state;
+
+static void doItem(writer_item* item)
+{
+  uint64 entered;
+
+  if(item->len > 0)
+  {
+    entered = stats_enter(kStats_Write);
+
+    if((item->offset == -1 ? write(item->fd, item->data, item->len) :
+        pwrite(item->fd, item->data, item->len, item->offset)) != (int)item->len)
+    {
+      if(item->meta)
+        err(1, "couldn't write to output file: " FC_PRINTF, item->meta->filename);
+      else
+        err(1, "couldn't write to output file");
+    }
+
+    stats_count(kStats_BytesWritten, item->len);
+    stats_leave(kStats_Write, entered);
+  }
+
+  if(item->meta)
+  {
+    setFileTime(item->fd, item->meta->filename, &(item->meta->created), 
+                &(item->meta->accessed), &(item->meta->modified));
+    setFileAttributes(item->fd, item->meta->filename, item->meta->flags);
+  }
+
+  if(item->close)
+    close(item->fd);
+}
+
+static void freeItem(writer_item* item)
+{
+  if(item->data)
+    free(item->data);
+  if(item->meta)
+    free(item->meta);
+  free(item);
+}
+
+#ifdef HAVE_PTHREAD_H
+
+static void wakeQueue(writer_queue* queue)
+{
+  queue->idle = false;
+  queue->held = 0;
+  queue->heldSize = 0;
+  pthread_cond_signal(&(queue->ready));
+}
+
+/* Before waiting on the writers, make sure they're all at it */
+static void wakeAll(writer* w)
+{
+  writer_queue* queue;
+  uint32 i;
+
+  for(i = 0; i < w->numThreads; i++)
+  {
+    queue = w->_state->queues + i;
+    if(queue->idle && queue->first)
+      wakeQueue(queue);
+  }
+}
+
+static void* writerThread(void* arg)
+{
+  writer_queue* queue = (writer_queue*)arg;
+  writer_state* state = queue->state;
+  writer_item* item;
+
+  pthread_mutex_lock(&(state->lock));
+
+  for(;;)
+  {
+    if(!queue->first)
+      queue->idle = true;
+
+    while(queue->idle && !state->quit)
+      pthread_cond_wait(&(queue->ready), &(state->lock));
+
+    /* Only quit once everything is written */
+    item = queue->first;
+    if(!item)
+      break;
+
+    item->busy = true;
+    pthread_mutex_unlock(&(state->lock));
+
+    doItem(item);
+
+    pthread_mutex_lock(&(state->lock));
+
+    queue->first = item->next;
+    if(!queue->first)
+      queue->last = NULL;
+
+    state->queued -= item->alloc;
+    state->pending--;
+    pthread_cond_broadcast(&(state->done));
+
+    freeItem(item);
+  }
+
+  pthread_mutex_unlock(&(state->lock));
+  return NULL;
+}
+
+#endif
+
+void writer_init(writer* w, uint32 threads, size_t chunk, size_t limit)
+{
+#ifdef HAVE_PTHREAD_H
+  writer_state* state;
+  uint32 i;
+#endif
+
+  memset(w, 0, sizeof(*w));
+  w->chunk = chunk;
+  w->limit = limit;
+
+#ifdef HAVE_PTHREAD_H
+  if(threads == 0)
+    return;
+
+  state = (writer_state*)mallocf(sizeof(writer_state));
+  memset(state, 0, sizeof(*state));
+  pthread_mutex_init(&(state->lock), NULL);
+  pthread_cond_init(&(state->done), NULL);
+  w->_state = state;
+
+  threads = min(threads, kWriter_MaxThreads);
+  for(i = 0; i < threads; i++)
+  {
+    state->queues[i].state = state;
+    pthread_cond_init(&(state->queues[i].ready), NULL);
+
+    if(pthread_create(&(state->queues[i].thread), NULL, writerThread, 
+                      state->queues + i) != 0)
+    {
+      pthread_cond_destroy(&(state->queues[i].ready));
+      break;
+    }
+  }
+
+  /* Whatever threads we could get, or none and we write directly */
+  w->numThreads = i;
+  if(i == 0)
+    warnx("couldn't start writer threads, writing directly");
+#endif
+}
+
+void writer_destroy(writer* w)
+{
+#ifdef HAVE_PTHREAD_H
+  writer_state* state = w->_state;
+  uint32 i;
+
+  if(!state)
+    return;
+
+  pthread_mutex_lock(&(state->lock));
+  state->quit = true;
+  for(i = 0; i < w->numThreads; i++)
+    pthread_cond_signal(&(state->queues[i].ready));
+  pthread_mutex_unlock(&(state->lock));
+
+  for(i = 0; i < w->numThreads; i++)
+  {
+    pthread_join(state->queues[i].thread, NULL);
+    pthread_cond_destroy(&(state->queues[i].ready));
+  }
+
+  pthread_cond_destroy(&(state->done));
+  pthread_mutex_destroy(&(state->lock));
+  free(state);
+#endif
+
+  memset(w, 0, sizeof(*w));
+}
+
+/* 
+ * Each file always goes to the same thread so its writes stay in 
+ * order. A file handle can't be reused until its close is done, 
+ * which happens on that same thread.
+ */
+static void queueItem(writer* w, writer_item* item)
+{
+#ifdef HAVE_PTHREAD_H
+  writer_state* state = w->_state;
+  writer_queue* queue;
+
+  if(w->numThreads > 0)
+  {
+    queue = state->queues + (item->fd % w->numThreads);
+
+    pthread_mutex_lock(&(state->lock));
+
+    /* Wait for the writers to catch up */
+    while(state->queued > 0 && state->queued + item->alloc > w->limit)
+    {
+      wakeAll(w);
+      pthread_cond_wait(&(state->done), &(state->lock));
+    }
+
+    if(queue->last)
+      queue->last->next = item;
+    else
+      queue->first = item;
+    queue->last = item;
+
+    state->queued += item->alloc;
+    state->pending++;
+
+    /* 
+     * Waking a thread for each small file costs more than writing 
+     * it, so an idle thread is left until there's a batch for it.
+     */
+    if(queue->idle)
+    {
+      queue->held++;
+      queue->heldSize += item->alloc;
+      if(queue->held >= kWriter_Batch || queue->heldSize >= w->chunk)
+        wakeQueue(queue);
+    }
+
+    pthread_mutex_unlock(&(state->lock));
+    return;
+  }
+#endif
+
+  doItem(item);
+  freeItem(item);
+}
+
+static writer_item* newItem(int fd)
+{
+  writer_item* item = (writer_item*)mallocf(sizeof(writer_item));
+  memset(item, 0, sizeof(*item));
+  item->fd = fd;
+  item->offset = -1;
+  return item;
+}
+
+void writer_write(writer* w, int fd, int64 offset, const void* data, size_t len)
+{
+  writer_item* item;
+#ifdef HAVE_PTHREAD_H
+  writer_state* state = w->_state;
+  writer_queue* queue;
+  size_t grow;
+#endif
+
+  if(len == 0)
+    return;
+
+  /* Nothing to gain by copying the data */
+  if(w->numThreads == 0)
+  {
+    uint64 entered = stats_enter(kStats_Write);
+    if((offset == -1 ? write(fd, data, len) : 
+        pwrite(fd, data, len, offset)) != (int)len)
+      err(1, "couldn't write to output file");
+    stats_count(kStats_BytesWritten, len);
+    stats_leave(kStats_Write, entered);
+    return;
+  }
+
+#ifdef HAVE_PTHREAD_H
+  /* Add on to the last write to the file when it follows on */
+  queue = state->queues + (fd % w->numThreads);
+
+  pthread_mutex_lock(&(state->lock));
+
+  item = queue->last;
+  if(item && !item->busy && item->fd == fd && item->data &&
+     !item->meta && !item->close && item->len + len <= w->chunk &&
+     (offset == -1 ? item->offset == -1 : 
+        (item->offset != -1 && item->offset + (int64)item->len == offset)))
+  {
+    /* 
+     * Only writes that get followed on grow towards a whole chunk, 
+     * so a small file is just charged for what it is.
+     */
+    if(item->alloc - item->len < len)
+    {
+      grow = min(max(item->alloc * 2, item->len + len), w->chunk) - item->alloc;
+      item->data = (byte*)reallocf(item->data, item->alloc + grow);
+      item->alloc += grow;
+      state->queued += grow;
+    }
+
+    memcpy(item->data + item->len, data, len);
+    item->len += len;
+    pthread_mutex_unlock(&(state->lock));
+    return;
+  }
+
+  pthread_mutex_unlock(&(state->lock));
+#endif
+
+  item = newItem(fd);
+  item->offset = offset;
+  item->alloc = len;
+  item->data = (byte*)mallocf(item->alloc);
+  memcpy(item->data, data, len);
+  item->len = len;
+
+  queueItem(w, item);
+}
+
+/* 
+ * Finishing a file is done along with its last write when that's 
+ * still waiting, rather than waking a thread up again for it.
+ */
+static bool closeLast(writer* w, int fd, writer_meta* meta)
+{
+#ifdef HAVE_PTHREAD_H
+  writer_state* state = w->_state;
+  writer_item* item;
+  bool ret = false;
+
+  if(w->numThreads == 0)
+    return false;
+
+  pthread_mutex_lock(&(state->lock));
+
+  item = state->queues[fd % w->numThreads].last;
+  if(item && !item->busy && item->fd == fd && !item->meta && !item->close)
+  {
+    item->meta = meta;
+    item->close = true;
+    ret = true;
+  }
+
+  pthread_mutex_unlock(&(state->lock));
+  return ret;
+#else
+  return false;
+#endif
+}
+
+void writer_finish(writer* w, int fd, const fchar_t* filename, uint64* created, 
+                   uint64* accessed, uint64* modified, uint32 flags)
+{
+  writer_meta* meta;
+  writer_item* item;
+
+  meta = (writer_meta*)mallocf(sizeof(writer_meta));
+  fcsncpy(meta->filename, filename, MAX_PATH);
+  meta->filename[MAX_PATH] = 0;
+  meta->created = *created;
+  meta->accessed = *accessed;
+  meta->modified = *modified;
+  meta->flags = flags;
+
+  if(closeLast(w, fd, meta))
+    return;
+
+  item = newItem(fd);
+  item->meta = meta;
+  item->close = true;
+  queueItem(w, item);
+}
+
+void writer_close(writer* w, int fd)
+{
+  writer_item* item;
+
+  if(w->numThreads == 0)
+  {
+    close(fd);
+    return;
+  }
+
+  if(closeLast(w, fd, NULL))
+    return;
+
+  item = newItem(fd);
+  item->close = true;
+  queueItem(w, item);
+}
+
+void writer_flush(writer* w)
+{
+#ifdef HAVE_PTHREAD_H
+  writer_state* state = w->_state;
+
+  if(w->numThreads == 0)
+    return;
+
+  pthread_mutex_lock(&(state->lock));
+  wakeAll(w);
+  while(state->pending > 0)
+    pthread_cond_wait(&(state->done), &(state->lock));
+  pthread_mutex_unlock(&(state->lock));
+#endif
+}
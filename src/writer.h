@@ -0,0 +1,67 @@
+/* 
+ * AUTHOR
+ * Stef Walter
+ *
+ * LICENSE
+ * This software is in the public domain.
+ *
+ * The software is provided "as is", without warranty of any kind,
+ * express or implied, including but not limited to the warranties
+ * of merchantability, fitness for a particular purpose, and
+ * noninfringement. In no event shall the author(s) be liable for any
+ * claim, damages, or other liability, whether in an action of
+ * contract, tort, or otherwise, arising from, out of, or in connection
+ * with the software or the use or other dealings in the software.
+ * 
+ * SUPPORT
+ * Send bug reports to: <stef@memberwebs.com>
+ */
+
+#ifndef __WRITER_H__
+#define __WRITER_H__
+
+#include "usuals.h"
+
+/*
+ * Output files can be written behind our backs by other threads, so
+ * that reading the disk doesn't wait on a slow destination. Writes 
+ * are queued (up to a limit) and done in order for each file. Without 
+ * threads everything is written straight away.
+ */
+
+/* Most writer threads there can be */
+#define kWriter_MaxThreads  16
+
+/* Items queued for an idle thread before it's woken */
+#define kWriter_Batch       0x20
+
+struct _writer_state;
+
+typedef struct _writer
+{
+  uint32 numThreads;        /* When zero writes aren't queued */
+  size_t chunk;             /* Small writes are gathered into pieces this big */
+  size_t limit;             /* Memory allowed for queued data */
+  struct _writer_state* _state;
+}
+writer;
+
+void writer_init(writer* w, uint32 threads, size_t chunk, size_t limit);
+
+/* Waits for everything to be written first */
+void writer_destroy(writer* w);
+
+/* Write to a file, at the given offset or after the last write when -1 */
+void writer_write(writer* w, int fd, int64 offset, const void* data, size_t len);
+
+/* Once written, set the times and attributes of a file and close it */
+void writer_finish(writer* w, int fd, const fchar_t* filename, uint64* created, 
+                   uint64* accessed, uint64* modified, uint32 flags);
+
+/* Close a file once everything has been written to it */
+void writer_close(writer* w, int fd);
+
+/* Wait until everything queued has been written */
+void writer_flush(writer* w);
+
+#endif /* __WRITER_H__ */